@@ -1,31 +1,859 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <limits.h>
 #include <string.h>
+#include <strings.h>
+#include <ctype.h>
 #include <time.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <arpa/inet.h>
 #include <sqlite3.h>
+#include <zlib.h>
 #include <openssl/sha.h>
 #include <openssl/rand.h>
 #include <openssl/evp.h>
+#include <openssl/hmac.h>
+#include <openssl/crypto.h>
+#include <openssl/params.h>
 
 #define MAX_NAME 100
 #define MAX_ADDRESS 200
 #define SALT_LEN 32
 #define ITERATIONS 10000
+#define BUSY_TIMEOUT_MS 5000
 
 typedef enum { ADMIN} Role;
 
-sqlite3 *db;
+// Each thread works on its own connection; the main thread's is opened by init_db()
+_Thread_local sqlite3 *db;
 char *DB_NAME = "national_id.db";
 
+// ================== RECORD ENCODING ==================
+// Citizens are stored with an integer NID, DOB as a YYYYMMDD integer and gender
+// and blood group as small codes; these convert between the stored and the
+// displayed forms. Code 0 means missing or unrecognised.
+const char *valid_blood_groups[] = {"A+", "A-", "B+", "B-", "O+", "O-", "AB+", "AB-", NULL};
+const char *genders[] = {"", "Male", "Female", "Other", NULL};
+
+// Accepts up to 18 digits; anything else cannot be a stored NID
+int nid_key(const char *nid, sqlite3_int64 *key) {
+    size_t len = strlen(nid);
+    if (len == 0 || len > 18 || strspn(nid, "0123456789") != len) {
+        return 0;
+    }
+    *key = strtoll(nid, NULL, 10);
+    return 1;
+}
+
+void format_nid(sqlite3_int64 key, char *out) {
+    snprintf(out, 20, "%010lld", (long long)key);
+}
+
+// Writes the stored spelling of nid ("12345" -> "0000012345") to out (20 bytes);
+// 0 when nid cannot be a stored NID
+int canonical_nid(const char *nid, char *out) {
+    sqlite3_int64 key;
+    if (!nid_key(nid, &key)) {
+        return 0;
+    }
+    format_nid(key, out);
+    return 1;
+}
+
+// "DD-MM-YYYY" to YYYYMMDD, or 0 when it does not parse
+int dob_key(const char *dob) {
+    int day, month, year;
+    if (sscanf(dob, "%d-%d-%d", &day, &month, &year) != 3 || day < 1 || day > 31 ||
+        month < 1 || month > 12 || year < 1 || year > 9999) {
+        return 0;
+    }
+    return year * 10000 + month * 100 + day;
+}
+
+void format_dob(int key, char *out) {
+    if (key <= 0) {
+        out[0] = '\0';
+        return;
+    }
+    snprintf(out, 11, "%02u-%02u-%04u", (unsigned)(key % 100) % 100u, (unsigned)(key / 100 % 100) % 100u,
+             (unsigned)(key / 10000) % 10000u);
+}
+
+// Case-insensitive, and M/F are accepted as short forms
+int gender_code(const char *gender) {
+    for (int i = 1; genders[i] != NULL; i++) {
+        if (strcasecmp(gender, genders[i]) == 0 || (gender[0] && !gender[1] && toupper((unsigned char)gender[0]) == genders[i][0])) {
+            return i;
+        }
+    }
+    return 0;
+}
+
+int blood_code(const char *blood_group) {
+    for (int i = 0; valid_blood_groups[i] != NULL; i++) {
+        if (strcmp(blood_group, valid_blood_groups[i]) == 0) {
+            return i + 1;
+        }
+    }
+    return 0;
+}
+
+const char *gender_name(int code) {
+    return code > 0 && code < (int)(sizeof(genders) / sizeof(genders[0])) - 1 ? genders[code] : "";
+}
+
+const char *blood_group_name(int code) {
+    return code > 0 && code < (int)(sizeof(valid_blood_groups) / sizeof(valid_blood_groups[0])) ? valid_blood_groups[code - 1] : "";
+}
+
+// ================== LATENCY HISTOGRAM ==================
+// Log-linear buckets: 16 per power of two, so any recorded latency is reported
+// within about 6% of its true value from a fixed-size table of counters.
+#define HIST_SUB_BITS 4
+#define HIST_SUB_COUNT (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS (64 * HIST_SUB_COUNT)
+
+typedef struct {
+    uint64_t counts[HIST_BUCKETS];
+    uint64_t total;
+    uint64_t sum_ns;
+    uint64_t max_ns;
+} Histogram;
+
+int hist_index(uint64_t ns) {
+    if (ns < HIST_SUB_COUNT) {
+        return (int)ns;
+    }
+    int shift = 63 - __builtin_clzll(ns) - HIST_SUB_BITS;
+    return ((shift + 1) << HIST_SUB_BITS) + (int)((ns >> shift) & (HIST_SUB_COUNT - 1));
+}
+
+// Midpoint of a bucket's range
+uint64_t hist_value(int index) {
+    if (index < HIST_SUB_COUNT) {
+        return (uint64_t)index;
+    }
+    int shift = (index >> HIST_SUB_BITS) - 1;
+    uint64_t low = (uint64_t)(HIST_SUB_COUNT + (index & (HIST_SUB_COUNT - 1))) << shift;
+    return low + ((1ULL << shift) >> 1);
+}
+
+// Safe to call from several threads at once
+void hist_record(Histogram *h, uint64_t ns) {
+    __atomic_fetch_add(&h->counts[hist_index(ns)], 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&h->total, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&h->sum_ns, ns, __ATOMIC_RELAXED);
+    uint64_t max = __atomic_load_n(&h->max_ns, __ATOMIC_RELAXED);
+    while (ns > max && !__atomic_compare_exchange_n(&h->max_ns, &max, ns, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+uint64_t hist_percentile(const Histogram *h, double p) {
+    uint64_t total = __atomic_load_n(&h->total, __ATOMIC_RELAXED);
+    if (total == 0) {
+        return 0;
+    }
+    uint64_t rank = (uint64_t)(p * total + 0.999999);
+    if (rank < 1) rank = 1;
+    uint64_t seen = 0;
+    for (int i = 0; i < HIST_BUCKETS; i++) {
+        seen += __atomic_load_n(&h->counts[i], __ATOMIC_RELAXED);
+        if (seen >= rank) {
+            uint64_t value = hist_value(i);
+            return value < h->max_ns ? value : h->max_ns;
+        }
+    }
+    return h->max_ns;
+}
+
+// ================== METRICS ==================
+// Operation and statement timings, lock waits and page-cache counters are kept in
+// relaxed atomics and only formatted when a report is requested, so collection
+// stays on under production load.
+#define METRICS_PUBLISH_EVERY 64
+
+typedef enum {
+    OP_REGISTER,
+    OP_VIEW,
+    OP_SEARCH,
+    OP_UPDATE,
+    OP_DELETE,
+    OP_AUDIT,
+    OP_QUERY,
+    OP_LOGIN,
+    OP_PBKDF2,
+    OP_COUNT
+} OpId;
+
+typedef struct {
+    const char *name;
+    Histogram hist;
+} OpMetric;
+
+OpMetric operations[OP_COUNT] = {
+    [OP_REGISTER] = {"register"},
+    [OP_VIEW]     = {"view"},
+    [OP_SEARCH]   = {"search"},
+    [OP_UPDATE]   = {"update"},
+    [OP_DELETE]   = {"delete"},
+    [OP_AUDIT]    = {"audit"},
+    [OP_QUERY]    = {"query"},
+    [OP_LOGIN]    = {"login"},
+    [OP_PBKDF2]   = {"pbkdf2"},
+};
+
+// Lock waits from the busy handler, and page-cache counters folded in from every connection
+struct {
+    uint64_t lock_waits;
+    uint64_t lock_wait_ns;
+    uint64_t lock_timeouts;
+    uint64_t cache_hits;
+    uint64_t cache_misses;
+    uint64_t cache_writes;
+    uint64_t cache_spills;
+} db_counters;
+
+_Thread_local unsigned publish_countdown;
+
+long long now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+void op_record(OpId id, long long started_ns) {
+    hist_record(&operations[id].hist, now_ns() - started_ns);
+}
+
+// Same schedule as sqlite3_busy_timeout(), but every wait is counted
+int busy_wait(void *arg, int attempt) {
+    static const int delays_ms[] = {1, 2, 5, 10, 15, 20, 25, 25, 25, 50, 50, 100};
+    const int steps = sizeof(delays_ms) / sizeof(delays_ms[0]);
+    (void)arg;
+    int waited = 0;
+    for (int i = 0; i < attempt && i < steps; i++) waited += delays_ms[i];
+    if (attempt >= steps) waited += (attempt - steps) * delays_ms[steps - 1];
+    int delay = attempt < steps ? delays_ms[attempt] : delays_ms[steps - 1];
+    if (waited + delay > BUSY_TIMEOUT_MS) {
+        delay = BUSY_TIMEOUT_MS - waited;
+        if (delay <= 0) {
+            __atomic_fetch_add(&db_counters.lock_timeouts, 1, __ATOMIC_RELAXED);
+            return 0;
+        }
+    }
+    if (attempt == 0) __atomic_fetch_add(&db_counters.lock_waits, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&db_counters.lock_wait_ns, (uint64_t)delay * 1000000, __ATOMIC_RELAXED);
+    usleep(delay * 1000);
+    return 1;
+}
+
+// Moves this connection's page-cache counters into the shared totals
+void publish_db_status(sqlite3 *conn) {
+    static const struct { int op; uint64_t *total; } counters[] = {
+        {SQLITE_DBSTATUS_CACHE_HIT, &db_counters.cache_hits},
+        {SQLITE_DBSTATUS_CACHE_MISS, &db_counters.cache_misses},
+        {SQLITE_DBSTATUS_CACHE_WRITE, &db_counters.cache_writes},
+        {SQLITE_DBSTATUS_CACHE_SPILL, &db_counters.cache_spills},
+    };
+    if (!conn) {
+        return;
+    }
+    for (size_t i = 0; i < sizeof(counters) / sizeof(counters[0]); i++) {
+        int current = 0, highwater = 0;
+        if (sqlite3_db_status(conn, counters[i].op, &current, &highwater, 1) == SQLITE_OK && current > 0) {
+            __atomic_fetch_add(counters[i].total, (uint64_t)current, __ATOMIC_RELAXED);
+        }
+    }
+}
+
+// ================== FIELD ENCRYPTION ==================
+// With NID_DATA_KEY set (64 hex digits), the free-text PII columns (name,
+// address, father and mother name) are stored as AES-256-GCM blobs:
+//   version (1) | nonce (12) | ciphertext | tag (16)
+// authenticated with the NID and column number, so a value cannot be moved to
+// another row or field. Exact-match lookups on the names go through blind
+// indexes: a truncated HMAC-SHA256 of the normalised value under a separate key.
+// Each thread keeps its cipher and MAC contexts keyed once; encrypting a field
+// only sets a fresh nonce.
+#define PII_KEY_LEN 32
+#define PII_VERSION 1
+#define PII_NONCE_LEN 12
+#define PII_TAG_LEN 16
+#define PII_OVERHEAD (1 + PII_NONCE_LEN + PII_TAG_LEN)
+#define PII_MAX_TEXT 256
+#define BLIND_INDEX_LEN 16
+
+int pii_encryption;     // set once at startup, before any worker thread exists
+unsigned char pii_key[PII_KEY_LEN];
+unsigned char blind_key[PII_KEY_LEN];
+unsigned char pii_key_check[SHA256_DIGEST_LENGTH];
+
+_Thread_local EVP_CIPHER_CTX *pii_encrypt_ctx;
+_Thread_local EVP_CIPHER_CTX *pii_decrypt_ctx;
+_Thread_local EVP_MAC_CTX *blind_ctx;
+
+// Separate keys for encryption, blind indexes and the stored key check
+int pii_load_key(const char *hex) {
+    unsigned char master[PII_KEY_LEN];
+    if (strlen(hex) != PII_KEY_LEN * 2) {
+        return 0;
+    }
+    for (int i = 0; i < PII_KEY_LEN; i++) {
+        unsigned int byte;
+        if (sscanf(hex + i * 2, "%2x", &byte) != 1) return 0;
+        master[i] = (unsigned char)byte;
+    }
+    unsigned int len;
+    HMAC(EVP_sha256(), master, PII_KEY_LEN, (const unsigned char*)"nid-pii-encrypt-v1", 18, pii_key, &len);
+    HMAC(EVP_sha256(), master, PII_KEY_LEN, (const unsigned char*)"nid-pii-blind-index-v1", 22, blind_key, &len);
+    HMAC(EVP_sha256(), master, PII_KEY_LEN, (const unsigned char*)"nid-pii-key-check-v1", 20, pii_key_check, &len);
+    OPENSSL_cleanse(master, sizeof(master));
+    pii_encryption = 1;
+    return 1;
+}
+
+int pii_thread_init() {
+    if (pii_encrypt_ctx) {
+        return 1;
+    }
+    pii_encrypt_ctx = EVP_CIPHER_CTX_new();
+    pii_decrypt_ctx = EVP_CIPHER_CTX_new();
+    EVP_MAC *hmac = EVP_MAC_fetch(NULL, "HMAC", NULL);
+    blind_ctx = hmac ? EVP_MAC_CTX_new(hmac) : NULL;
+    EVP_MAC_free(hmac);
+    OSSL_PARAM params[] = {OSSL_PARAM_construct_utf8_string("digest", "SHA256", 0), OSSL_PARAM_construct_end()};
+    if (!pii_encrypt_ctx || !pii_decrypt_ctx || !blind_ctx ||
+        !EVP_EncryptInit_ex(pii_encrypt_ctx, EVP_aes_256_gcm(), NULL, pii_key, NULL) ||
+        !EVP_DecryptInit_ex(pii_decrypt_ctx, EVP_aes_256_gcm(), NULL, pii_key, NULL) ||
+        !EVP_MAC_init(blind_ctx, blind_key, PII_KEY_LEN, params)) {
+        fprintf(stderr, "Field encryption: cannot set up cipher contexts\n");
+        return 0;
+    }
+    return 1;
+}
+
+void pii_thread_free() {
+    EVP_CIPHER_CTX_free(pii_encrypt_ctx);
+    EVP_CIPHER_CTX_free(pii_decrypt_ctx);
+    EVP_MAC_CTX_free(blind_ctx);
+    pii_encrypt_ctx = pii_decrypt_ctx = NULL;
+    blind_ctx = NULL;
+}
+
+void pii_aad(sqlite3_int64 nid, int column, unsigned char aad[9]) {
+    for (int i = 0; i < 8; i++) aad[i] = (unsigned char)((uint64_t)nid >> (8 * i));
+    aad[8] = (unsigned char)column;
+}
+
+// out needs len + PII_OVERHEAD bytes. Returns the blob length, or 0 on failure.
+size_t pii_encrypt(const char *text, size_t len, sqlite3_int64 nid, int column, unsigned char *out) {
+    unsigned char aad[9];
+    int n;
+    if (!pii_thread_init()) {
+        return 0;
+    }
+    out[0] = PII_VERSION;
+    unsigned char *nonce = out + 1, *body = out + 1 + PII_NONCE_LEN;
+    pii_aad(nid, column, aad);
+    if (RAND_bytes(nonce, PII_NONCE_LEN) != 1 ||
+        !EVP_EncryptInit_ex(pii_encrypt_ctx, NULL, NULL, NULL, nonce) ||
+        !EVP_EncryptUpdate(pii_encrypt_ctx, NULL, &n, aad, sizeof(aad)) ||
+        !EVP_EncryptUpdate(pii_encrypt_ctx, body, &n, (const unsigned char*)text, (int)len) ||
+        !EVP_EncryptFinal_ex(pii_encrypt_ctx, body + len, &n) ||
+        !EVP_CIPHER_CTX_ctrl(pii_encrypt_ctx, EVP_CTRL_GCM_GET_TAG, PII_TAG_LEN, body + len)) {
+        return 0;
+    }
+    return len + PII_OVERHEAD;
+}
+
+// Writes the NUL-terminated plaintext to out. Returns its length, or -1 if the
+// blob is malformed, too long for out or fails authentication.
+int pii_decrypt(const unsigned char *blob, size_t len, sqlite3_int64 nid, int column, char *out, size_t size) {
+    unsigned char aad[9];
+    int n;
+    if (len < PII_OVERHEAD || blob[0] != PII_VERSION || len - PII_OVERHEAD >= size || !pii_thread_init()) {
+        return -1;
+    }
+    size_t text_len = len - PII_OVERHEAD;
+    const unsigned char *nonce = blob + 1, *body = blob + 1 + PII_NONCE_LEN;
+    pii_aad(nid, column, aad);
+    if (!EVP_DecryptInit_ex(pii_decrypt_ctx, NULL, NULL, NULL, nonce) ||
+        !EVP_DecryptUpdate(pii_decrypt_ctx, NULL, &n, aad, sizeof(aad)) ||
+        !EVP_DecryptUpdate(pii_decrypt_ctx, (unsigned char*)out, &n, body, (int)text_len) ||
+        !EVP_CIPHER_CTX_ctrl(pii_decrypt_ctx, EVP_CTRL_GCM_SET_TAG, PII_TAG_LEN, (void*)(body + text_len)) ||
+        EVP_DecryptFinal_ex(pii_decrypt_ctx, (unsigned char*)out + n, &n) <= 0) {
+        out[0] = '\0';
+        return -1;
+    }
+    out[text_len] = '\0';
+    return (int)text_len;
+}
+
+// Keyed hash of the value with case and runs of spaces folded, so the lookup
+// matches however the name was typed
+int blind_index(const char *text, unsigned char out[BLIND_INDEX_LEN]) {
+    char normal[PII_MAX_TEXT];
+    size_t len = 0;
+    for (const char *p = text; *p && len < sizeof(normal); p++) {
+        if (*p == ' ' || *p == '\t') {
+            if (len && normal[len - 1] != ' ') normal[len++] = ' ';
+        } else {
+            normal[len++] = (char)tolower((unsigned char)*p);
+        }
+    }
+    if (len && normal[len - 1] == ' ') len--;
+    unsigned char mac[SHA256_DIGEST_LENGTH];
+    size_t mac_len;
+    if (!pii_thread_init() || !EVP_MAC_init(blind_ctx, NULL, 0, NULL) ||
+        !EVP_MAC_update(blind_ctx, (const unsigned char*)normal, len) ||
+        !EVP_MAC_final(blind_ctx, mac, &mac_len, sizeof(mac))) {
+        return 0;
+    }
+    memcpy(out, mac, BLIND_INDEX_LEN);
+    return 1;
+}
+
+// Binds a PII column: ciphertext when encryption is on, the text otherwise
+void bind_pii(sqlite3_stmt *stmt, int index, const char *text, sqlite3_int64 nid, int column) {
+    if (!pii_encryption) {
+        sqlite3_bind_text(stmt, index, text, -1, SQLITE_STATIC);
+        return;
+    }
+    unsigned char blob[PII_MAX_TEXT + PII_OVERHEAD];
+    size_t len = strlen(text);
+    size_t blob_len = len < PII_MAX_TEXT ? pii_encrypt(text, len, nid, column, blob) : 0;
+    if (blob_len) sqlite3_bind_blob(stmt, index, blob, (int)blob_len, SQLITE_TRANSIENT);
+    else sqlite3_bind_null(stmt, index);   // fails the NOT NULL constraint rather than storing plaintext
+}
+
+// Binds a blind index, or NULL when encryption is off
+void bind_blind_index(sqlite3_stmt *stmt, int index, const char *text) {
+    unsigned char bidx[BLIND_INDEX_LEN];
+    if (pii_encryption && blind_index(text, bidx)) {
+        sqlite3_bind_blob(stmt, index, bidx, BLIND_INDEX_LEN, SQLITE_TRANSIENT);
+    } else {
+        sqlite3_bind_null(stmt, index);
+    }
+}
+
+// Text of a PII column from a citizens row, decrypting if it is stored encrypted.
+// Returns a pointer into the statement or into scratch (PII_MAX_TEXT bytes).
+const char *pii_column(sqlite3_stmt *stmt, int col, char *scratch, int *len) {
+    if (sqlite3_column_type(stmt, col) == SQLITE_BLOB) {
+        const unsigned char *blob = sqlite3_column_blob(stmt, col);
+        int n = pii_encryption ? pii_decrypt(blob, sqlite3_column_bytes(stmt, col), sqlite3_column_int64(stmt, 0),
+                                             col, scratch, PII_MAX_TEXT) : -1;
+        if (n < 0) {
+            fprintf(stderr, "Field encryption: cannot decrypt column %d of NID %lld\n", col,
+                    (long long)sqlite3_column_int64(stmt, 0));
+            scratch[0] = '\0';
+            n = 0;
+        }
+        *len = n;
+        return scratch;
+    }
+    const char *text = (const char*)sqlite3_column_text(stmt, col);
+    *len = sqlite3_column_bytes(stmt, col);
+    return text ? text : "";
+}
+
 // ================== DATABASE FUNCTIONS ==================
-int init_db() {
-    int rc = sqlite3_open(DB_NAME, &db);
+// Citizens can be spread over N shard files next to DB_NAME, by NID modulo N (the
+// settings key 'citizen_shards', changed with --rebalance). Each shard is a complete
+// database with the same schema, of which only citizens is used. Every connection
+// attaches them as shard0..shardN-1 and reads through a TEMP view named citizens,
+// which shadows the main table (empty while sharded); writes name the owning shard.
+#define DB_MAX_SHARDS 8     // SQLite attaches at most 10 files; rebalancing needs one more
+
+int db_shards = 0;          // 0: citizens live in the main file
+
+const char *shard_schemas[DB_MAX_SHARDS] = {"shard0", "shard1", "shard2", "shard3",
+                                            "shard4", "shard5", "shard6", "shard7"};
+
+// The count is part of the name, so a rebalance never writes over live files
+void shard_path(int shard, int count, char *out, size_t size) {
+    snprintf(out, size, "%s.shard-%d-of-%d", DB_NAME, shard, count);
+}
+
+int citizen_shard(sqlite3_int64 key) {
+    return db_shards ? (int)(key % db_shards) : 0;
+}
+
+// Schema that holds citizen_shard()'s citizens table
+const char *citizen_schema(int shard) {
+    return db_shards ? shard_schemas[shard] : "main";
+}
+
+// Numbers every insert, update and delete on citizens in main.citizen_changes (see
+// CHANGE FEED). They are TEMP triggers so that one sequence spans the shard files,
+// whose own triggers could not reach the main file, and every writable connection
+// creates them once the shards are attached. While sharded they also stamp the
+// number in main.commit_marks and in the shard's own commit_mark_<k>, for
+// reconcile_shards() to find writes only one of the two files kept.
+int create_change_triggers(sqlite3 *conn) {
+    // Tombstoning a citizen is its deletion; purging the tombstone is not a change
+    static const char *triggers[][3] = {
+        {"INSERT", "", "1, new.nid"},
+        {"UPDATE", "WHEN old.deleted_at IS NULL", "CASE WHEN new.deleted_at IS NULL THEN 2 ELSE 3 END, new.nid"},
+        {"DELETE", "WHEN old.deleted_at IS NULL", "3, old.nid"},
+    };
+    for (int i = 0; i < (db_shards ? db_shards : 1); i++) {
+        // A trigger names tables unqualified, so each shard's stamp has a name of its own
+        char mark[512] = "";
+        if (db_shards) {
+            char sql[160];
+            snprintf(sql, sizeof(sql), "CREATE TABLE IF NOT EXISTS %s.commit_mark_%d "
+                                       "(id INTEGER PRIMARY KEY, seq INTEGER NOT NULL);", shard_schemas[i], i);
+            if (sqlite3_exec(conn, sql, 0, 0, 0) != SQLITE_OK) {
+                fprintf(stderr, "Cannot create the commit mark of %s: %s\n", shard_schemas[i], sqlite3_errmsg(conn));
+                return 0;
+            }
+            snprintf(mark, sizeof(mark), "INSERT OR REPLACE INTO commit_marks VALUES (%d, (SELECT max(seq) FROM "
+                                         "citizen_changes), CAST(strftime('%%s', 'now') AS INTEGER)); "
+                                         "INSERT OR REPLACE INTO commit_mark_%d VALUES (0, (SELECT max(seq) FROM "
+                                         "citizen_changes)); ", i, i);
+        }
+        for (int op = 0; op < 3; op++) {
+            char sql[1024];
+            snprintf(sql, sizeof(sql), "CREATE TEMP TRIGGER IF NOT EXISTS citizen_changes_%d_%d AFTER %s ON %s.citizens %s "
+                                       "BEGIN INSERT INTO citizen_changes (op, nid, changed_at) VALUES "
+                                       "(%s, CAST(strftime('%%s', 'now') AS INTEGER)); %sEND;",
+                     i, op + 1, triggers[op][0], citizen_schema(i), triggers[op][1], triggers[op][2], mark);
+            if (sqlite3_exec(conn, sql, 0, 0, 0) != SQLITE_OK) {
+                fprintf(stderr, "Cannot create the change triggers: %s\n", sqlite3_errmsg(conn));
+                return 0;
+            }
+        }
+    }
+    return 1;
+}
+
+// For rewrites that are not changes to a citizen, such as moving or encrypting rows
+void drop_change_triggers(sqlite3 *conn) {
+    for (int i = 0; i < DB_MAX_SHARDS; i++) {
+        for (int op = 1; op <= 3; op++) {
+            char sql[64];
+            snprintf(sql, sizeof(sql), "DROP TRIGGER IF EXISTS temp.citizen_changes_%d_%d;", i, op);
+            sqlite3_exec(conn, sql, 0, 0, 0);
+        }
+    }
+}
+
+int attach_shards(sqlite3 *conn) {
+    char sql[2048];
+    for (int i = 0; i < db_shards; i++) {
+        char path[1024];
+        shard_path(i, db_shards, path, sizeof(path));
+        sqlite3_snprintf(sizeof(sql), sql, "ATTACH %Q AS %s;", path, shard_schemas[i]);
+        if (sqlite3_exec(conn, sql, 0, 0, 0) != SQLITE_OK) {
+            fprintf(stderr, "Cannot attach %s: %s\n", path, sqlite3_errmsg(conn));
+            return 0;
+        }
+    }
+    if (db_shards) {
+        size_t len = snprintf(sql, sizeof(sql), "CREATE TEMP VIEW citizens AS ");
+        for (int i = 0; i < db_shards; i++) {
+            len += snprintf(sql + len, sizeof(sql) - len, "%sSELECT * FROM %s.citizens",
+                            i ? " UNION ALL " : "", shard_schemas[i]);
+        }
+        if (sqlite3_exec(conn, sql, 0, 0, 0) != SQLITE_OK) {
+            fprintf(stderr, "Cannot create the citizens view: %s\n", sqlite3_errmsg(conn));
+            return 0;
+        }
+        // Each file counts its own rows, see citizen_stats
+        len = snprintf(sql, sizeof(sql), "CREATE TEMP VIEW citizen_stats AS SELECT * FROM main.citizen_stats");
+        for (int i = 0; i < db_shards; i++) {
+            len += snprintf(sql + len, sizeof(sql) - len, " UNION ALL SELECT * FROM %s.citizen_stats", shard_schemas[i]);
+        }
+        if (sqlite3_exec(conn, sql, 0, 0, 0) != SQLITE_OK) {
+            fprintf(stderr, "Cannot create the statistics view: %s\n", sqlite3_errmsg(conn));
+            return 0;
+        }
+    }
+    return 1;
+}
+
+void detach_shards(sqlite3 *conn) {
+    char sql[64];
+    drop_change_triggers(conn);
+    sqlite3_exec(conn, "DROP VIEW IF EXISTS temp.citizens; DROP VIEW IF EXISTS temp.citizen_stats;", 0, 0, 0);
+    for (int i = 0; i < db_shards; i++) {
+        snprintf(sql, sizeof(sql), "DETACH %s;", shard_schemas[i]);
+        sqlite3_exec(conn, sql, 0, 0, 0);
+    }
+}
+
+int open_connection(int flags) {
+    int rc = sqlite3_open_v2(DB_NAME, &db, flags | SQLITE_OPEN_NOMUTEX, NULL);
     if (rc != SQLITE_OK) {
         fprintf(stderr, "Cannot open database: %s\n", sqlite3_errmsg(db));
+        sqlite3_close(db);
+        db = NULL;
+        return 0;
+    }
+    sqlite3_busy_handler(db, busy_wait, NULL);
+    if (!attach_shards(db)) {
+        sqlite3_close(db);
+        db = NULL;
         return 0;
     }
+    return 1;
+}
+
+// Schema changes made after the original tables. Each entry runs once, in order,
+// and PRAGMA user_version records how many have been applied.
+const char *schema_migrations[] = {
+    // 1: secondary indexes and a full-text index over names and address for citizen queries
+    "CREATE INDEX IF NOT EXISTS idx_citizens_name ON citizens(name, dob);"
+    "CREATE INDEX IF NOT EXISTS idx_citizens_dob ON citizens(dob, nid);"
+    "CREATE INDEX IF NOT EXISTS idx_citizens_father ON citizens(father_name, nid);"
+    "CREATE INDEX IF NOT EXISTS idx_citizens_mother ON citizens(mother_name, nid);"
+    "CREATE INDEX IF NOT EXISTS idx_citizens_blood ON citizens(blood_group, nid);"
+    "CREATE VIRTUAL TABLE IF NOT EXISTS citizens_fts USING fts5("
+    "name, father_name, mother_name, address, content='citizens', content_rowid='rowid');"
+    "CREATE TRIGGER IF NOT EXISTS citizens_fts_insert AFTER INSERT ON citizens BEGIN "
+    "INSERT INTO citizens_fts(rowid, name, father_name, mother_name, address) "
+    "VALUES (new.rowid, new.name, new.father_name, new.mother_name, new.address); END;"
+    "CREATE TRIGGER IF NOT EXISTS citizens_fts_delete AFTER DELETE ON citizens BEGIN "
+    "INSERT INTO citizens_fts(citizens_fts, rowid, name, father_name, mother_name, address) "
+    "VALUES ('delete', old.rowid, old.name, old.father_name, old.mother_name, old.address); END;"
+    "CREATE TRIGGER IF NOT EXISTS citizens_fts_update AFTER UPDATE OF name, father_name, mother_name, address ON citizens BEGIN "
+    "INSERT INTO citizens_fts(citizens_fts, rowid, name, father_name, mother_name, address) "
+    "VALUES ('delete', old.rowid, old.name, old.father_name, old.mother_name, old.address); "
+    "INSERT INTO citizens_fts(rowid, name, father_name, mother_name, address) "
+    "VALUES (new.rowid, new.name, new.father_name, new.mother_name, new.address); END;"
+    "INSERT INTO citizens_fts(citizens_fts) VALUES ('rebuild');",
+    // 2: audit log indexes for NID/activity/time-range queries, and the catalog of
+    // monthly archive files written by --archive-audit
+    "CREATE INDEX IF NOT EXISTS idx_audit_nid_time ON audit_logs(nid, timestamp);"
+    "CREATE INDEX IF NOT EXISTS idx_audit_activity_time ON audit_logs(activity_type, timestamp);"
+    "CREATE INDEX IF NOT EXISTS idx_audit_time ON audit_logs(timestamp);"
+    "CREATE TABLE IF NOT EXISTS audit_archives ("
+    "path TEXT PRIMARY KEY,"
+    "month TEXT NOT NULL,"
+    "row_count INTEGER NOT NULL,"
+    "first_id INTEGER NOT NULL,"
+    "last_id INTEGER NOT NULL,"
+    "archived_at INTEGER NOT NULL);"
+    "CREATE INDEX IF NOT EXISTS idx_audit_archives_month ON audit_archives(month);",
+    // 3: compact citizens table clustered on an integer NID (WITHOUT ROWID), with DOB as
+    // YYYYMMDD and gender/blood group as codes; converted by the encoding functions that
+    // init_db() registers. Secondary indexes carry the NID implicitly.
+    "DROP TRIGGER IF EXISTS citizens_fts_insert;"
+    "DROP TRIGGER IF EXISTS citizens_fts_delete;"
+    "DROP TRIGGER IF EXISTS citizens_fts_update;"
+    "DROP TABLE IF EXISTS citizens_fts;"
+    "CREATE TABLE citizens_compact ("
+    "nid INTEGER PRIMARY KEY,"
+    "name TEXT NOT NULL,"
+    "dob INTEGER NOT NULL,"
+    "gender INTEGER NOT NULL,"
+    "address TEXT NOT NULL,"
+    "father_name TEXT NOT NULL,"
+    "mother_name TEXT NOT NULL,"
+    "blood_group INTEGER NOT NULL,"
+    "is_active INTEGER NOT NULL,"
+    "created_at INTEGER,"
+    "last_modified INTEGER"
+    ") WITHOUT ROWID;"
+    "INSERT INTO citizens_compact SELECT CAST(nid AS INTEGER), name, dob_key(dob), gender_code(gender), address, "
+    "father_name, mother_name, blood_code(blood_group), COALESCE(is_active, 1), created_at, last_modified FROM citizens;"
+    "DROP TABLE citizens;"
+    "ALTER TABLE citizens_compact RENAME TO citizens;"
+    "CREATE INDEX idx_citizens_name ON citizens(name, dob);"
+    "CREATE INDEX idx_citizens_dob ON citizens(dob);"
+    "CREATE INDEX idx_citizens_father ON citizens(father_name);"
+    "CREATE INDEX idx_citizens_mother ON citizens(mother_name);"
+    "CREATE INDEX idx_citizens_blood ON citizens(blood_group);"
+    "CREATE VIRTUAL TABLE citizens_fts USING fts5("
+    "name, father_name, mother_name, address, content='citizens', content_rowid='nid', detail=column);"
+    "CREATE TRIGGER citizens_fts_insert AFTER INSERT ON citizens BEGIN "
+    "INSERT INTO citizens_fts(rowid, name, father_name, mother_name, address) "
+    "VALUES (new.nid, new.name, new.father_name, new.mother_name, new.address); END;"
+    "CREATE TRIGGER citizens_fts_delete AFTER DELETE ON citizens BEGIN "
+    "INSERT INTO citizens_fts(citizens_fts, rowid, name, father_name, mother_name, address) "
+    "VALUES ('delete', old.nid, old.name, old.father_name, old.mother_name, old.address); END;"
+    "CREATE TRIGGER citizens_fts_update AFTER UPDATE OF name, father_name, mother_name, address ON citizens BEGIN "
+    "INSERT INTO citizens_fts(citizens_fts, rowid, name, father_name, mother_name, address) "
+    "VALUES ('delete', old.nid, old.name, old.father_name, old.mother_name, old.address); "
+    "INSERT INTO citizens_fts(rowid, name, father_name, mother_name, address) "
+    "VALUES (new.nid, new.name, new.father_name, new.mother_name, new.address); END;"
+    "INSERT INTO citizens_fts(citizens_fts) VALUES ('rebuild');",
+    // 4: free-form detail for audit events, e.g. the fields an update changed
+    "ALTER TABLE audit_logs ADD COLUMN details TEXT;",
+    // 5: blind indexes for exact-match lookups on encrypted names (NULL while field
+    // encryption is off, hence partial indexes) and a table for database-wide settings
+    "ALTER TABLE citizens ADD COLUMN name_bidx BLOB;"
+    "ALTER TABLE citizens ADD COLUMN father_bidx BLOB;"
+    "ALTER TABLE citizens ADD COLUMN mother_bidx BLOB;"
+    "CREATE INDEX idx_citizens_name_bidx ON citizens(name_bidx) WHERE name_bidx IS NOT NULL;"
+    "CREATE INDEX idx_citizens_father_bidx ON citizens(father_bidx) WHERE father_bidx IS NOT NULL;"
+    "CREATE INDEX idx_citizens_mother_bidx ON citizens(mother_bidx) WHERE mother_bidx IS NOT NULL;"
+    "CREATE TABLE IF NOT EXISTS settings (key TEXT PRIMARY KEY, value BLOB);",
+    // 6: blocking keys for duplicate detection (two per citizen, filled in by
+    // build_duplicate_blocks() on first start) and the queue of suspected duplicates
+    "CREATE TABLE citizen_blocks ("
+    "block INTEGER NOT NULL,"
+    "nid INTEGER NOT NULL,"
+    "PRIMARY KEY (block, nid)) WITHOUT ROWID;"
+    "CREATE INDEX idx_citizen_blocks_nid ON citizen_blocks(nid);"
+    "CREATE TABLE duplicate_reviews ("
+    "nid INTEGER NOT NULL,"
+    "candidate_nid INTEGER NOT NULL,"
+    "score REAL NOT NULL,"
+    "status TEXT NOT NULL DEFAULT 'pending',"
+    "flagged_at INTEGER NOT NULL,"
+    "reviewed_at INTEGER,"
+    "PRIMARY KEY (nid, candidate_nid)) WITHOUT ROWID;"
+    "CREATE INDEX idx_duplicate_reviews_candidate ON duplicate_reviews(candidate_nid);"
+    "CREATE INDEX idx_duplicate_reviews_pending ON duplicate_reviews(flagged_at) WHERE status = 'pending';",
+    // 7: head counts by gender, blood group, birth decade and status, kept by triggers
+    // in the same transaction as the citizens row
+    "CREATE TABLE citizen_stats ("
+    "gender INTEGER NOT NULL,"
+    "blood_group INTEGER NOT NULL,"
+    "birth_decade INTEGER NOT NULL,"
+    "is_active INTEGER NOT NULL,"
+    "count INTEGER NOT NULL,"
+    "PRIMARY KEY (gender, blood_group, birth_decade, is_active)) WITHOUT ROWID;"
+    "INSERT INTO citizen_stats SELECT gender, blood_group, dob / 100000 * 10, is_active, COUNT(*) "
+    "FROM citizens GROUP BY 1, 2, 3, 4;"
+    "CREATE TRIGGER citizen_stats_insert AFTER INSERT ON citizens BEGIN "
+    "INSERT INTO citizen_stats VALUES (new.gender, new.blood_group, new.dob / 100000 * 10, new.is_active, 1) "
+    "ON CONFLICT DO UPDATE SET count = count + 1; END;"
+    "CREATE TRIGGER citizen_stats_delete AFTER DELETE ON citizens BEGIN "
+    "UPDATE citizen_stats SET count = count - 1 WHERE gender = old.gender AND blood_group = old.blood_group "
+    "AND birth_decade = old.dob / 100000 * 10 AND is_active = old.is_active; END;"
+    "CREATE TRIGGER citizen_stats_update AFTER UPDATE OF gender, blood_group, dob, is_active ON citizens "
+    "WHEN old.gender != new.gender OR old.blood_group != new.blood_group "
+    "OR old.dob / 100000 != new.dob / 100000 OR old.is_active != new.is_active BEGIN "
+    "UPDATE citizen_stats SET count = count - 1 WHERE gender = old.gender AND blood_group = old.blood_group "
+    "AND birth_decade = old.dob / 100000 * 10 AND is_active = old.is_active; "
+    "INSERT INTO citizen_stats VALUES (new.gender, new.blood_group, new.dob / 100000 * 10, new.is_active, 1) "
+    "ON CONFLICT DO UPDATE SET count = count + 1; END;",
+    // 8: change feed for replicas; see create_change_triggers() and CHANGE FEED
+    "CREATE TABLE citizen_changes ("
+    "seq INTEGER PRIMARY KEY AUTOINCREMENT,"
+    "op INTEGER NOT NULL,"
+    "nid INTEGER NOT NULL,"
+    "changed_at INTEGER NOT NULL);"
+    "CREATE TABLE change_consumers ("
+    "name TEXT PRIMARY KEY,"
+    "acked_seq INTEGER NOT NULL,"
+    "acked_at INTEGER NOT NULL);",
+    // 9: deleting a citizen leaves a tombstone (deleted_at) until the purge removes it.
+    // Secondary indexes only cover live rows, and head counts leave tombstones out.
+    "ALTER TABLE citizens ADD COLUMN deleted_at INTEGER;"
+    "DROP INDEX IF EXISTS idx_citizens_name;"
+    "DROP INDEX IF EXISTS idx_citizens_dob;"
+    "DROP INDEX IF EXISTS idx_citizens_father;"
+    "DROP INDEX IF EXISTS idx_citizens_mother;"
+    "DROP INDEX IF EXISTS idx_citizens_blood;"
+    "DROP INDEX IF EXISTS idx_citizens_name_bidx;"
+    "DROP INDEX IF EXISTS idx_citizens_father_bidx;"
+    "DROP INDEX IF EXISTS idx_citizens_mother_bidx;"
+    "CREATE INDEX idx_citizens_name ON citizens(name, dob) WHERE deleted_at IS NULL;"
+    "CREATE INDEX idx_citizens_dob ON citizens(dob) WHERE deleted_at IS NULL;"
+    "CREATE INDEX idx_citizens_father ON citizens(father_name) WHERE deleted_at IS NULL;"
+    "CREATE INDEX idx_citizens_mother ON citizens(mother_name) WHERE deleted_at IS NULL;"
+    "CREATE INDEX idx_citizens_blood ON citizens(blood_group) WHERE deleted_at IS NULL;"
+    "CREATE INDEX idx_citizens_name_bidx ON citizens(name_bidx) WHERE deleted_at IS NULL AND name_bidx IS NOT NULL;"
+    "CREATE INDEX idx_citizens_father_bidx ON citizens(father_bidx) WHERE deleted_at IS NULL AND father_bidx IS NOT NULL;"
+    "CREATE INDEX idx_citizens_mother_bidx ON citizens(mother_bidx) WHERE deleted_at IS NULL AND mother_bidx IS NOT NULL;"
+    "CREATE INDEX idx_citizens_tombstones ON citizens(deleted_at) WHERE deleted_at IS NOT NULL;"
+    "DROP TRIGGER citizen_stats_insert;"
+    "DROP TRIGGER citizen_stats_delete;"
+    "DROP TRIGGER citizen_stats_update;"
+    "CREATE TRIGGER citizen_stats_insert AFTER INSERT ON citizens WHEN new.deleted_at IS NULL BEGIN "
+    "INSERT INTO citizen_stats VALUES (new.gender, new.blood_group, new.dob / 100000 * 10, new.is_active, 1) "
+    "ON CONFLICT DO UPDATE SET count = count + 1; END;"
+    "CREATE TRIGGER citizen_stats_delete AFTER DELETE ON citizens WHEN old.deleted_at IS NULL BEGIN "
+    "UPDATE citizen_stats SET count = count - 1 WHERE gender = old.gender AND blood_group = old.blood_group "
+    "AND birth_decade = old.dob / 100000 * 10 AND is_active = old.is_active; END;"
+    "CREATE TRIGGER citizen_stats_update AFTER UPDATE OF gender, blood_group, dob, is_active, deleted_at ON citizens "
+    "WHEN (old.deleted_at IS NULL) != (new.deleted_at IS NULL) OR (new.deleted_at IS NULL AND ("
+    "old.gender != new.gender OR old.blood_group != new.blood_group "
+    "OR old.dob / 100000 != new.dob / 100000 OR old.is_active != new.is_active)) BEGIN "
+    "UPDATE citizen_stats SET count = count - 1 WHERE old.deleted_at IS NULL AND gender = old.gender "
+    "AND blood_group = old.blood_group AND birth_decade = old.dob / 100000 * 10 AND is_active = old.is_active; "
+    "INSERT INTO citizen_stats SELECT new.gender, new.blood_group, new.dob / 100000 * 10, new.is_active, 1 "
+    "WHERE new.deleted_at IS NULL ON CONFLICT DO UPDATE SET count = count + 1; END;",
+    // 10: the change feed number each shard's latest write was given, as the main file
+    // saw it (see reconcile_shards())
+    "CREATE TABLE commit_marks ("
+    "shard INTEGER PRIMARY KEY,"
+    "seq INTEGER NOT NULL,"
+    "marked_at INTEGER NOT NULL);",
+    // 11: an archive is cataloged as pending before its file takes its name, and
+    // completed after (see reconcile_audit_archives())
+    "ALTER TABLE audit_archives ADD COLUMN status TEXT NOT NULL DEFAULT 'complete';",
+    NULL
+};
+
+int migrate_schema() {
+    sqlite3_stmt *stmt;
+    int version = 0;
+    if (sqlite3_prepare_v2(db, "PRAGMA user_version;", -1, &stmt, 0) == SQLITE_OK) {
+        if (sqlite3_step(stmt) == SQLITE_ROW) version = sqlite3_column_int(stmt, 0);
+        sqlite3_finalize(stmt);
+    }
+    for (int i = version; schema_migrations[i] != NULL; i++) {
+        char *err_msg = 0;
+        char pragma[64];
+        snprintf(pragma, sizeof(pragma), "PRAGMA user_version = %d;", i + 1);
+        if (sqlite3_exec(db, "BEGIN IMMEDIATE;", 0, 0, &err_msg) != SQLITE_OK ||
+            sqlite3_exec(db, schema_migrations[i], 0, 0, &err_msg) != SQLITE_OK ||
+            sqlite3_exec(db, pragma, 0, 0, &err_msg) != SQLITE_OK ||
+            sqlite3_exec(db, "COMMIT;", 0, 0, &err_msg) != SQLITE_OK) {
+            fprintf(stderr, "Schema migration %d failed: %s\n", i + 1, err_msg ? err_msg : sqlite3_errmsg(db));
+            sqlite3_free(err_msg);
+            sqlite3_exec(db, "ROLLBACK;", 0, 0, 0);
+            return 0;
+        }
+    }
+    return 1;
+}
+
+void sql_dob_key(sqlite3_context *ctx, int argc, sqlite3_value **argv) {
+    (void)argc;
+    const char *text = (const char*)sqlite3_value_text(argv[0]);
+    sqlite3_result_int(ctx, text ? dob_key(text) : 0);
+}
+
+void sql_gender_code(sqlite3_context *ctx, int argc, sqlite3_value **argv) {
+    (void)argc;
+    const char *text = (const char*)sqlite3_value_text(argv[0]);
+    sqlite3_result_int(ctx, text ? gender_code(text) : 0);
+}
+
+void sql_blood_code(sqlite3_context *ctx, int argc, sqlite3_value **argv) {
+    (void)argc;
+    const char *text = (const char*)sqlite3_value_text(argv[0]);
+    sqlite3_result_int(ctx, text ? blood_code(text) : 0);
+}
+
+// Creates the tables and applies pending migrations on db
+int create_schema() {
+    int rc;
+    // Used by schema migration 3 to convert text columns
+    int flags = SQLITE_UTF8 | SQLITE_DETERMINISTIC;
+    sqlite3_create_function(db, "dob_key", 1, flags, NULL, sql_dob_key, NULL, NULL);
+    sqlite3_create_function(db, "gender_code", 1, flags, NULL, sql_gender_code, NULL, NULL);
+    sqlite3_create_function(db, "blood_code", 1, flags, NULL, sql_blood_code, NULL, NULL);
 
+    // Only takes effect on a new file; see TOMBSTONE PURGE
     const char *sql = 
+        "PRAGMA auto_vacuum = INCREMENTAL;"
         "CREATE TABLE IF NOT EXISTS citizens ("
         "nid TEXT PRIMARY KEY,"
         "name TEXT NOT NULL,"
@@ -63,9 +891,249 @@ int init_db() {
         sqlite3_free(err_msg);
         return 0;
     }
+    return migrate_schema();
+}
+
+// Creates the shard file at path, or brings an existing one up to date, on a
+// connection of its own
+int init_shard(const char *path, int create) {
+    sqlite3 *main_db = db;
+    int flags = SQLITE_OPEN_READWRITE | SQLITE_OPEN_NOMUTEX | (create ? SQLITE_OPEN_CREATE : 0);
+    int ok = sqlite3_open_v2(path, &db, flags, NULL) == SQLITE_OK;
+    if (ok) {
+        sqlite3_busy_handler(db, busy_wait, NULL);
+        ok = create_schema();
+    } else {
+        fprintf(stderr, "Cannot open shard %s: %s\n", path, sqlite3_errmsg(db));
+    }
+    sqlite3_close(db);
+    db = main_db;
+    return ok;
+}
+
+int init_db() {
+    if (!open_connection(SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE) || !create_schema()) {
+        return 0;
+    }
+    sqlite3_stmt *stmt;
+    if (sqlite3_prepare_v2(db, "SELECT value FROM settings WHERE key = 'citizen_shards';", -1, &stmt, 0) == SQLITE_OK) {
+        if (sqlite3_step(stmt) == SQLITE_ROW) db_shards = sqlite3_column_int(stmt, 0);
+        sqlite3_finalize(stmt);
+    }
+    if (db_shards < 0 || db_shards > DB_MAX_SHARDS) {
+        fprintf(stderr, "Invalid shard count %d in settings\n", db_shards);
+        return 0;
+    }
+    for (int i = 0; i < db_shards; i++) {
+        char path[1024];
+        shard_path(i, db_shards, path, sizeof(path));
+        if (!init_shard(path, 0)) {
+            return 0;
+        }
+    }
+    return attach_shards(db) && create_change_triggers(db);
+}
+
+// ================== STATEMENT REGISTRY ==================
+// Every SQL statement the program runs is prepared once per connection and
+// reused; callers acquire a handle, bind, step, and release it again.
+typedef enum {
+    STMT_CITIZEN_INSERT,
+    STMT_CITIZEN_SELECT,
+    STMT_CITIZEN_SELECT_ALL,
+    STMT_CITIZEN_PAGE_NEXT,
+    STMT_CITIZEN_PAGE_PREV,
+    STMT_CITIZEN_DELETE,
+    STMT_AUDIT_INSERT,
+    STMT_USER_SELECT,
+    STMT_USER_COUNT,
+    STMT_USER_INSERT,
+    STMT_USER_LOGIN_OK,
+    STMT_USER_LOGIN_FAILED,
+    STMT_BLOCK_INSERT,
+    STMT_BLOCK_CANDIDATES,
+    STMT_BLOCK_DELETE,
+    STMT_REVIEW_INSERT,
+    STMT_REVIEW_DELETE,
+    STMT_CHANGE_SELECT,
+    STMT_CHANGE_POSITION,
+    STMT_CHANGE_ACK,
+    STMT_CHANGE_COMPACT,
+    STMT_CHANGE_MARK,
+    STMT_CHANGE_EXPIRY,
+    STMT_CHANGE_TRIM,
+    STMT_CHANGE_MARK_AT,
+    STMT_CONSUMER_SELECT,
+    STMT_CONSUMER_DELETE,
+    STMT_CONSUMER_STALE,
+    STMT_COUNT
+} StmtId;
+
+// Timings are shared by all connections and updated atomically. A routed statement
+// works on one citizen: its sql names the table as "%s.citizens" and it is prepared
+// once per shard, see citizen_schema().
+typedef struct {
+    const char *name;
+    const char *sql;
+    int routed;
+    Histogram hist;
+} PreparedStatement;
+
+PreparedStatement statements[STMT_COUNT] = {
+    [STMT_CITIZEN_INSERT]     = {"citizen_insert", "INSERT INTO %s.citizens (nid, name, dob, gender, address, "
+                                 "father_name, mother_name, blood_group, is_active, created_at, last_modified, "
+                                 "name_bidx, father_bidx, mother_bidx) VALUES (?,?,?,?,?,?,?,?,?,?,?,?,?,?);", 1},
+    [STMT_CITIZEN_SELECT]     = {"citizen_select", "SELECT * FROM %s.citizens WHERE nid = ? AND deleted_at IS NULL;", 1},
+    [STMT_CITIZEN_SELECT_ALL] = {"citizen_select_all", "SELECT * FROM citizens WHERE deleted_at IS NULL ORDER BY nid;"},
+    [STMT_CITIZEN_PAGE_NEXT]  = {"citizen_page_next", "SELECT * FROM citizens WHERE nid > ? AND deleted_at IS NULL "
+                                 "ORDER BY nid LIMIT ?;"},
+    [STMT_CITIZEN_PAGE_PREV]  = {"citizen_page_prev", "SELECT * FROM citizens WHERE nid < ? AND deleted_at IS NULL "
+                                 "ORDER BY nid DESC LIMIT ?;"},
+    [STMT_CITIZEN_DELETE]     = {"citizen_delete", "UPDATE %s.citizens SET deleted_at = ?2, last_modified = ?2 "
+                                 "WHERE nid = ?1 AND deleted_at IS NULL;", 1},
+    [STMT_AUDIT_INSERT]       = {"audit_insert", "INSERT INTO audit_logs (nid, timestamp, activity_type, details) VALUES (?,?,?,?);"},
+    [STMT_USER_SELECT]        = {"user_select", "SELECT password_hash, salt, failed_attempts, last_login FROM users WHERE username = ?;"},
+    [STMT_USER_COUNT]         = {"user_count", "SELECT COUNT(*) FROM users WHERE username = ?;"},
+    [STMT_USER_INSERT]        = {"user_insert", "INSERT INTO users VALUES (?,?,?,?,?,?);"},
+    [STMT_USER_LOGIN_OK]      = {"user_login_ok", "UPDATE users SET failed_attempts = 0, last_login = ? WHERE username = ?;"},
+    [STMT_USER_LOGIN_FAILED]  = {"user_login_failed", "UPDATE users SET failed_attempts = COALESCE(failed_attempts, 0) + 1 WHERE username = ?;"},
+    [STMT_BLOCK_INSERT]       = {"block_insert", "INSERT OR IGNORE INTO citizen_blocks VALUES (?,?);"},
+    [STMT_BLOCK_CANDIDATES]   = {"block_candidates", "SELECT * FROM citizens WHERE nid IN "
+                                 "(SELECT nid FROM citizen_blocks WHERE block = ?1 AND nid != ?3 LIMIT ?4) "
+                                 "AND deleted_at IS NULL UNION ALL "
+                                 "SELECT * FROM citizens WHERE nid IN "
+                                 "(SELECT nid FROM citizen_blocks WHERE block = ?2 AND nid != ?3 LIMIT ?4) AND nid NOT IN "
+                                 "(SELECT nid FROM citizen_blocks WHERE block = ?1 AND nid != ?3 LIMIT ?4) "
+                                 "AND deleted_at IS NULL;"},
+    [STMT_BLOCK_DELETE]       = {"block_delete", "DELETE FROM citizen_blocks WHERE nid = ?;"},
+    [STMT_REVIEW_INSERT]      = {"review_insert", "INSERT OR IGNORE INTO duplicate_reviews (nid, candidate_nid, score, flagged_at) "
+                                 "VALUES (?,?,?,?);"},
+    [STMT_REVIEW_DELETE]      = {"review_delete", "DELETE FROM duplicate_reviews WHERE status = 'pending' "
+                                 "AND (nid = ?1 OR candidate_nid = ?1);"},
+    [STMT_CHANGE_SELECT]      = {"change_select", "SELECT seq, op, nid FROM citizen_changes WHERE seq > ? ORDER BY seq LIMIT ?;"},
+    [STMT_CHANGE_POSITION]    = {"change_position", "SELECT (SELECT seq FROM sqlite_sequence WHERE name = 'citizen_changes'), "
+                                 "(SELECT value FROM settings WHERE key = 'changes_compacted');"},
+    [STMT_CHANGE_ACK]         = {"change_ack", "INSERT INTO change_consumers VALUES (?,?,?) ON CONFLICT DO UPDATE "
+                                 "SET acked_seq = MAX(acked_seq, excluded.acked_seq), acked_at = excluded.acked_at;"},
+    [STMT_CHANGE_COMPACT]     = {"change_compact", "DELETE FROM citizen_changes WHERE seq <= "
+                                 "(SELECT MIN(acked_seq) FROM change_consumers);"},
+    [STMT_CHANGE_MARK]        = {"change_mark", "INSERT INTO settings SELECT 'changes_compacted', MIN(acked_seq) "
+                                 "FROM change_consumers WHERE true HAVING COUNT(*) > 0 "
+                                 "ON CONFLICT DO UPDATE SET value = MAX(value, excluded.value);"},
+    [STMT_CHANGE_EXPIRY]      = {"change_expiry", "SELECT COALESCE((SELECT seq FROM citizen_changes WHERE changed_at >= ? "
+                                 "ORDER BY seq LIMIT 1), (SELECT seq FROM sqlite_sequence WHERE name = 'citizen_changes') + 1, 1) - 1;"},
+    [STMT_CHANGE_TRIM]        = {"change_trim", "DELETE FROM citizen_changes WHERE seq <= ?;"},
+    [STMT_CHANGE_MARK_AT]     = {"change_mark_at", "INSERT INTO settings VALUES ('changes_compacted', ?) "
+                                 "ON CONFLICT DO UPDATE SET value = MAX(value, excluded.value);"},
+    [STMT_CONSUMER_SELECT]    = {"consumer_select", "SELECT acked_seq FROM change_consumers WHERE name = ?;"},
+    [STMT_CONSUMER_DELETE]    = {"consumer_delete", "DELETE FROM change_consumers WHERE name = ?;"},
+    [STMT_CONSUMER_STALE]     = {"consumer_stale", "SELECT name, acked_seq, acked_at FROM change_consumers WHERE acked_seq < ?;"},
+};
+
+_Thread_local sqlite3_stmt *prepared[DB_MAX_SHARDS][STMT_COUNT];     // [0] for unrouted statements
+_Thread_local int stmt_shard[STMT_COUNT];
+_Thread_local long long stmt_started_ns[STMT_COUNT];
+
+// Citizen queries are built from a combination of filters; each combination is
+// prepared on first use and cached by its filter mask
+#define QUERY_FILTERS 7
+#define UPDATE_FIELDS 8
+#define AUDIT_QUERY_FILTERS 5
+#define STATS_DIMENSIONS 4
+_Thread_local sqlite3_stmt *query_stmts[1 << QUERY_FILTERS];
+_Thread_local sqlite3_stmt *update_stmts[DB_MAX_SHARDS][1 << UPDATE_FIELDS];
+_Thread_local sqlite3_stmt *audit_query_stmts[1 << AUDIT_QUERY_FILTERS];
+_Thread_local sqlite3_stmt *stats_stmts[1 << STATS_DIMENSIONS][STATS_DIMENSIONS + 1];  // [filters][breakdown]
+
+int prepare_statements() {
+    for (int i = 0; i < STMT_COUNT; i++) {
+        int copies = statements[i].routed && db_shards ? db_shards : 1;
+        for (int shard = 0; shard < copies; shard++) {
+            char sql[1024];
+            if (statements[i].routed) {
+                snprintf(sql, sizeof(sql), statements[i].sql, citizen_schema(shard));
+            }
+            const char *text = statements[i].routed ? sql : statements[i].sql;
+            if (sqlite3_prepare_v3(db, text, -1, SQLITE_PREPARE_PERSISTENT, &prepared[shard][i], 0) != SQLITE_OK) {
+                fprintf(stderr, "Failed to prepare %s: %s\n", statements[i].name, sqlite3_errmsg(db));
+                return 0;
+            }
+        }
+    }
+    return 1;
+}
+
+// Returns the ready-to-bind handle for id on the given shard and starts its timer
+sqlite3_stmt *stmt_acquire_shard(StmtId id, int shard) {
+    stmt_started_ns[id] = now_ns();
+    stmt_shard[id] = shard;
+    return prepared[shard][id];
+}
+
+sqlite3_stmt *stmt_acquire(StmtId id) {
+    return stmt_acquire_shard(id, 0);
+}
+
+// Resets the handle for the next caller and records the execution; page-cache
+// counters are published every METRICS_PUBLISH_EVERY statements
+void stmt_release(StmtId id) {
+    sqlite3_stmt *stmt = prepared[stmt_shard[id]][id];
+    sqlite3_reset(stmt);
+    sqlite3_clear_bindings(stmt);
+    hist_record(&statements[id].hist, now_ns() - stmt_started_ns[id]);
+    if (++publish_countdown % METRICS_PUBLISH_EVERY == 0) {
+        publish_db_status(db);
+    }
+}
+
+void finalize_statements() {
+    for (int shard = 0; shard < DB_MAX_SHARDS; shard++) {
+        for (int i = 0; i < STMT_COUNT; i++) {
+            sqlite3_finalize(prepared[shard][i]);
+            prepared[shard][i] = NULL;
+        }
+        for (int i = 0; i < (1 << UPDATE_FIELDS); i++) {
+            sqlite3_finalize(update_stmts[shard][i]);
+            update_stmts[shard][i] = NULL;
+        }
+    }
+    for (int i = 0; i < (1 << QUERY_FILTERS); i++) {
+        sqlite3_finalize(query_stmts[i]);
+        query_stmts[i] = NULL;
+    }
+    for (int i = 0; i < (1 << AUDIT_QUERY_FILTERS); i++) {
+        sqlite3_finalize(audit_query_stmts[i]);
+        audit_query_stmts[i] = NULL;
+    }
+    for (int i = 0; i < (1 << STATS_DIMENSIONS); i++) {
+        for (int j = 0; j <= STATS_DIMENSIONS; j++) {
+            sqlite3_finalize(stats_stmts[i][j]);
+            stats_stmts[i][j] = NULL;
+        }
+    }
+}
+
+// Prepared connection for a worker thread; pair with close_connection()
+int open_thread_connection(int flags) {
+    if (!open_connection(flags)) {
+        return 0;
+    }
+    if (((flags & SQLITE_OPEN_READWRITE) && !create_change_triggers(db)) || !prepare_statements()) {
+        sqlite3_close(db);
+        db = NULL;
+        return 0;
+    }
     return 1;
 }
 
+void close_connection() {
+    publish_db_status(db);
+    finalize_statements();
+    sqlite3_close(db);
+    db = NULL;
+    pii_thread_free();
+}
+
 // ================== DATA MODELS ==================
 typedef struct {
     char nid[20];
@@ -81,6 +1149,20 @@ typedef struct {
     time_t last_modified;
 } Citizen;
 
+// Compact form for records held in memory: the coded columns, then the four
+// free-text fields packed back to back (about 100 bytes instead of ~560)
+typedef struct {
+    int64_t nid;
+    int64_t created_at;
+    int64_t last_modified;
+    int32_t dob;                // YYYYMMDD
+    uint8_t gender;
+    uint8_t blood_group;
+    uint8_t is_active;
+    uint8_t lengths[4];         // name, address, father_name, mother_name
+    char text[];
+} CompactCitizen;
+
 typedef struct {
     char username[50];
     unsigned char password_hash[SHA256_DIGEST_LENGTH];
@@ -103,28 +1185,762 @@ int validate_date(const char *date) {
            (day >= 1 && day <= 31);
 }
 
-void generate_unique_nid(char *nid) {
-    srand(time(NULL));
-    snprintf(nid, 11, "%010d", rand() % 1000000000);
+int has_value(const char *s) {
+    return s && s[0] != '\0';
 }
 
-// ================== CRYPTO FUNCTIONS ==================
-void generate_salt(unsigned char *salt) {
-    if (!RAND_bytes(salt, SALT_LEN)) {
-        perror("Error generating salt");
-        exit(EXIT_FAILURE);
+int validate_blood_group(const char *blood_group) {
+    return blood_code(blood_group) != 0;
+}
+
+int validate_gender(const char *gender) {
+    return gender_code(gender) != 0;
+}
+
+// Bytes of text a CompactCitizen needs after the fixed part, or SIZE_MAX when a
+// field is too long for its one-byte length
+size_t compact_text_size(const Citizen *c) {
+    const char *fields[] = {c->name, c->address, c->father_name, c->mother_name};
+    size_t total = 0;
+    for (int i = 0; i < 4; i++) {
+        size_t len = strlen(fields[i]);
+        if (len > UINT8_MAX) return SIZE_MAX;
+        total += len;
     }
+    return total;
 }
 
-void derive_key(const char *pass, const unsigned char *salt, unsigned char *key) {
-    if (!PKCS5_PBKDF2_HMAC(pass, strlen(pass), salt, SALT_LEN, ITERATIONS, EVP_sha256(), SHA256_DIGEST_LENGTH, key)) {
-        perror("Error deriving key");
-        exit(EXIT_FAILURE);
+// out must have room for compact_text_size(c) bytes of text
+void compact_encode(const Citizen *c, CompactCitizen *out) {
+    const char *fields[] = {c->name, c->address, c->father_name, c->mother_name};
+    sqlite3_int64 nid = 0;
+    nid_key(c->nid, &nid);
+    out->nid = nid;
+    out->created_at = c->created_at;
+    out->last_modified = c->last_modified;
+    out->dob = dob_key(c->dob);
+    out->gender = (uint8_t)gender_code(c->gender);
+    out->blood_group = (uint8_t)blood_code(c->blood_group);
+    out->is_active = (uint8_t)c->is_active;
+    char *p = out->text;
+    for (int i = 0; i < 4; i++) {
+        out->lengths[i] = (uint8_t)strlen(fields[i]);
+        memcpy(p, fields[i], out->lengths[i]);
+        p += out->lengths[i];
     }
 }
 
-// ================== CITIZEN OPERATIONS ==================
+void compact_decode(const CompactCitizen *in, Citizen *c) {
+    char *fields[] = {c->name, c->address, c->father_name, c->mother_name};
+    size_t sizes[] = {sizeof(c->name), sizeof(c->address), sizeof(c->father_name), sizeof(c->mother_name)};
+    const char *p = in->text;
+    for (int i = 0; i < 4; i++) {
+        size_t len = in->lengths[i] < sizes[i] ? in->lengths[i] : sizes[i] - 1;
+        memcpy(fields[i], p, len);
+        fields[i][len] = '\0';
+        p += in->lengths[i];
+    }
+    format_nid(in->nid, c->nid);
+    format_dob(in->dob, c->dob);
+    strcpy(c->gender, gender_name(in->gender));
+    strcpy(c->blood_group, blood_group_name(in->blood_group));
+    c->is_active = in->is_active;
+    c->created_at = (time_t)in->created_at;
+    c->last_modified = (time_t)in->last_modified;
+}
+
+// Growable output buffer, reused across rows and requests
+typedef struct {
+    char *data;
+    size_t len;
+    size_t cap;
+} Buffer;
+
+void buf_reserve(Buffer *b, size_t extra) {
+    if (b->len + extra + 1 <= b->cap) {
+        return;
+    }
+    size_t cap = b->cap ? b->cap : 256;
+    while (cap < b->len + extra + 1) cap *= 2;
+    char *data = realloc(b->data, cap);
+    if (!data) {
+        perror("Out of memory");
+        exit(EXIT_FAILURE);
+    }
+    b->data = data;
+    b->cap = cap;
+}
+
+void buf_append(Buffer *b, const char *data, size_t len) {
+    buf_reserve(b, len);
+    memcpy(b->data + b->len, data, len);
+    b->len += len;
+    b->data[b->len] = '\0';
+}
+
+void buf_printf(Buffer *b, const char *fmt, ...) {
+    va_list ap;
+    va_start(ap, fmt);
+    int n = vsnprintf(NULL, 0, fmt, ap);
+    va_end(ap);
+    buf_reserve(b, n);
+    va_start(ap, fmt);
+    vsnprintf(b->data + b->len, n + 1, fmt, ap);
+    va_end(ap);
+    b->len += n;
+}
+
+void buf_free(Buffer *b) {
+    free(b->data);
+    b->data = NULL;
+    b->len = b->cap = 0;
+}
+
+int read_full(int fd, void *buf, size_t len) {
+    char *p = buf;
+    while (len > 0) {
+        ssize_t n = read(fd, p, len);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return 0;
+        p += n;
+        len -= n;
+    }
+    return 1;
+}
+
+int write_full(int fd, const void *buf, size_t len) {
+    const char *p = buf;
+    while (len > 0) {
+        ssize_t n = write(fd, p, len);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return 0;
+        p += n;
+        len -= n;
+    }
+    return 1;
+}
+
+// ================== CRYPTO FUNCTIONS ==================
+void generate_salt(unsigned char *salt) {
+    if (!RAND_bytes(salt, SALT_LEN)) {
+        perror("Error generating salt");
+        exit(EXIT_FAILURE);
+    }
+}
+
+void derive_key(const char *pass, const unsigned char *salt, unsigned char *key) {
+    long long started = now_ns();
+    if (!PKCS5_PBKDF2_HMAC(pass, strlen(pass), salt, SALT_LEN, ITERATIONS, EVP_sha256(), SHA256_DIGEST_LENGTH, key)) {
+        perror("Error deriving key");
+        exit(EXIT_FAILURE);
+    }
+    op_record(OP_PBKDF2, started);
+}
+
+// ================== NID ALLOCATOR ==================
+// NIDs come from a persisted sequence that is reserved NID_BLOCK_SIZE numbers at a
+// time. The sequence lives in a sidecar database so reserving a block never waits
+// on a citizen write transaction, and numbers left in a block at exit are skipped,
+// never reused. Each sequence number goes through a keyed Feistel permutation of
+// [0, 10^10), so issued NIDs are unique but not sequential.
+#define NID_SPACE 10000000000ULL
+#define NID_HALF 100000ULL
+#define NID_BLOCK_SIZE 1024
+#define NID_FEISTEL_ROUNDS 6
+#define NID_KEY_LEN (NID_FEISTEL_ROUNDS * 8)
+#define NID_REMAINING_BITS 20
+#define NID_REMAINING_MASK ((1ULL << NID_REMAINING_BITS) - 1)
+
+sqlite3 *nid_db;
+sqlite3_stmt *nid_reserve_stmt;
+pthread_mutex_t nid_refill_lock = PTHREAD_MUTEX_INITIALIZER;
+uint64_t nid_round_keys[NID_FEISTEL_ROUNDS];
+// Next sequence number in the high bits, numbers left in the current block in the low bits
+uint64_t nid_state;
+
+int init_nid_allocator() {
+    char path[512];
+    snprintf(path, sizeof(path), "%s.nidseq", DB_NAME);
+    if (sqlite3_open(path, &nid_db) != SQLITE_OK) {
+        fprintf(stderr, "Cannot open NID sequence: %s\n", sqlite3_errmsg(nid_db));
+        return 0;
+    }
+    sqlite3_busy_handler(nid_db, busy_wait, NULL);
+
+    unsigned char key[NID_KEY_LEN];
+    if (!RAND_bytes(key, sizeof(key))) {
+        fprintf(stderr, "Error generating NID permutation key\n");
+        return 0;
+    }
+    sqlite3_stmt *stmt;
+    int ok = sqlite3_exec(nid_db,
+                          "CREATE TABLE IF NOT EXISTS nid_sequence ("
+                          "id INTEGER PRIMARY KEY CHECK (id = 1),"
+                          "next_seq INTEGER NOT NULL,"
+                          "permutation_key BLOB NOT NULL);", 0, 0, 0) == SQLITE_OK &&
+             sqlite3_prepare_v2(nid_db, "INSERT OR IGNORE INTO nid_sequence VALUES (1, 0, ?);", -1, &stmt, 0) == SQLITE_OK;
+    if (ok) {
+        sqlite3_bind_blob(stmt, 1, key, sizeof(key), SQLITE_STATIC);
+        ok = sqlite3_step(stmt) == SQLITE_DONE;
+        sqlite3_finalize(stmt);
+    }
+    if (ok && sqlite3_prepare_v2(nid_db, "SELECT permutation_key FROM nid_sequence WHERE id = 1;", -1, &stmt, 0) == SQLITE_OK) {
+        ok = sqlite3_step(stmt) == SQLITE_ROW && sqlite3_column_bytes(stmt, 0) == NID_KEY_LEN;
+        if (ok) memcpy(nid_round_keys, sqlite3_column_blob(stmt, 0), NID_KEY_LEN);
+        sqlite3_finalize(stmt);
+    }
+    if (ok) {
+        ok = sqlite3_prepare_v2(nid_db,
+                                "UPDATE nid_sequence SET next_seq = next_seq + ?1 "
+                                "WHERE id = 1 AND next_seq + ?1 <= ?2 RETURNING next_seq;",
+                                -1, &nid_reserve_stmt, 0) == SQLITE_OK;
+    }
+    if (!ok) {
+        fprintf(stderr, "Cannot initialize NID sequence: %s\n", sqlite3_errmsg(nid_db));
+    }
+    return ok;
+}
+
+void close_nid_allocator() {
+    sqlite3_finalize(nid_reserve_stmt);
+    sqlite3_close(nid_db);
+    nid_reserve_stmt = NULL;
+    nid_db = NULL;
+}
+
+uint64_t nid_mix(uint64_t x) {
+    x ^= x >> 30;
+    x *= 0xbf58476d1ce4e5b9ULL;
+    x ^= x >> 27;
+    x *= 0x94d049bb133111ebULL;
+    return x ^ (x >> 31);
+}
+
+uint64_t permute_nid(uint64_t seq) {
+    uint64_t left = seq / NID_HALF, right = seq % NID_HALF;
+    for (int r = 0; r < NID_FEISTEL_ROUNDS; r++) {
+        uint64_t next = (left + nid_mix(right ^ nid_round_keys[r])) % NID_HALF;
+        left = right;
+        right = next;
+    }
+    return left * NID_HALF + right;
+}
+
+// Commits the reservation before any number in it is handed out
+int reserve_nid_block(uint64_t *start) {
+    sqlite3_bind_int64(nid_reserve_stmt, 1, NID_BLOCK_SIZE);
+    sqlite3_bind_int64(nid_reserve_stmt, 2, (sqlite3_int64)NID_SPACE);
+    int rc = sqlite3_step(nid_reserve_stmt);
+    if (rc == SQLITE_ROW) {
+        *start = (uint64_t)sqlite3_column_int64(nid_reserve_stmt, 0) - NID_BLOCK_SIZE;
+        rc = sqlite3_step(nid_reserve_stmt);
+    }
+    sqlite3_reset(nid_reserve_stmt);
+    if (rc != SQLITE_DONE || sqlite3_changes(nid_db) != 1) {
+        fprintf(stderr, "Cannot reserve NID block: %s\n",
+                rc == SQLITE_DONE ? "NID space exhausted" : sqlite3_errmsg(nid_db));
+        return 0;
+    }
+    return 1;
+}
+
+// Lock-free within a block; only the thread that finds it empty takes the refill lock
+int generate_unique_nid(char *nid) {
+    uint64_t seq;
+    while (1) {
+        uint64_t state = __atomic_load_n(&nid_state, __ATOMIC_ACQUIRE);
+        if (state & NID_REMAINING_MASK) {
+            if (__atomic_compare_exchange_n(&nid_state, &state, state + (1ULL << NID_REMAINING_BITS) - 1,
+                                            0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+                seq = state >> NID_REMAINING_BITS;
+                break;
+            }
+            continue;
+        }
+        pthread_mutex_lock(&nid_refill_lock);
+        if ((__atomic_load_n(&nid_state, __ATOMIC_ACQUIRE) & NID_REMAINING_MASK) == 0) {
+            uint64_t start;
+            if (!reserve_nid_block(&start)) {
+                pthread_mutex_unlock(&nid_refill_lock);
+                return 0;
+            }
+            __atomic_store_n(&nid_state, (start << NID_REMAINING_BITS) | NID_BLOCK_SIZE, __ATOMIC_RELEASE);
+        }
+        pthread_mutex_unlock(&nid_refill_lock);
+    }
+    snprintf(nid, 11, "%010llu", (unsigned long long)permute_nid(seq));
+    return 1;
+}
+
+// ================== CITIZEN CACHE ==================
+// Recently searched citizens, keyed by NID and packed into variable-length entries.
+// The cache is split into shards with their own lock, table and LRU list, and each
+// shard evicts from the tail once it exceeds its share of the memory budget.
+//
+// Writers invalidate after the row changes. A change made inside a transaction is
+// invalidated again once the transaction commits (cache_transaction_done()), and
+// every invalidation bumps the shard's epoch so a reader that loaded the row from
+// an older snapshot does not put it back.
+#define CACHE_SHARDS 16
+#define CACHE_DEFAULT_MB 64
+#define CACHE_PENDING_MAX 256
+
+typedef struct CacheEntry {
+    struct CacheEntry *hash_next;
+    struct CacheEntry *prev;        // LRU neighbours, most recent at the head
+    struct CacheEntry *next;
+    size_t size;
+    CompactCitizen record;          // variable length, so it must stay last
+} CacheEntry;
+
+typedef struct {
+    pthread_mutex_t lock;
+    CacheEntry **buckets;
+    size_t bucket_count;
+    size_t entries;
+    size_t bytes;
+    CacheEntry *head;
+    CacheEntry *tail;
+    uint64_t epoch;
+} CacheShard;
+
+CacheShard cache_shards[CACHE_SHARDS];
+size_t cache_shard_budget;      // 0 disables the cache
+
+struct {
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t evictions;
+    uint64_t invalidations;
+} cache_counters;
+
+_Thread_local uint64_t cache_pending[CACHE_PENDING_MAX];
+_Thread_local int cache_pending_count;
+_Thread_local int cache_pending_overflow;
+
+void cache_init(size_t budget_mb) {
+    cache_shard_budget = budget_mb * 1024 * 1024 / CACHE_SHARDS;
+    for (int i = 0; i < CACHE_SHARDS; i++) {
+        pthread_mutex_init(&cache_shards[i].lock, NULL);
+    }
+}
+
+int cache_key(const char *nid, uint64_t *key) {
+    sqlite3_int64 value;
+    if (!nid_key(nid, &value)) {
+        return 0;
+    }
+    *key = (uint64_t)value;
+    return 1;
+}
+
+CacheShard *cache_shard(uint64_t key) {
+    return &cache_shards[nid_mix(key) % CACHE_SHARDS];
+}
+
+CacheEntry **cache_slot(CacheShard *shard, uint64_t key) {
+    CacheEntry **slot = &shard->buckets[(nid_mix(key) >> 8) & (shard->bucket_count - 1)];
+    while (*slot && (uint64_t)(*slot)->record.nid != key) slot = &(*slot)->hash_next;
+    return slot;
+}
+
+void cache_unlink(CacheShard *shard, CacheEntry *e) {
+    if (e->prev) e->prev->next = e->next;
+    else shard->head = e->next;
+    if (e->next) e->next->prev = e->prev;
+    else shard->tail = e->prev;
+}
+
+void cache_push_front(CacheShard *shard, CacheEntry *e) {
+    e->prev = NULL;
+    e->next = shard->head;
+    if (shard->head) shard->head->prev = e;
+    shard->head = e;
+    if (!shard->tail) shard->tail = e;
+}
+
+void cache_remove(CacheShard *shard, CacheEntry **slot) {
+    CacheEntry *e = *slot;
+    *slot = e->hash_next;
+    cache_unlink(shard, e);
+    shard->entries--;
+    shard->bytes -= e->size;
+    free(e);
+}
+
+// Doubles the table once it averages one entry per bucket
+void cache_grow(CacheShard *shard) {
+    size_t count = shard->bucket_count ? shard->bucket_count * 2 : 256;
+    CacheEntry **buckets = calloc(count, sizeof(CacheEntry*));
+    if (!buckets) {
+        return;
+    }
+    for (size_t i = 0; i < shard->bucket_count; i++) {
+        for (CacheEntry *e = shard->buckets[i], *next; e; e = next) {
+            next = e->hash_next;
+            size_t b = (nid_mix((uint64_t)e->record.nid) >> 8) & (count - 1);
+            e->hash_next = buckets[b];
+            buckets[b] = e;
+        }
+    }
+    free(shard->buckets);
+    shard->buckets = buckets;
+    shard->bucket_count = count;
+}
+
+// On a hit fills out and returns 1. On a miss returns 0 with the shard epoch to
+// hand back to cache_put() after reading the database.
+int cache_get(const char *nid, Citizen *out, uint64_t *epoch) {
+    uint64_t key;
+    *epoch = UINT64_MAX;
+    if (!cache_shard_budget || !cache_key(nid, &key)) {
+        return 0;
+    }
+    CacheShard *shard = cache_shard(key);
+    pthread_mutex_lock(&shard->lock);
+    CacheEntry *e = shard->bucket_count ? *cache_slot(shard, key) : NULL;
+    if (!e) {
+        *epoch = shard->epoch;
+        pthread_mutex_unlock(&shard->lock);
+        __atomic_fetch_add(&cache_counters.misses, 1, __ATOMIC_RELAXED);
+        return 0;
+    }
+    cache_unlink(shard, e);
+    cache_push_front(shard, e);
+    compact_decode(&e->record, out);
+    pthread_mutex_unlock(&shard->lock);
+    __atomic_fetch_add(&cache_counters.hits, 1, __ATOMIC_RELAXED);
+    return 1;
+}
+
+// Stores a row read from the database, unless it was invalidated since the miss
+void cache_put(const Citizen *c, uint64_t epoch) {
+    uint64_t key;
+    // Rows read inside a transaction may include this connection's uncommitted changes
+    if (epoch == UINT64_MAX || !sqlite3_get_autocommit(db) || !cache_key(c->nid, &key)) {
+        return;
+    }
+    size_t text = compact_text_size(c);
+    if (text == SIZE_MAX) {
+        return;
+    }
+    CacheEntry *e = malloc(sizeof(CacheEntry) + text);
+    if (!e) {
+        return;
+    }
+    e->size = sizeof(CacheEntry) + text;
+    compact_encode(c, &e->record);
+
+    CacheShard *shard = cache_shard(key);
+    pthread_mutex_lock(&shard->lock);
+    if (shard->epoch != epoch) {
+        pthread_mutex_unlock(&shard->lock);
+        free(e);
+        return;
+    }
+    if (shard->entries >= shard->bucket_count) cache_grow(shard);
+    CacheEntry **slot = cache_slot(shard, key);
+    if (*slot) cache_remove(shard, slot);
+    e->hash_next = NULL;
+    *slot = e;
+    cache_push_front(shard, e);
+    shard->entries++;
+    shard->bytes += e->size;
+    while (shard->bytes > cache_shard_budget && shard->tail != e) {
+        cache_remove(shard, cache_slot(shard, (uint64_t)shard->tail->record.nid));
+        __atomic_fetch_add(&cache_counters.evictions, 1, __ATOMIC_RELAXED);
+    }
+    pthread_mutex_unlock(&shard->lock);
+}
+
+void cache_drop(uint64_t key) {
+    CacheShard *shard = cache_shard(key);
+    pthread_mutex_lock(&shard->lock);
+    if (shard->bucket_count) {
+        CacheEntry **slot = cache_slot(shard, key);
+        if (*slot) cache_remove(shard, slot);
+    }
+    shard->epoch++;
+    pthread_mutex_unlock(&shard->lock);
+    __atomic_fetch_add(&cache_counters.invalidations, 1, __ATOMIC_RELAXED);
+}
+
+// Empties every shard; used when too many changes are pending to track singly
+void cache_clear() {
+    for (int i = 0; i < CACHE_SHARDS; i++) {
+        CacheShard *shard = &cache_shards[i];
+        pthread_mutex_lock(&shard->lock);
+        while (shard->head) {
+            cache_remove(shard, cache_slot(shard, (uint64_t)shard->head->record.nid));
+        }
+        shard->epoch++;
+        pthread_mutex_unlock(&shard->lock);
+    }
+}
+
+// Call after a citizen row is updated or deleted
+void cache_invalidate(const char *nid) {
+    uint64_t key;
+    if (!cache_shard_budget || !cache_key(nid, &key)) {
+        return;
+    }
+    cache_drop(key);
+    if (!sqlite3_get_autocommit(db)) {
+        if (cache_pending_count < CACHE_PENDING_MAX) cache_pending[cache_pending_count++] = key;
+        else cache_pending_overflow = 1;
+    }
+}
+
+// Call after COMMIT or ROLLBACK of a transaction that may have changed citizens
+void cache_transaction_done() {
+    if (cache_pending_overflow) {
+        cache_clear();
+    } else {
+        for (int i = 0; i < cache_pending_count; i++) cache_drop(cache_pending[i]);
+    }
+    cache_pending_count = 0;
+    cache_pending_overflow = 0;
+}
+
+void cache_free() {
+    cache_clear();
+    for (int i = 0; i < CACHE_SHARDS; i++) {
+        free(cache_shards[i].buckets);
+        cache_shards[i].buckets = NULL;
+        cache_shards[i].bucket_count = 0;
+    }
+}
+
+// ================== DUPLICATE DETECTION ==================
+// Each citizen is filed under two blocking keys: the phonetic name with the date of
+// birth, and the phonetic name with the mother's phonetic name. A new record, or
+// one whose keys change, is scored only against the citizens sharing a key (at most
+// DEDUP_MAX_CANDIDATES from each key, the name+DOB key's first so that a large
+// name+mother block cannot crowd them out), so the cost does not grow with the
+// table. The two keys are looked up in separate arms of a UNION ALL: a combined NID
+// list, or an ORDER BY, keeps SQLite from searching the shards by NID and it scans
+// them whole instead. Pairs that score DEDUP_THRESHOLD or more are queued in duplicate_reviews.
+//
+// Keys are 64-bit hashes; with field encryption on they are keyed HMACs so they
+// reveal nothing about the names.
+#define DEDUP_MAX_CANDIDATES 32
+#define DEDUP_THRESHOLD 0.92
+#define DEDUP_BATCH 1000
+
+typedef struct {
+    char nid[20];       // best-scoring earlier citizen
+    double score;
+    int count;          // candidates flagged
+} DuplicateMatch;
+
+// Lowercase letters and digits, words separated by single spaces
+void normalize_name(const char *in, char *out, size_t size) {
+    size_t len = 0;
+    for (const char *p = in; *p && len + 1 < size; p++) {
+        if (isalnum((unsigned char)*p)) {
+            out[len++] = (char)tolower((unsigned char)*p);
+        } else if (len && out[len - 1] != ' ') {
+            out[len++] = ' ';
+        }
+    }
+    if (len && out[len - 1] == ' ') len--;
+    out[len] = '\0';
+}
+
+// Soundex of each word (numbers are kept as they are), e.g. "Mohammad Rahman" -> "m530 r550"
+void phonetic_name(const char *name, char *out, size_t size) {
+    static const char codes[] = "01230120022455012623010202";
+    char normal[PII_MAX_TEXT];
+    normalize_name(name, normal, sizeof(normal));
+    size_t len = 0;
+    for (const char *word = normal; *word && len + 6 < size; ) {
+        size_t word_len = strcspn(word, " ");
+        if (len) out[len++] = ' ';
+        if (isdigit((unsigned char)word[0])) {
+            for (size_t i = 0; i < word_len && len + 1 < size; i++) out[len++] = word[i];
+        } else {
+            size_t start = len;
+            char last = codes[word[0] - 'a'];
+            out[len++] = word[0];
+            for (size_t i = 1; i < word_len && len - start < 4; i++) {
+                char code = isalpha((unsigned char)word[i]) ? codes[word[i] - 'a'] : '0';
+                if (code != '0' && code != last) out[len++] = code;
+                if (word[i] != 'h' && word[i] != 'w') last = code;
+            }
+            while (len - start < 4) out[len++] = '0';
+        }
+        word += word_len;
+        if (*word == ' ') word++;
+    }
+    out[len] = '\0';
+}
+
+sqlite3_int64 block_hash(const char *text) {
+    uint64_t hash = 14695981039346656037ULL;
+    unsigned char mac[BLIND_INDEX_LEN];
+    if (pii_encryption && blind_index(text, mac)) {
+        memcpy(&hash, mac, sizeof(hash));
+    } else {
+        for (const char *p = text; *p; p++) hash = (hash ^ (unsigned char)*p) * 1099511628211ULL;
+    }
+    return (sqlite3_int64)hash;
+}
+
+void duplicate_blocks(const Citizen *c, sqlite3_int64 blocks[2]) {
+    char name[PII_MAX_TEXT], mother[PII_MAX_TEXT], key[2 * PII_MAX_TEXT + 16];
+    phonetic_name(c->name, name, sizeof(name));
+    phonetic_name(c->mother_name, mother, sizeof(mother));
+    snprintf(key, sizeof(key), "d|%s|%d", name, dob_key(c->dob));
+    blocks[0] = block_hash(key);
+    snprintf(key, sizeof(key), "m|%s|%s", name, mother);
+    blocks[1] = block_hash(key);
+}
+
+// Jaro-Winkler similarity of two normalized strings, 0 to 1
+double jaro_winkler(const char *a, const char *b) {
+    int la = (int)strlen(a), lb = (int)strlen(b);
+    if (la == 0 || lb == 0) return la == lb;
+    char used_a[PII_MAX_TEXT] = {0}, used_b[PII_MAX_TEXT] = {0};
+    int window = (la > lb ? la : lb) / 2 - 1, matches = 0;
+    if (window < 0) window = 0;
+    for (int i = 0; i < la; i++) {
+        int lo = i > window ? i - window : 0, hi = i + window + 1 < lb ? i + window + 1 : lb;
+        for (int j = lo; j < hi; j++) {
+            if (!used_b[j] && a[i] == b[j]) {
+                used_a[i] = used_b[j] = 1;
+                matches++;
+                break;
+            }
+        }
+    }
+    if (matches == 0) return 0.0;
+    int transpositions = 0;
+    for (int i = 0, j = 0; i < la; i++) {
+        if (!used_a[i]) continue;
+        while (!used_b[j]) j++;
+        if (a[i] != b[j++]) transpositions++;
+    }
+    double m = matches;
+    double jaro = (m / la + m / lb + (m - transpositions / 2.0) / m) / 3.0;
+    int prefix = 0;
+    while (prefix < 4 && prefix < la && prefix < lb && a[prefix] == b[prefix]) prefix++;
+    return jaro + prefix * 0.1 * (1.0 - jaro);
+}
+
+double field_similarity(const char *a, const char *b) {
+    char na[PII_MAX_TEXT], nb[PII_MAX_TEXT];
+    normalize_name(a, na, sizeof(na));
+    normalize_name(b, nb, sizeof(nb));
+    return jaro_winkler(na, nb);
+}
+
+// Weighted similarity of c and a candidate row from STMT_BLOCK_CANDIDATES
+double duplicate_score(const Citizen *c, sqlite3_stmt *row) {
+    char scratch[PII_MAX_TEXT];
+    int len;
+    double score = 0.5 * field_similarity(c->name, pii_column(row, 1, scratch, &len));
+    score += 0.25 * field_similarity(c->mother_name, pii_column(row, 6, scratch, &len));
+    score += 0.15 * field_similarity(c->father_name, pii_column(row, 5, scratch, &len));
+    int dob = dob_key(c->dob), other = sqlite3_column_int(row, 2);
+    score += dob == other ? 0.1 : dob / 10000 == other / 10000 ? 0.05 : 0.0;
+    return score;
+}
+
+// Scores c against the citizens sharing its blocking keys, queues the likely
+// duplicates for review and files c under its keys. Returns the number flagged
+// (the best one in match, if given) or -1 on error.
+int index_duplicates(const Citizen *c, DuplicateMatch *match) {
+    sqlite3_int64 key, blocks[2];
+    if (!nid_key(c->nid, &key)) {
+        return -1;
+    }
+    duplicate_blocks(c, blocks);
+    if (match) {
+        match->nid[0] = '\0';
+        match->score = 0.0;
+        match->count = 0;
+    }
+
+    sqlite3_int64 flagged[DEDUP_MAX_CANDIDATES];
+    double scores[DEDUP_MAX_CANDIDATES];
+    int count = 0, rc;
+    sqlite3_stmt *stmt = stmt_acquire(STMT_BLOCK_CANDIDATES);
+    sqlite3_bind_int64(stmt, 1, blocks[0]);
+    sqlite3_bind_int64(stmt, 2, blocks[1]);
+    sqlite3_bind_int64(stmt, 3, key);
+    sqlite3_bind_int(stmt, 4, DEDUP_MAX_CANDIDATES);
+    while ((rc = sqlite3_step(stmt)) == SQLITE_ROW && count < DEDUP_MAX_CANDIDATES) {
+        double score = duplicate_score(c, stmt);
+        if (score < DEDUP_THRESHOLD) continue;
+        flagged[count] = sqlite3_column_int64(stmt, 0);
+        scores[count++] = score;
+        if (match && score > match->score) {
+            format_nid(flagged[count - 1], match->nid);
+            match->score = score;
+        }
+    }
+    stmt_release(STMT_BLOCK_CANDIDATES);
+    if (rc != SQLITE_DONE && rc != SQLITE_ROW) {
+        return -1;
+    }
+
+    int ok = 1;
+    for (int i = 0; i < count && ok; i++) {
+        stmt = stmt_acquire(STMT_REVIEW_INSERT);
+        sqlite3_bind_int64(stmt, 1, key);
+        sqlite3_bind_int64(stmt, 2, flagged[i]);
+        sqlite3_bind_double(stmt, 3, scores[i]);
+        sqlite3_bind_int64(stmt, 4, (sqlite3_int64)time(NULL));
+        ok = sqlite3_step(stmt) == SQLITE_DONE;
+        stmt_release(STMT_REVIEW_INSERT);
+    }
+    for (int i = 0; i < 2 && ok; i++) {
+        stmt = stmt_acquire(STMT_BLOCK_INSERT);
+        sqlite3_bind_int64(stmt, 1, blocks[i]);
+        sqlite3_bind_int64(stmt, 2, key);
+        ok = sqlite3_step(stmt) == SQLITE_DONE;
+        stmt_release(STMT_BLOCK_INSERT);
+    }
+    if (match) match->count = count;
+    return ok ? count : -1;
+}
+
+// Removes a citizen's blocking keys, and its pending reviews when it is deleted
+int drop_duplicate_blocks(sqlite3_int64 key, int deleted) {
+    sqlite3_stmt *stmt = stmt_acquire(STMT_BLOCK_DELETE);
+    sqlite3_bind_int64(stmt, 1, key);
+    int ok = sqlite3_step(stmt) == SQLITE_DONE;
+    stmt_release(STMT_BLOCK_DELETE);
+    if (ok && deleted) {
+        stmt = stmt_acquire(STMT_REVIEW_DELETE);
+        sqlite3_bind_int64(stmt, 1, key);
+        ok = sqlite3_step(stmt) == SQLITE_DONE;
+        stmt_release(STMT_REVIEW_DELETE);
+    }
+    return ok;
+}
+
+// Re-runs the check for a changed citizen if its blocking keys moved; filed holds
+// the lowest and highest key it is filed under now (NULL columns if none). Returns
+// the number flagged or -1 on error.
+int recheck_duplicates(const Citizen *c, sqlite3_stmt *filed, int col) {
+    sqlite3_int64 key, blocks[2];
+    if (!nid_key(c->nid, &key)) {
+        return -1;
+    }
+    duplicate_blocks(c, blocks);
+    sqlite3_int64 low = blocks[0] < blocks[1] ? blocks[0] : blocks[1];
+    sqlite3_int64 high = blocks[0] < blocks[1] ? blocks[1] : blocks[0];
+    if (sqlite3_column_type(filed, col) != SQLITE_NULL &&
+        sqlite3_column_int64(filed, col) == low && sqlite3_column_int64(filed, col + 1) == high) {
+        return 0;
+    }
+    return drop_duplicate_blocks(key, 0) ? index_duplicates(c, NULL) : -1;
+}
+
+// ================== CITIZEN OPERATIONS ==================
 void input_citizen(Citizen *citizen, int is_new) {
+    int valid = 0;
     printf("\nEnter Citizen Details:\n");
 
     printf("Full Name: ");
@@ -141,9 +1957,16 @@ void input_citizen(Citizen *citizen, int is_new) {
     }
     } while (!validate_date(citizen->dob));
 
-    printf("Gender (Male/Female): ");
-    scanf("%9s", citizen->gender);
-    clear_input_buffer();
+    do {
+        printf("Gender (Male/Female/Other): ");
+        scanf("%9s", citizen->gender);
+        clear_input_buffer();
+        valid = validate_gender(citizen->gender);
+        if (!valid) {
+            printf("Invalid gender. Please enter Male, Female or Other.\n");
+        }
+    } while (!valid);
+    strcpy(citizen->gender, gender_name(gender_code(citizen->gender)));
 
     printf("Address: ");
     scanf(" %199[^\n]", citizen->address);
@@ -157,18 +1980,11 @@ void input_citizen(Citizen *citizen, int is_new) {
     scanf(" %99[^\n]", citizen->mother_name);
     clear_input_buffer();
 
-    const char *valid_blood_groups[] = {"A+", "A-", "B+", "B-", "O+", "O-", "AB+", "AB-", NULL};
-    int valid = 0;
     do {
         printf("Blood Group (A+/A-/B+/B-/O+/O-/AB+/AB-): ");
         scanf("%3s", citizen->blood_group);
         clear_input_buffer();
-        for(int i = 0; valid_blood_groups[i] != NULL; i++) {
-            if(strcmp(citizen->blood_group, valid_blood_groups[i]) == 0) {
-                valid = 1;
-                break;
-            }
-        }
+        valid = validate_blood_group(citizen->blood_group);
         if (!valid) {
             printf("Invalid blood group. Please enter a valid one.\n");
         }
@@ -176,8 +1992,6 @@ void input_citizen(Citizen *citizen, int is_new) {
 
   
     if (is_new) {
-        generate_unique_nid(citizen->nid);
-        printf("Generated NID: %s\n", citizen->nid);
         citizen->is_active = 1;
         citizen->created_at = time(NULL);
     } else {
@@ -187,373 +2001,5746 @@ void input_citizen(Citizen *citizen, int is_new) {
         clear_input_buffer();
     }
 
-    citizen->last_modified = time(NULL);
+    citizen->last_modified = time(NULL);
+}
+// Binds all columns of the citizen INSERT statement
+void bind_citizen(sqlite3_stmt *stmt, const Citizen *citizen) {
+    sqlite3_int64 key = 0;
+    nid_key(citizen->nid, &key);
+    sqlite3_bind_int64(stmt, 1, key);
+    bind_pii(stmt, 2, citizen->name, key, 1);
+    sqlite3_bind_int(stmt, 3, dob_key(citizen->dob));
+    sqlite3_bind_int(stmt, 4, gender_code(citizen->gender));
+    bind_pii(stmt, 5, citizen->address, key, 4);
+    bind_pii(stmt, 6, citizen->father_name, key, 5);
+    bind_pii(stmt, 7, citizen->mother_name, key, 6);
+    sqlite3_bind_int(stmt, 8, blood_code(citizen->blood_group));
+    sqlite3_bind_int(stmt, 9, citizen->is_active);
+    sqlite3_bind_int64(stmt, 10, (sqlite3_int64)citizen->created_at);
+    sqlite3_bind_int64(stmt, 11, (sqlite3_int64)citizen->last_modified);
+    bind_blind_index(stmt, 12, citizen->name);
+    bind_blind_index(stmt, 13, citizen->father_name);
+    bind_blind_index(stmt, 14, citizen->mother_name);
+}
+
+// Copies a PII column (decrypted if need be) into a fixed-size field
+void copy_column(char *dst, size_t size, sqlite3_stmt *stmt, int col) {
+    char scratch[PII_MAX_TEXT];
+    int len;
+    const char *text = pii_column(stmt, col, scratch, &len);
+    if ((size_t)len >= size) len = (int)size - 1;
+    memcpy(dst, text, len);
+    dst[len] = '\0';
+}
+
+// Reads a "SELECT * FROM citizens" row
+void citizen_from_row(sqlite3_stmt *stmt, Citizen *c) {
+    format_nid(sqlite3_column_int64(stmt, 0), c->nid);
+    copy_column(c->name, sizeof(c->name), stmt, 1);
+    format_dob(sqlite3_column_int(stmt, 2), c->dob);
+    strcpy(c->gender, gender_name(sqlite3_column_int(stmt, 3)));
+    copy_column(c->address, sizeof(c->address), stmt, 4);
+    copy_column(c->father_name, sizeof(c->father_name), stmt, 5);
+    copy_column(c->mother_name, sizeof(c->mother_name), stmt, 6);
+    strcpy(c->blood_group, blood_group_name(sqlite3_column_int(stmt, 7)));
+    c->is_active = sqlite3_column_int(stmt, 8);
+    c->created_at = (time_t)sqlite3_column_int64(stmt, 9);
+    c->last_modified = (time_t)sqlite3_column_int64(stmt, 10);
+}
+
+#define NID_COLLISION_RETRIES 8
+
+// Allocates the citizen's NID and inserts the row. A retry is only needed when a
+// database still holds NIDs issued by the old random generator.
+//
+// The row and its duplicate check share a transaction: the caller's, or one of its own.
+int register_citizen(Citizen *citizen, DuplicateMatch *match) {
+    long long started = now_ns();
+    int own = sqlite3_get_autocommit(db);
+    if (own && sqlite3_exec(db, "BEGIN IMMEDIATE;", 0, 0, 0) != SQLITE_OK) {
+        op_record(OP_REGISTER, started);
+        return 0;
+    }
+    int saved = 0;
+    for (int attempt = 0; attempt < NID_COLLISION_RETRIES && !saved; attempt++) {
+        if (!generate_unique_nid(citizen->nid)) {
+            break;
+        }
+        sqlite3_int64 key = 0;
+        nid_key(citizen->nid, &key);
+        sqlite3_stmt *stmt = stmt_acquire_shard(STMT_CITIZEN_INSERT, citizen_shard(key));
+        bind_citizen(stmt, citizen);
+        int rc = sqlite3_step(stmt);
+        int extended_rc = sqlite3_extended_errcode(db);
+        stmt_release(STMT_CITIZEN_INSERT);
+        saved = rc == SQLITE_DONE;
+        if (!saved && extended_rc != SQLITE_CONSTRAINT_PRIMARYKEY) {
+            break;
+        }
+    }
+    if (saved && index_duplicates(citizen, match) < 0) {
+        fprintf(stderr, "Duplicate check failed: %s\n", sqlite3_errmsg(db));
+        saved = 0;
+    }
+    if (own) {
+        if (!saved || sqlite3_exec(db, "COMMIT;", 0, 0, 0) != SQLITE_OK) {
+            sqlite3_exec(db, "ROLLBACK;", 0, 0, 0);
+            saved = 0;
+        }
+    }
+    op_record(OP_REGISTER, started);
+    return saved;
+}
+
+int save_citizen(Citizen *citizen) {
+    return register_citizen(citizen, NULL);
+}
+// Returns 1 and fills out when the NID exists, 0 otherwise
+int find_citizen(const char *nid, Citizen *out) {
+    long long started = now_ns();
+    uint64_t epoch;
+    if (cache_get(nid, out, &epoch)) {
+        op_record(OP_SEARCH, started);
+        return 1;
+    }
+    sqlite3_int64 key;
+    if (!nid_key(nid, &key)) {
+        op_record(OP_SEARCH, started);
+        return 0;
+    }
+    sqlite3_stmt *stmt = stmt_acquire_shard(STMT_CITIZEN_SELECT, citizen_shard(key));
+    sqlite3_bind_int64(stmt, 1, key);
+    int found = 0;
+    if(sqlite3_step(stmt) == SQLITE_ROW) {
+        citizen_from_row(stmt, out);
+        found = 1;
+    }
+    stmt_release(STMT_CITIZEN_SELECT);
+    if (found) cache_put(out, epoch);
+    op_record(OP_SEARCH, started);
+    return found;
+}
+
+// Columns an update can change, in table order
+enum {
+    FIELD_NAME = 1 << 0,
+    FIELD_DOB = 1 << 1,
+    FIELD_GENDER = 1 << 2,
+    FIELD_ADDRESS = 1 << 3,
+    FIELD_FATHER = 1 << 4,
+    FIELD_MOTHER = 1 << 5,
+    FIELD_BLOOD = 1 << 6,
+    FIELD_ACTIVE = 1 << 7,
+    FIELD_ALL = (1 << UPDATE_FIELDS) - 1
+};
+
+const struct {
+    const char *column;
+    const char *prompt;
+} citizen_fields[UPDATE_FIELDS] = {
+    {"name", "Full Name"}, {"dob", "DOB (DD-MM-YYYY)"}, {"gender", "Gender (Male/Female/Other)"},
+    {"address", "Address"}, {"father_name", "Father Name"}, {"mother_name", "Mother Name"},
+    {"blood_group", "Blood Group (A+/A-/B+/B-/O+/O-/AB+/AB-)"}, {"is_active", "Is Active (1=Yes, 0=No)"}
+};
+
+// Validates value for one FIELD_* and stores it in c. Returns 0 if it is invalid.
+int set_citizen_field(Citizen *c, int field, const char *value) {
+    size_t len = strlen(value);
+    switch (field) {
+        case FIELD_NAME:
+            if (len == 0 || len >= sizeof(c->name)) return 0;
+            strcpy(c->name, value);
+            return 1;
+        case FIELD_DOB:
+            if (len >= sizeof(c->dob) || !validate_date(value)) return 0;
+            strcpy(c->dob, value);
+            return 1;
+        case FIELD_GENDER:
+            if (!validate_gender(value)) return 0;
+            strcpy(c->gender, gender_name(gender_code(value)));
+            return 1;
+        case FIELD_ADDRESS:
+            if (len == 0 || len >= sizeof(c->address)) return 0;
+            strcpy(c->address, value);
+            return 1;
+        case FIELD_FATHER:
+            if (len == 0 || len >= sizeof(c->father_name)) return 0;
+            strcpy(c->father_name, value);
+            return 1;
+        case FIELD_MOTHER:
+            if (len == 0 || len >= sizeof(c->mother_name)) return 0;
+            strcpy(c->mother_name, value);
+            return 1;
+        case FIELD_BLOOD:
+            if (!validate_blood_group(value)) return 0;
+            strcpy(c->blood_group, value);
+            return 1;
+        case FIELD_ACTIVE:
+            if (strcmp(value, "0") != 0 && strcmp(value, "1") != 0) return 0;
+            c->is_active = value[0] == '1';
+            return 1;
+    }
+    return 0;
+}
+
+// Comma-separated column names of the fields in mask, for the audit log
+void describe_fields(int mask, char *out, size_t size) {
+    size_t len = 0;
+    out[0] = '\0';
+    for (int i = 0; i < UPDATE_FIELDS; i++) {
+        if (mask & (1 << i)) {
+            len += snprintf(out + len, len < size ? size - len : 0, "%s%s", len ? "," : "", citizen_fields[i].column);
+        }
+    }
+}
+
+// One statement per field combination and shard, cached per connection like the
+// query statements
+sqlite3_stmt *update_statement(int mask, int shard) {
+    if (update_stmts[shard][mask]) {
+        return update_stmts[shard][mask];
+    }
+    char sql[512];
+    snprintf(sql, sizeof(sql), "UPDATE %s.citizens SET last_modified = ?9", citizen_schema(shard));
+    for (int i = 0; i < UPDATE_FIELDS; i++) {
+        if (mask & (1 << i)) {
+            snprintf(sql + strlen(sql), sizeof(sql) - strlen(sql), ", %s = ?%d", citizen_fields[i].column, i + 1);
+        }
+    }
+    if (mask & FIELD_NAME) strcat(sql, ", name_bidx = ?11");
+    if (mask & FIELD_FATHER) strcat(sql, ", father_bidx = ?12");
+    if (mask & FIELD_MOTHER) strcat(sql, ", mother_bidx = ?13");
+    strcat(sql, " WHERE nid = ?10 AND deleted_at IS NULL RETURNING *");
+    if (mask & (FIELD_NAME | FIELD_DOB | FIELD_MOTHER)) {
+        strcat(sql, ", (SELECT min(block) FROM citizen_blocks WHERE nid = ?10), "
+                    "(SELECT max(block) FROM citizen_blocks WHERE nid = ?10)");
+    }
+    strcat(sql, ";");
+    if (sqlite3_prepare_v3(db, sql, -1, SQLITE_PREPARE_PERSISTENT, &update_stmts[shard][mask], 0) != SQLITE_OK) {
+        fprintf(stderr, "Failed to prepare update: %s\n", sqlite3_errmsg(db));
+        return NULL;
+    }
+    return update_stmts[shard][mask];
+}
+
+// Writes only the fields in mask (and last_modified). The same statement tells
+// whether the NID exists, so no read is needed first. Returns 1 if the citizen
+// was updated, 0 if there is no such NID and -1 on error. The row and its
+// rewritten blocking keys go in the caller's transaction, or one of its own that
+// is rolled back on error.
+int update_citizen_fields(const char *nid, const Citizen *updated, int mask) {
+    long long started = now_ns();
+    sqlite3_int64 key;
+    if (!nid_key(nid, &key)) {
+        return 0;
+    }
+    sqlite3_stmt *stmt = update_statement(mask & FIELD_ALL, citizen_shard(key));
+    if (!stmt) {
+        return -1;
+    }
+    int own = sqlite3_get_autocommit(db);
+    if (own && sqlite3_exec(db, "BEGIN IMMEDIATE;", 0, 0, 0) != SQLITE_OK) {
+        fprintf(stderr, "Update failed: %s\n", sqlite3_errmsg(db));
+        op_record(OP_UPDATE, started);
+        return -1;
+    }
+    if (mask & FIELD_NAME) {
+        bind_pii(stmt, 1, updated->name, key, 1);
+        bind_blind_index(stmt, 11, updated->name);
+    }
+    if (mask & FIELD_DOB) sqlite3_bind_int(stmt, 2, dob_key(updated->dob));
+    if (mask & FIELD_GENDER) sqlite3_bind_int(stmt, 3, gender_code(updated->gender));
+    if (mask & FIELD_ADDRESS) bind_pii(stmt, 4, updated->address, key, 4);
+    if (mask & FIELD_FATHER) {
+        bind_pii(stmt, 5, updated->father_name, key, 5);
+        bind_blind_index(stmt, 12, updated->father_name);
+    }
+    if (mask & FIELD_MOTHER) {
+        bind_pii(stmt, 6, updated->mother_name, key, 6);
+        bind_blind_index(stmt, 13, updated->mother_name);
+    }
+    if (mask & FIELD_BLOOD) sqlite3_bind_int(stmt, 7, blood_code(updated->blood_group));
+    if (mask & FIELD_ACTIVE) sqlite3_bind_int(stmt, 8, updated->is_active);
+    sqlite3_bind_int64(stmt, 9, (sqlite3_int64)updated->last_modified);
+    sqlite3_bind_int64(stmt, 10, key);
+    int rc = sqlite3_step(stmt);
+    int result = rc == SQLITE_ROW ? 1 : rc == SQLITE_DONE ? 0 : -1;
+    if (result < 0) {
+        fprintf(stderr, "Update failed: %s\n", sqlite3_errmsg(db));
+    }
+    // Changes to the fields behind the blocking keys re-run the duplicate check
+    if (result == 1 && (mask & (FIELD_NAME | FIELD_DOB | FIELD_MOTHER))) {
+        Citizen current;
+        citizen_from_row(stmt, &current);
+        if (recheck_duplicates(&current, stmt, 15) < 0) {   // after the 15 citizens columns
+            fprintf(stderr, "Duplicate check failed: %s\n", sqlite3_errmsg(db));
+            result = -1;
+        }
+    }
+    sqlite3_reset(stmt);
+    sqlite3_clear_bindings(stmt);
+    if (rc == SQLITE_ROW) cache_invalidate(nid);    // even on error: a caller may still commit
+    if (own) {
+        if (result < 0 || sqlite3_exec(db, "COMMIT;", 0, 0, 0) != SQLITE_OK) {
+            sqlite3_exec(db, "ROLLBACK;", 0, 0, 0);
+            result = -1;
+        }
+        cache_transaction_done();
+    }
+    op_record(OP_UPDATE, started);
+    return result;
+}
+
+int update_citizen(const char *nid, const Citizen *updated) {
+    return update_citizen_fields(nid, updated, FIELD_ALL) == 1;
+}
+
+// Leaves a tombstone for purge_tombstones() to remove after the retention period.
+// Returns 1 if the citizen was deleted, 0 if there is no such (live) citizen and -1
+// on error. The blocking keys go in the caller's transaction, or one of its own.
+int delete_citizen(const char *nid) {
+    long long started = now_ns();
+    sqlite3_int64 key;
+    if (!nid_key(nid, &key)) {
+        return 0;
+    }
+    int own = sqlite3_get_autocommit(db);
+    if (own && sqlite3_exec(db, "BEGIN IMMEDIATE;", 0, 0, 0) != SQLITE_OK) {
+        op_record(OP_DELETE, started);
+        return -1;
+    }
+    sqlite3_stmt *delete_stmt = stmt_acquire_shard(STMT_CITIZEN_DELETE, citizen_shard(key));
+    sqlite3_bind_int64(delete_stmt, 1, key);
+    sqlite3_bind_int64(delete_stmt, 2, (sqlite3_int64)time(NULL));
+    int result = sqlite3_step(delete_stmt) == SQLITE_DONE ? sqlite3_changes(db) > 0 : -1;
+    stmt_release(STMT_CITIZEN_DELETE);
+    if (result == 1 && !drop_duplicate_blocks(key, 1)) {
+        result = -1;
+    }
+    if (own) {
+        if (result < 0 || sqlite3_exec(db, "COMMIT;", 0, 0, 0) != SQLITE_OK) {
+            sqlite3_exec(db, "ROLLBACK;", 0, 0, 0);
+            result = -1;
+        }
+    }
+    if (result == 1) cache_invalidate(nid);
+    op_record(OP_DELETE, started);
+    return result;
+}
+
+void display_citizen(const Citizen *citizen) {
+    printf("\nNID: %s\nName: %s\nDOB: %s\nGender: %s\nAddress: %s\nFather: %s\nMother: %s\nBlood Group: %s\nStatus: %s\nCreated: %sLast Modified: %s",
+           citizen->nid, citizen->name, citizen->dob, citizen->gender, citizen->address, citizen->father_name,
+           citizen->mother_name, citizen->blood_group, citizen->is_active ? "Active" : "Inactive",
+           ctime(&citizen->created_at), ctime(&citizen->last_modified));
+}
+
+// ================== AUDIT LOG ==================
+// audit_log() is the single entry point for recording activity. A caller already
+// inside a write transaction (bulk import, the server's writer thread) adds the
+// row to that transaction. Everyone else pushes the event into a ring buffer that
+// a background thread drains in batched transactions, so read paths never wait
+// on a journal sync. The ring is flushed completely by audit_stop().
+#define AUDIT_RING_SIZE 8192
+#define AUDIT_BATCH_SIZE 512
+#define AUDIT_FLUSH_MS 100
+#define AUDIT_MAX_RETRIES 5
+#define AUDIT_ACTIVITY_LEN 48
+#define AUDIT_DETAILS_LEN 96
+
+typedef struct {
+    char nid[20];
+    char activity[AUDIT_ACTIVITY_LEN];
+    char details[AUDIT_DETAILS_LEN];    // "" when there are none
+    time_t timestamp;
+} AuditEvent;
+
+struct {
+    pthread_mutex_t lock;
+    pthread_cond_t not_empty;
+    pthread_cond_t not_full;
+    pthread_cond_t flushed;
+    AuditEvent events[AUDIT_RING_SIZE];
+    unsigned long long head;      // events pushed
+    unsigned long long tail;      // events taken by the writer
+    unsigned long long written;   // events committed (or given up on)
+    int running;
+    int stopping;
+    pthread_t thread;
+} audit_ring = {.lock = PTHREAD_MUTEX_INITIALIZER, .not_empty = PTHREAD_COND_INITIALIZER,
+                .not_full = PTHREAD_COND_INITIALIZER, .flushed = PTHREAD_COND_INITIALIZER};
+
+int insert_audit_row(const char *nid, const char *activity, const char *details, time_t timestamp) {
+    sqlite3_stmt *stmt = stmt_acquire(STMT_AUDIT_INSERT);
+    sqlite3_bind_text(stmt, 1, nid, -1, SQLITE_STATIC);
+    sqlite3_bind_int64(stmt, 2, (sqlite3_int64)timestamp);
+    sqlite3_bind_text(stmt, 3, activity, -1, SQLITE_STATIC);
+    if (has_value(details)) sqlite3_bind_text(stmt, 4, details, -1, SQLITE_STATIC);
+    else sqlite3_bind_null(stmt, 4);
+    int rc = sqlite3_step(stmt);
+    stmt_release(STMT_AUDIT_INSERT);
+    return rc == SQLITE_DONE;
+}
+
+// Writes one batch in a single transaction, retrying while the database is busy
+int write_audit_batch(const AuditEvent *batch, int count) {
+    for (int attempt = 0; attempt < AUDIT_MAX_RETRIES; attempt++) {
+        int ok = sqlite3_exec(db, "BEGIN IMMEDIATE;", 0, 0, 0) == SQLITE_OK;
+        for (int i = 0; ok && i < count; i++) {
+            ok = insert_audit_row(batch[i].nid, batch[i].activity, batch[i].details, batch[i].timestamp);
+        }
+        if (ok && sqlite3_exec(db, "COMMIT;", 0, 0, 0) == SQLITE_OK) {
+            return 1;
+        }
+        sqlite3_exec(db, "ROLLBACK;", 0, 0, 0);
+    }
+    fprintf(stderr, "Audit log: dropped %d events: %s\n", count, sqlite3_errmsg(db));
+    return 0;
+}
+
+void *audit_thread(void *arg) {
+    (void)arg;
+    AuditEvent batch[AUDIT_BATCH_SIZE];
+    if (!open_thread_connection(SQLITE_OPEN_READWRITE)) {
+        exit(EXIT_FAILURE);
+    }
+    pthread_mutex_lock(&audit_ring.lock);
+    while (1) {
+        if (audit_ring.head == audit_ring.tail) {
+            if (audit_ring.stopping) break;
+            struct timespec deadline;
+            clock_gettime(CLOCK_REALTIME, &deadline);
+            deadline.tv_nsec += AUDIT_FLUSH_MS * 1000000L;
+            if (deadline.tv_nsec >= 1000000000L) {
+                deadline.tv_sec++;
+                deadline.tv_nsec -= 1000000000L;
+            }
+            pthread_cond_timedwait(&audit_ring.not_empty, &audit_ring.lock, &deadline);
+            continue;
+        }
+        int count = 0;
+        while (audit_ring.tail != audit_ring.head && count < AUDIT_BATCH_SIZE) {
+            batch[count++] = audit_ring.events[audit_ring.tail++ % AUDIT_RING_SIZE];
+        }
+        pthread_cond_broadcast(&audit_ring.not_full);
+        pthread_mutex_unlock(&audit_ring.lock);
+
+        write_audit_batch(batch, count);
+
+        pthread_mutex_lock(&audit_ring.lock);
+        audit_ring.written += count;
+        pthread_cond_broadcast(&audit_ring.flushed);
+    }
+    pthread_mutex_unlock(&audit_ring.lock);
+    close_connection();
+    return NULL;
+}
+
+int audit_start() {
+    pthread_mutex_lock(&audit_ring.lock);
+    audit_ring.stopping = 0;
+    pthread_mutex_unlock(&audit_ring.lock);
+    if (pthread_create(&audit_ring.thread, NULL, audit_thread, NULL) != 0) {
+        fprintf(stderr, "Audit log: cannot start writer thread, logging synchronously\n");
+        return 0;
+    }
+    audit_ring.running = 1;
+    return 1;
+}
+
+void audit_stop() {
+    if (!audit_ring.running) {
+        return;
+    }
+    pthread_mutex_lock(&audit_ring.lock);
+    audit_ring.stopping = 1;
+    pthread_cond_signal(&audit_ring.not_empty);
+    pthread_mutex_unlock(&audit_ring.lock);
+    pthread_join(audit_ring.thread, NULL);
+    audit_ring.running = 0;
+}
+
+// Waits until every event pushed so far has been written
+void audit_flush() {
+    if (!audit_ring.running) {
+        return;
+    }
+    pthread_mutex_lock(&audit_ring.lock);
+    unsigned long long target = audit_ring.head;
+    pthread_cond_signal(&audit_ring.not_empty);
+    while (audit_ring.written < target) {
+        pthread_cond_wait(&audit_ring.flushed, &audit_ring.lock);
+    }
+    pthread_mutex_unlock(&audit_ring.lock);
+}
+
+// details may be NULL. Returns 0 only when an inline insert failed; a caller inside a
+// write transaction must then roll back rather than commit the change unaudited.
+int audit_log_details(const char *nid, const char *activity, const char *details) {
+    time_t now = time(NULL);
+    if (!audit_ring.running || !sqlite3_get_autocommit(db)) {
+        return insert_audit_row(nid, activity, details, now);
+    }
+    pthread_mutex_lock(&audit_ring.lock);
+    while (audit_ring.head - audit_ring.tail == AUDIT_RING_SIZE) {
+        pthread_cond_wait(&audit_ring.not_full, &audit_ring.lock);
+    }
+    AuditEvent *event = &audit_ring.events[audit_ring.head++ % AUDIT_RING_SIZE];
+    snprintf(event->nid, sizeof(event->nid), "%s", nid);
+    snprintf(event->activity, sizeof(event->activity), "%s", activity);
+    snprintf(event->details, sizeof(event->details), "%s", details ? details : "");
+    event->timestamp = now;
+    if (audit_ring.head - audit_ring.tail >= AUDIT_BATCH_SIZE) {
+        pthread_cond_signal(&audit_ring.not_empty);
+    }
+    pthread_mutex_unlock(&audit_ring.lock);
+    return 1;
+}
+
+int audit_log(const char *nid, const char *activity) {
+    return audit_log_details(nid, activity, NULL);
+}
+
+// ================== AUDIT QUERY ==================
+// Newest first, filtered by any mix of NID, activity and time range. Every
+// combination is served by one of the audit indexes, so a page costs the same
+// however long the history grows.
+#define AUDIT_DEFAULT_LIMIT 50
+#define AUDIT_MAX_LIMIT 1000
+#define AUDIT_CURSOR_LEN 48
+
+enum {
+    AUDIT_BY_NID = 1 << 0,
+    AUDIT_BY_ACTIVITY = 1 << 1,
+    AUDIT_FROM = 1 << 2,
+    AUDIT_TO = 1 << 3,
+    AUDIT_BEFORE = 1 << 4
+};
+
+typedef struct {
+    const char *nid;
+    const char *activity;
+    time_t from;            // inclusive; 0 for no lower bound
+    time_t to;              // exclusive; 0 for no upper bound
+    const char *before;     // "timestamp:id" cursor from the previous page
+    int limit;
+} AuditQuery;
+
+sqlite3_stmt *audit_query_statement(int mask) {
+    if (audit_query_stmts[mask]) {
+        return audit_query_stmts[mask];
+    }
+    char sql[512] = "SELECT id, nid, timestamp, activity_type, details FROM audit_logs WHERE 1";
+    if (mask & AUDIT_BY_NID)      strcat(sql, " AND nid = ?1");
+    if (mask & AUDIT_BY_ACTIVITY) strcat(sql, " AND activity_type = ?2");
+    if (mask & AUDIT_FROM)        strcat(sql, " AND timestamp >= ?3");
+    if (mask & AUDIT_TO)          strcat(sql, " AND timestamp < ?4");
+    if (mask & AUDIT_BEFORE)      strcat(sql, " AND timestamp <= ?5 AND (timestamp < ?5 OR id < ?6)");
+    strcat(sql, " ORDER BY timestamp DESC, id DESC LIMIT ?7;");
+    if (sqlite3_prepare_v3(db, sql, -1, SQLITE_PREPARE_PERSISTENT, &audit_query_stmts[mask], 0) != SQLITE_OK) {
+        fprintf(stderr, "Failed to prepare audit query: %s\n", sqlite3_errmsg(db));
+        return NULL;
+    }
+    return audit_query_stmts[mask];
+}
+
+// Calls on_row with the statement positioned on each (id, nid, timestamp, activity_type, details)
+// row and returns the row count, -1 on error or -2 if the NID filter is not a valid NID.
+// next_cursor (AUDIT_CURSOR_LEN bytes) receives the cursor for the next page, or "" on the last one.
+int query_audit_logs(const AuditQuery *q, void (*on_row)(sqlite3_stmt*, void*), void *ctx, char *next_cursor) {
+    long long started = now_ns();
+    char nid[20];
+    next_cursor[0] = '\0';
+    if (has_value(q->nid) && !canonical_nid(q->nid, nid)) {
+        return -2;
+    }
+    int limit = q->limit > 0 ? q->limit : AUDIT_DEFAULT_LIMIT;
+    if (limit > AUDIT_MAX_LIMIT) limit = AUDIT_MAX_LIMIT;
+    long long before_ts = 0, before_id = 0;
+    int has_before = has_value(q->before) && sscanf(q->before, "%lld:%lld", &before_ts, &before_id) == 2;
+
+    int mask = (has_value(q->nid) ? AUDIT_BY_NID : 0) |
+               (has_value(q->activity) ? AUDIT_BY_ACTIVITY : 0) |
+               (q->from ? AUDIT_FROM : 0) |
+               (q->to ? AUDIT_TO : 0) |
+               (has_before ? AUDIT_BEFORE : 0);
+    sqlite3_stmt *stmt = audit_query_statement(mask);
+    if (!stmt) {
+        return -1;
+    }
+    if (mask & AUDIT_BY_NID) sqlite3_bind_text(stmt, 1, nid, -1, SQLITE_STATIC);
+    if (mask & AUDIT_BY_ACTIVITY) sqlite3_bind_text(stmt, 2, q->activity, -1, SQLITE_STATIC);
+    if (mask & AUDIT_FROM) sqlite3_bind_int64(stmt, 3, (sqlite3_int64)q->from);
+    if (mask & AUDIT_TO) sqlite3_bind_int64(stmt, 4, (sqlite3_int64)q->to);
+    if (mask & AUDIT_BEFORE) {
+        sqlite3_bind_int64(stmt, 5, before_ts);
+        sqlite3_bind_int64(stmt, 6, before_id);
+    }
+    sqlite3_bind_int(stmt, 7, limit);
+
+    int count = 0, rc;
+    long long last_ts = 0, last_id = 0;
+    while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+        last_id = sqlite3_column_int64(stmt, 0);
+        last_ts = sqlite3_column_int64(stmt, 2);
+        on_row(stmt, ctx);
+        count++;
+    }
+    if (rc != SQLITE_DONE) {
+        fprintf(stderr, "Audit query failed: %s\n", sqlite3_errmsg(db));
+        count = -1;
+    }
+    sqlite3_reset(stmt);
+    sqlite3_clear_bindings(stmt);
+
+    if (count == limit) {
+        snprintf(next_cursor, AUDIT_CURSOR_LEN, "%lld:%lld", last_ts, last_id);
+    }
+    op_record(OP_AUDIT, started);
+    return count;
+}
+
+// ================== CITIZEN QUERY ==================
+#define QUERY_DEFAULT_LIMIT 20
+#define QUERY_MAX_LIMIT 1000
+#define QUERY_FTS_MAX 1024
+
+enum {
+    QUERY_NAME = 1 << 0,
+    QUERY_DOB_FROM = 1 << 1,
+    QUERY_FATHER = 1 << 2,
+    QUERY_MOTHER = 1 << 3,
+    QUERY_BLOOD = 1 << 4,
+    QUERY_TEXT = 1 << 5,
+    QUERY_DOB_TO = 1 << 6
+};
+
+// Empty or NULL filters (and zero DOB bounds) are ignored. Results are ordered by
+// NID; pass the previous page's next_cursor as after_nid to continue.
+typedef struct {
+    const char *name_prefix;        // the full name when field encryption is on
+    int dob_from;           // inclusive YYYYMMDD bounds, see dob_key()
+    int dob_to;
+    const char *father_name;
+    const char *mother_name;
+    const char *blood_group;
+    const char *address;    // words matched as prefixes within the address
+    const char *text;       // words matched as prefixes in any name or the address
+    const char *after_nid;
+    int limit;
+} CitizenQuery;
+
+// Appends each word of input as a quoted FTS5 prefix term, optionally scoped to a column
+int append_fts_terms(char *out, size_t size, const char *column, const char *input) {
+    size_t len = strlen(out);
+    const char *p = input;
+    while (*p) {
+        while (*p == ' ') p++;
+        if (!*p) break;
+        len += snprintf(out + len, len < size ? size - len : 0, "%s%s%s\"",
+                        len ? " AND " : "", column ? column : "", column ? " : " : "");
+        for (; *p && *p != ' '; p++) {
+            if (len + 3 >= size) return 0;
+            if (*p == '"') out[len++] = '"';
+            out[len++] = *p;
+        }
+        len += snprintf(out + len, len < size ? size - len : 0, "\"*");
+        if (len >= size) return 0;
+    }
+    return 1;
+}
+
+sqlite3_stmt *query_statement(int mask) {
+    if (query_stmts[mask]) {
+        return query_stmts[mask];
+    }
+    char sql[1024] = "SELECT * FROM citizens WHERE nid > ?1 AND deleted_at IS NULL";
+    // Encrypted names can only be matched exactly, through their blind indexes
+    if (mask & QUERY_NAME)   strcat(sql, pii_encryption ? " AND name_bidx = ?2" : " AND name >= ?2 AND name < ?3");
+    if (mask & QUERY_DOB_FROM) strcat(sql, " AND dob >= ?4");
+    if (mask & QUERY_DOB_TO) strcat(sql, " AND dob <= ?10");
+    if (mask & QUERY_FATHER) strcat(sql, pii_encryption ? " AND father_bidx = ?5" : " AND father_name = ?5");
+    if (mask & QUERY_MOTHER) strcat(sql, pii_encryption ? " AND mother_bidx = ?6" : " AND mother_name = ?6");
+    if (mask & QUERY_BLOOD)  strcat(sql, " AND blood_group = ?7");
+    if ((mask & QUERY_TEXT) && !db_shards) {
+        strcat(sql, " AND nid IN (SELECT rowid FROM citizens_fts WHERE citizens_fts MATCH ?8)");
+    } else if (mask & QUERY_TEXT) {
+        // Each shard has its own word index
+        strcat(sql, " AND nid IN (");
+        for (int i = 0; i < db_shards; i++) {
+            snprintf(sql + strlen(sql), sizeof(sql) - strlen(sql), "%sSELECT rowid FROM %s.citizens_fts(?8)",
+                     i ? " UNION ALL " : "", shard_schemas[i]);
+        }
+        strcat(sql, ")");
+    }
+    strcat(sql, " ORDER BY nid LIMIT ?9;");
+    if (sqlite3_prepare_v3(db, sql, -1, SQLITE_PREPARE_PERSISTENT, &query_stmts[mask], 0) != SQLITE_OK) {
+        fprintf(stderr, "Failed to prepare query: %s\n", sqlite3_errmsg(db));
+        return NULL;
+    }
+    return query_stmts[mask];
+}
+
+// Narrows a DOB range to citizens aged min_age..max_age today; -1 leaves that side open.
+// Someone is at least min_age if born on or before today's date min_age years ago.
+void age_to_dob_range(int min_age, int max_age, int *dob_from, int *dob_to) {
+    time_t now = time(NULL);
+    struct tm tm;
+    localtime_r(&now, &tm);
+    int today = (tm.tm_year + 1900) * 10000 + (tm.tm_mon + 1) * 100 + tm.tm_mday;
+    if (min_age >= 0) {
+        int to = today - min_age * 10000;
+        if (!*dob_to || to < *dob_to) *dob_to = to;
+    }
+    if (max_age >= 0) {
+        int from = today - (max_age + 1) * 10000 + 1;
+        if (from > *dob_from) *dob_from = from;
+    }
+}
+
+// Calls on_row for each match and returns the number of rows, or -1 on error.
+// next_cursor (at least 20 bytes) receives the NID to resume from, or "" on the last page.
+int query_citizens(const CitizenQuery *q, void (*on_row)(const Citizen*, void*), void *ctx, char *next_cursor) {
+    long long started = now_ns();
+    int limit = q->limit > 0 ? q->limit : QUERY_DEFAULT_LIMIT;
+    if (limit > QUERY_MAX_LIMIT) limit = QUERY_MAX_LIMIT;
+
+    char fts[QUERY_FTS_MAX] = "";
+    if (pii_encryption && (has_value(q->address) || has_value(q->text))) {
+        fprintf(stderr, "Word search is not available while field encryption is on\n");
+        return -1;
+    }
+    if ((has_value(q->address) && !append_fts_terms(fts, sizeof(fts), "address", q->address)) ||
+        (has_value(q->text) && !append_fts_terms(fts, sizeof(fts), NULL, q->text))) {
+        return -1;
+    }
+    // Any string starting with the prefix sorts below prefix + 0xFF
+    char name_upper[MAX_NAME + 1] = "";
+    if (has_value(q->name_prefix)) {
+        snprintf(name_upper, sizeof(name_upper), "%.*s\xff", MAX_NAME - 1, q->name_prefix);
+    }
+
+    sqlite3_int64 after = -1;
+    if (has_value(q->after_nid) && !nid_key(q->after_nid, &after)) {
+        return -1;
+    }
+
+    int mask = (has_value(q->name_prefix) ? QUERY_NAME : 0) |
+               (q->dob_from > 0 ? QUERY_DOB_FROM : 0) |
+               (q->dob_to > 0 ? QUERY_DOB_TO : 0) |
+               (has_value(q->father_name) ? QUERY_FATHER : 0) |
+               (has_value(q->mother_name) ? QUERY_MOTHER : 0) |
+               (has_value(q->blood_group) ? QUERY_BLOOD : 0) |
+               (fts[0] ? QUERY_TEXT : 0);
+    sqlite3_stmt *stmt = query_statement(mask);
+    if (!stmt) {
+        return -1;
+    }
+    sqlite3_bind_int64(stmt, 1, after);
+    if ((mask & QUERY_NAME) && pii_encryption) {
+        bind_blind_index(stmt, 2, q->name_prefix);
+    } else if (mask & QUERY_NAME) {
+        sqlite3_bind_text(stmt, 2, q->name_prefix, -1, SQLITE_STATIC);
+        sqlite3_bind_text(stmt, 3, name_upper, -1, SQLITE_STATIC);
+    }
+    if (mask & QUERY_DOB_FROM) sqlite3_bind_int(stmt, 4, q->dob_from);
+    if (mask & QUERY_DOB_TO) sqlite3_bind_int(stmt, 10, q->dob_to);
+    if ((mask & QUERY_FATHER) && pii_encryption) bind_blind_index(stmt, 5, q->father_name);
+    else if (mask & QUERY_FATHER) sqlite3_bind_text(stmt, 5, q->father_name, -1, SQLITE_STATIC);
+    if ((mask & QUERY_MOTHER) && pii_encryption) bind_blind_index(stmt, 6, q->mother_name);
+    else if (mask & QUERY_MOTHER) sqlite3_bind_text(stmt, 6, q->mother_name, -1, SQLITE_STATIC);
+    if (mask & QUERY_BLOOD) sqlite3_bind_int(stmt, 7, blood_code(q->blood_group));
+    if (mask & QUERY_TEXT) sqlite3_bind_text(stmt, 8, fts, -1, SQLITE_STATIC);
+    sqlite3_bind_int(stmt, 9, limit);
+
+    int count = 0, rc;
+    Citizen c;
+    while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+        citizen_from_row(stmt, &c);
+        on_row(&c, ctx);
+        count++;
+    }
+    if (rc != SQLITE_DONE) {
+        fprintf(stderr, "Query failed: %s\n", sqlite3_errmsg(db));
+        count = -1;
+    }
+    sqlite3_reset(stmt);
+    sqlite3_clear_bindings(stmt);
+
+    next_cursor[0] = '\0';
+    if (count == limit) {
+        strcpy(next_cursor, c.nid);
+    }
+    op_record(OP_QUERY, started);
+    return count;
+}
+
+// ================== DEMOGRAPHIC STATISTICS ==================
+// Head counts by gender, blood group, birth decade and status live in citizen_stats,
+// one counter per combination, kept by triggers on citizens (schema migration 7) so
+// they change in the same transaction as the row. A report reads a few hundred
+// counters whatever the size of the register. A sharded database keeps each
+// shard's counters in its own file and reads them through a TEMP view.
+// rebuild_statistics() recounts every row in parallel to check them.
+#define STATS_MAX_CELLS 4096
+#define STATS_MAX_SCANS 64
+
+// Codes as stored (see gender_code()); -1 matches any value
+typedef struct {
+    int gender;
+    int blood_group;
+    int birth_decade;       // e.g. 1990 for 1990-1999
+    int is_active;
+} StatsFilter;
+
+const char *stats_columns[STATS_DIMENSIONS] = {"gender", "blood_group", "birth_decade", "is_active"};
+
+// The total (breakdown == STATS_DIMENSIONS) or the counts by one column, for the
+// filter combination in mask; cached per connection like the query statements
+sqlite3_stmt *stats_statement(int mask, int breakdown) {
+    if (stats_stmts[mask][breakdown]) {
+        return stats_stmts[mask][breakdown];
+    }
+    char sql[512];
+    if (breakdown == STATS_DIMENSIONS) {
+        strcpy(sql, "SELECT NULL, SUM(count) FROM citizen_stats WHERE count != 0");
+    } else {
+        snprintf(sql, sizeof(sql), "SELECT %s, SUM(count) FROM citizen_stats WHERE count != 0", stats_columns[breakdown]);
+    }
+    for (int i = 0; i < STATS_DIMENSIONS; i++) {
+        if (mask & (1 << i)) {
+            snprintf(sql + strlen(sql), sizeof(sql) - strlen(sql), " AND %s = ?%d", stats_columns[i], i + 1);
+        }
+    }
+    if (breakdown < STATS_DIMENSIONS) strcat(sql, " GROUP BY 1 ORDER BY 1");
+    strcat(sql, ";");
+    if (sqlite3_prepare_v3(db, sql, -1, SQLITE_PREPARE_PERSISTENT, &stats_stmts[mask][breakdown], 0) != SQLITE_OK) {
+        fprintf(stderr, "Failed to prepare statistics: %s\n", sqlite3_errmsg(db));
+        return NULL;
+    }
+    return stats_stmts[mask][breakdown];
+}
+
+void append_stats_value(Buffer *out, int column, int value) {
+    if (column == 0) buf_printf(out, "%s", value ? gender_name(value) : "unknown");
+    else if (column == 1) buf_printf(out, "%s", value ? blood_group_name(value) : "unknown");
+    else if (column == 2) buf_printf(out, "%ds", value);
+    else buf_printf(out, "%s", value ? "active" : "inactive");
+}
+
+// Sets the filter named by column from value, which is read as the request or as
+// append_stats_value() writes it ("unknown", "1990s", "active"). Returns 0 if the
+// value does not parse, -1 if there is no such column.
+int set_stats_filter(StatsFilter *f, const char *column, const char *value) {
+    char *end;
+    if (strcmp(column, "gender") == 0) {
+        f->gender = strcasecmp(value, "unknown") == 0 ? 0 : gender_code(value);
+        return f->gender > 0 || strcasecmp(value, "unknown") == 0;
+    }
+    if (strcmp(column, "blood") == 0) {
+        f->blood_group = strcasecmp(value, "unknown") == 0 ? 0 : blood_code(value);
+        return f->blood_group > 0 || strcasecmp(value, "unknown") == 0;
+    }
+    if (strcmp(column, "decade") == 0) {
+        long year = strtol(value, &end, 10);
+        if (end == value || (*end && strcmp(end, "s") != 0) || year < 0 || year > 9999) return 0;
+        f->birth_decade = (int)year / 10 * 10;
+        return 1;
+    }
+    if (strcmp(column, "active") == 0) {
+        if (strcmp(value, "1") == 0 || strcmp(value, "active") == 0) f->is_active = 1;
+        else if (strcmp(value, "0") == 0 || strcmp(value, "inactive") == 0) f->is_active = 0;
+        else return 0;
+        return 1;
+    }
+    return -1;
+}
+
+// Appends "\ntotal\t-\t<count>" and then "\n<column>\t<value>\t<count>" for each value
+// of each column, counting only citizens that match f. Returns 0 on error.
+int citizen_statistics(const StatsFilter *f, Buffer *out) {
+    int values[STATS_DIMENSIONS] = {f->gender, f->blood_group, f->birth_decade, f->is_active};
+    int mask = 0;
+    for (int i = 0; i < STATS_DIMENSIONS; i++) {
+        if (values[i] >= 0) mask |= 1 << i;
+    }
+    // The total first, then each column
+    for (int step = 0; step <= STATS_DIMENSIONS; step++) {
+        int breakdown = step ? step - 1 : STATS_DIMENSIONS;
+        sqlite3_stmt *stmt = stats_statement(mask, breakdown);
+        if (!stmt) {
+            return 0;
+        }
+        for (int i = 0; i < STATS_DIMENSIONS; i++) {
+            if (mask & (1 << i)) sqlite3_bind_int(stmt, i + 1, values[i]);
+        }
+        int rc;
+        while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+            if (breakdown == STATS_DIMENSIONS) {
+                buf_printf(out, "\ntotal\t-\t%lld", sqlite3_column_int64(stmt, 1));
+                continue;
+            }
+            buf_printf(out, "\n%s\t", stats_columns[breakdown]);
+            append_stats_value(out, breakdown, sqlite3_column_int(stmt, 0));
+            buf_printf(out, "\t%lld", sqlite3_column_int64(stmt, 1));
+        }
+        sqlite3_reset(stmt);
+        if (rc != SQLITE_DONE) {
+            fprintf(stderr, "Statistics failed: %s\n", sqlite3_errmsg(db));
+            return 0;
+        }
+    }
+    return 1;
+}
+
+typedef struct {
+    int key[STATS_DIMENSIONS];
+    long long count;
+} StatsCell;
+
+typedef struct {
+    StatsCell cells[STATS_MAX_CELLS];
+    int count;
+} StatsTable;
+
+// Adds n to the counter for key. Returns 0 if the table is full.
+int stats_add(StatsTable *t, const int key[STATS_DIMENSIONS], long long n) {
+    for (int i = 0; i < t->count; i++) {
+        if (memcmp(t->cells[i].key, key, sizeof(t->cells[i].key)) == 0) {
+            t->cells[i].count += n;
+            return 1;
+        }
+    }
+    if (t->count == STATS_MAX_CELLS) {
+        return 0;
+    }
+    memcpy(t->cells[t->count].key, key, sizeof(t->cells[t->count].key));
+    t->cells[t->count++].count = n;
+    return 1;
+}
+
+long long stats_get(const StatsTable *t, const int key[STATS_DIMENSIONS]) {
+    for (int i = 0; i < t->count; i++) {
+        if (memcmp(t->cells[i].key, key, sizeof(t->cells[i].key)) == 0) return t->cells[i].count;
+    }
+    return 0;
+}
+
+// Counts the rows of one file (schema) with NIDs in [from, to)
+typedef struct {
+    const char *schema;
+    sqlite3_int64 from;
+    sqlite3_int64 to;
+    StatsTable *counted;
+    int ok;
+} StatsScan;
+
+void *stats_scan_thread(void *arg) {
+    StatsScan *scan = arg;
+    scan->ok = 0;
+    if (!open_thread_connection(SQLITE_OPEN_READONLY)) {
+        return NULL;
+    }
+    sqlite3_stmt *stmt;
+    char sql[256];
+    snprintf(sql, sizeof(sql), "SELECT gender, blood_group, dob / 100000 * 10, is_active, COUNT(*) FROM %s.citizens "
+                               "WHERE nid >= ?1 AND nid < ?2 AND deleted_at IS NULL GROUP BY 1, 2, 3, 4;", scan->schema);
+    if (sqlite3_prepare_v2(db, sql, -1, &stmt, 0) == SQLITE_OK) {
+        sqlite3_bind_int64(stmt, 1, scan->from);
+        sqlite3_bind_int64(stmt, 2, scan->to);
+        int rc, ok = 1;
+        while (ok && (rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+            int key[STATS_DIMENSIONS];
+            for (int i = 0; i < STATS_DIMENSIONS; i++) key[i] = sqlite3_column_int(stmt, i);
+            ok = stats_add(scan->counted, key, sqlite3_column_int64(stmt, 4));
+        }
+        scan->ok = ok && rc == SQLITE_DONE;
+        sqlite3_finalize(stmt);
+    }
+    if (!scan->ok) fprintf(stderr, "Statistics: scanning %s failed: %s\n", scan->schema, sqlite3_errmsg(db));
+    close_connection();
+    return NULL;
+}
+
+// Compares the counters of one file with a recount, and rewrites them if any
+// differ. Returns the number that were wrong, or -1 on error.
+int stats_repair(const char *schema, const StatsTable *counted) {
+    StatsTable *stored = calloc(1, sizeof(StatsTable));
+    sqlite3_stmt *stmt;
+    char sql[256];
+    int ok = stored != NULL, wrong = 0;
+    snprintf(sql, sizeof(sql), "SELECT gender, blood_group, birth_decade, is_active, count FROM %s.citizen_stats "
+                               "WHERE count != 0;", schema);
+    if (ok && sqlite3_prepare_v2(db, sql, -1, &stmt, 0) == SQLITE_OK) {
+        while (ok && sqlite3_step(stmt) == SQLITE_ROW) {
+            int key[STATS_DIMENSIONS];
+            for (int i = 0; i < STATS_DIMENSIONS; i++) key[i] = sqlite3_column_int(stmt, i);
+            ok = stats_add(stored, key, sqlite3_column_int64(stmt, 4));
+        }
+        sqlite3_finalize(stmt);
+    } else {
+        ok = 0;
+    }
+    for (int i = 0; ok && i < counted->count; i++) {
+        wrong += stats_get(stored, counted->cells[i].key) != counted->cells[i].count;
+    }
+    for (int i = 0; ok && i < stored->count; i++) {
+        wrong += stats_get(counted, stored->cells[i].key) == 0;
+    }
+    free(stored);
+    if (ok && wrong) {
+        snprintf(sql, sizeof(sql), "DELETE FROM %s.citizen_stats;", schema);
+        ok = sqlite3_exec(db, sql, 0, 0, 0) == SQLITE_OK;
+        snprintf(sql, sizeof(sql), "INSERT INTO %s.citizen_stats VALUES (?,?,?,?,?);", schema);
+        if (ok && sqlite3_prepare_v2(db, sql, -1, &stmt, 0) == SQLITE_OK) {
+            for (int i = 0; ok && i < counted->count; i++) {
+                for (int j = 0; j < STATS_DIMENSIONS; j++) sqlite3_bind_int(stmt, j + 1, counted->cells[i].key[j]);
+                sqlite3_bind_int64(stmt, 5, counted->cells[i].count);
+                ok = sqlite3_step(stmt) == SQLITE_DONE;
+                sqlite3_reset(stmt);
+            }
+            sqlite3_finalize(stmt);
+        } else {
+            ok = 0;
+        }
+    }
+    return ok ? wrong : -1;
+}
+
+// Recounts every citizen on parallel read connections (NID ranges of the main
+// file, or one per shard) and checks the counters against the result, rewriting
+// those that are wrong. The write lock held meanwhile keeps both in step.
+int rebuild_statistics(int workers) {
+    long long started = now_ns();
+    if (workers < 1) workers = 1;
+    if (workers > STATS_MAX_SCANS) workers = STATS_MAX_SCANS;
+    int files = db_shards + 1, scans = db_shards ? files : workers;
+    StatsTable *counted = calloc(files, sizeof(StatsTable));
+    StatsScan *scan = calloc(scans, sizeof(StatsScan));
+    StatsTable *partial = calloc(scans, sizeof(StatsTable));
+    pthread_t *threads = calloc(scans, sizeof(pthread_t));
+    int *started_threads = calloc(scans, sizeof(int));
+    if (!counted || !scan || !partial || !threads || !started_threads ||
+        sqlite3_exec(db, "BEGIN IMMEDIATE;", 0, 0, 0) != SQLITE_OK) {
+        fprintf(stderr, "Statistics: cannot start the recount: %s\n", sqlite3_errmsg(db));
+        free(counted);
+        free(scan);
+        free(partial);
+        free(threads);
+        free(started_threads);
+        return 0;
+    }
+    sqlite3_int64 low = 0, high = 0;
+    sqlite3_stmt *stmt;
+    if (!db_shards && sqlite3_prepare_v2(db, "SELECT MIN(nid), MAX(nid) FROM main.citizens;", -1, &stmt, 0) == SQLITE_OK) {
+        if (sqlite3_step(stmt) == SQLITE_ROW && sqlite3_column_type(stmt, 0) != SQLITE_NULL) {
+            low = sqlite3_column_int64(stmt, 0);
+            high = sqlite3_column_int64(stmt, 1);
+        }
+        sqlite3_finalize(stmt);
+    }
+    sqlite3_int64 width = (high - low) / scans + 1;
+    for (int i = 0; i < scans; i++) {
+        if (db_shards) {
+            // The main file (which should hold no citizens) and each shard, whole
+            scan[i].schema = i ? shard_schemas[i - 1] : "main";
+            scan[i].from = 0;
+            scan[i].to = INT64_MAX;
+        } else {
+            scan[i].schema = "main";
+            scan[i].from = low + width * i;
+            scan[i].to = i + 1 == scans ? high + 1 : scan[i].from + width;
+        }
+        scan[i].counted = &partial[i];
+        started_threads[i] = pthread_create(&threads[i], NULL, stats_scan_thread, &scan[i]) == 0;
+    }
+    int ok = 1;
+    long long total = 0;
+    for (int i = 0; i < scans; i++) {
+        if (started_threads[i]) pthread_join(threads[i], NULL);
+        ok = ok && started_threads[i] && scan[i].ok;
+        StatsTable *file = &counted[db_shards ? i : 0];
+        for (int j = 0; ok && j < partial[i].count; j++) {
+            ok = stats_add(file, partial[i].cells[j].key, partial[i].cells[j].count);
+            total += partial[i].cells[j].count;
+        }
+    }
+    int wrong = 0;
+    for (int i = 0; ok && i < files; i++) {
+        int n = stats_repair(i ? shard_schemas[i - 1] : "main", &counted[i]);
+        ok = n >= 0;
+        wrong += ok ? n : 0;
+    }
+    if (!ok || sqlite3_exec(db, "COMMIT;", 0, 0, 0) != SQLITE_OK) {
+        fprintf(stderr, "Statistics: recount failed: %s\n", sqlite3_errmsg(db));
+        sqlite3_exec(db, "ROLLBACK;", 0, 0, 0);
+        ok = 0;
+    }
+    if (ok) {
+        fprintf(stderr, "Statistics: recounted %lld citizens on %d threads in %.2fs; ", total, scans,
+                (now_ns() - started) / 1e9);
+        if (wrong) fprintf(stderr, "%d counters were wrong and have been rewritten\n", wrong);
+        else fprintf(stderr, "all counters match\n");
+    }
+    free(counted);
+    free(scan);
+    free(partial);
+    free(threads);
+    free(started_threads);
+    return ok;
+}
+
+// ================== USER AUTHENTICATION ==================
+// Password checks run on a pool of threads with their own connections, so a burst
+// of logins costs at most one PBKDF2 per core and callers wait in a bounded queue
+// instead of piling onto the CPU. A successful login returns a session token signed
+// with a per-process key; later privileged calls verify the token, not the password.
+#define AUTH_QUEUE_DEPTH 64
+#define AUTH_QUEUE_WAIT_MS 2000
+#define SESSION_TTL 1800
+#define SESSION_TOKEN_LEN 192
+
+enum { AUTH_BUSY = -1, AUTH_FAILED = 0, AUTH_OK = 1 };
+
+typedef struct {
+    const char *username;
+    const char *password;
+    int result;
+    int failed_attempts;    // failures since the previous successful login
+    time_t last_login;
+    int done;
+} AuthJob;
+
+struct {
+    pthread_mutex_t lock;
+    pthread_cond_t ready;
+    pthread_cond_t space;
+    pthread_cond_t finished;
+    AuthJob *jobs[AUTH_QUEUE_DEPTH];
+    int head;
+    int count;
+    int stopping;
+    int workers;
+    pthread_t *threads;
+} auth_pool = {.lock = PTHREAD_MUTEX_INITIALIZER, .ready = PTHREAD_COND_INITIALIZER,
+               .space = PTHREAD_COND_INITIALIZER, .finished = PTHREAD_COND_INITIALIZER};
+
+unsigned char session_key[SHA256_DIGEST_LENGTH];
+
+// Runs on the calling thread's connection and records the outcome on the user row
+void verify_password(AuthJob *job) {
+    sqlite3_stmt *stmt = stmt_acquire(STMT_USER_SELECT);
+    sqlite3_bind_text(stmt, 1, job->username, -1, SQLITE_STATIC);
+    int rc = sqlite3_step(stmt);
+    job->result = AUTH_FAILED;
+    // Copied out so the statement is released before the slow key derivation
+    unsigned char hash[SHA256_DIGEST_LENGTH], salt[SALT_LEN];
+    int usable = rc == SQLITE_ROW && sqlite3_column_bytes(stmt, 0) == SHA256_DIGEST_LENGTH &&
+                 sqlite3_column_bytes(stmt, 1) == SALT_LEN;
+    if (usable) {
+        memcpy(hash, sqlite3_column_blob(stmt, 0), SHA256_DIGEST_LENGTH);
+        memcpy(salt, sqlite3_column_blob(stmt, 1), SALT_LEN);
+        job->failed_attempts = sqlite3_column_int(stmt, 2);
+        job->last_login = (time_t)sqlite3_column_int64(stmt, 3);
+    } else if (rc != SQLITE_ROW && rc != SQLITE_DONE) {
+        fprintf(stderr, "Database error: %s\n", sqlite3_errmsg(db));
+    }
+    stmt_release(STMT_USER_SELECT);
+    if (rc != SQLITE_ROW) {
+        return;
+    }
+    if (usable) {
+        unsigned char derived_key[SHA256_DIGEST_LENGTH];
+        derive_key(job->password, salt, derived_key);
+        job->result = CRYPTO_memcmp(hash, derived_key, SHA256_DIGEST_LENGTH) == 0;
+    }
+
+    StmtId id = job->result == AUTH_OK ? STMT_USER_LOGIN_OK : STMT_USER_LOGIN_FAILED;
+    stmt = stmt_acquire(id);
+    int param = 1;
+    if (id == STMT_USER_LOGIN_OK) sqlite3_bind_int64(stmt, param++, (sqlite3_int64)time(NULL));
+    sqlite3_bind_text(stmt, param, job->username, -1, SQLITE_STATIC);
+    if (sqlite3_step(stmt) != SQLITE_DONE) {
+        fprintf(stderr, "Failed to record login: %s\n", sqlite3_errmsg(db));
+    }
+    stmt_release(id);
+}
+
+void *auth_thread(void *arg) {
+    (void)arg;
+    int connected = open_thread_connection(SQLITE_OPEN_READWRITE);
+    while (1) {
+        pthread_mutex_lock(&auth_pool.lock);
+        while (auth_pool.count == 0 && !auth_pool.stopping) {
+            pthread_cond_wait(&auth_pool.ready, &auth_pool.lock);
+        }
+        if (auth_pool.count == 0) {
+            pthread_mutex_unlock(&auth_pool.lock);
+            break;
+        }
+        AuthJob *job = auth_pool.jobs[auth_pool.head];
+        auth_pool.head = (auth_pool.head + 1) % AUTH_QUEUE_DEPTH;
+        auth_pool.count--;
+        pthread_cond_signal(&auth_pool.space);
+        pthread_mutex_unlock(&auth_pool.lock);
+
+        if (connected) verify_password(job);
+        else job->result = AUTH_FAILED;
+
+        pthread_mutex_lock(&auth_pool.lock);
+        job->done = 1;
+        pthread_cond_broadcast(&auth_pool.finished);
+        pthread_mutex_unlock(&auth_pool.lock);
+    }
+    if (connected) close_connection();
+    return NULL;
+}
+
+int auth_start(int workers) {
+    if (!RAND_bytes(session_key, sizeof(session_key))) {
+        fprintf(stderr, "Cannot generate session key\n");
+        return 0;
+    }
+    if (workers < 1) workers = 1;
+    auth_pool.threads = calloc(workers, sizeof(pthread_t));
+    if (!auth_pool.threads) {
+        return 0;
+    }
+    for (int i = 0; i < workers; i++) {
+        if (pthread_create(&auth_pool.threads[i], NULL, auth_thread, NULL) != 0) {
+            break;
+        }
+        auth_pool.workers++;
+    }
+    return auth_pool.workers > 0;
+}
+
+void auth_stop() {
+    pthread_mutex_lock(&auth_pool.lock);
+    auth_pool.stopping = 1;
+    pthread_cond_broadcast(&auth_pool.ready);
+    pthread_mutex_unlock(&auth_pool.lock);
+    for (int i = 0; i < auth_pool.workers; i++) {
+        pthread_join(auth_pool.threads[i], NULL);
+    }
+    free(auth_pool.threads);
+    auth_pool.threads = NULL;
+    auth_pool.workers = 0;
+}
+
+// Hands the check to the pool and waits for it. Returns AUTH_BUSY if the queue
+// stays full for AUTH_QUEUE_WAIT_MS; without a pool the check runs inline.
+int auth_submit(AuthJob *job) {
+    long long started = now_ns();
+    job->done = 0;
+    if (auth_pool.workers == 0) {
+        verify_password(job);
+        op_record(OP_LOGIN, started);
+        return job->result;
+    }
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += AUTH_QUEUE_WAIT_MS / 1000;
+    deadline.tv_nsec += (AUTH_QUEUE_WAIT_MS % 1000) * 1000000L;
+    if (deadline.tv_nsec >= 1000000000L) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000L;
+    }
+
+    pthread_mutex_lock(&auth_pool.lock);
+    while (auth_pool.count == AUTH_QUEUE_DEPTH) {
+        if (pthread_cond_timedwait(&auth_pool.space, &auth_pool.lock, &deadline) == ETIMEDOUT) {
+            pthread_mutex_unlock(&auth_pool.lock);
+            return AUTH_BUSY;
+        }
+    }
+    auth_pool.jobs[(auth_pool.head + auth_pool.count) % AUTH_QUEUE_DEPTH] = job;
+    auth_pool.count++;
+    pthread_cond_signal(&auth_pool.ready);
+    while (!job->done) {
+        pthread_cond_wait(&auth_pool.finished, &auth_pool.lock);
+    }
+    pthread_mutex_unlock(&auth_pool.lock);
+    op_record(OP_LOGIN, started);
+    return job->result;
+}
+
+int authenticate_user(const char *username, const char *password) {
+    AuthJob job = {0};
+    job.username = username;
+    job.password = password;
+    return auth_submit(&job) == AUTH_OK;
+}
+
+void session_mac(const char *username, long long expires, char *hex) {
+    char data[128];
+    int len = snprintf(data, sizeof(data), "%s:%lld", username, expires);
+    unsigned char mac[SHA256_DIGEST_LENGTH];
+    unsigned int mac_len = 0;
+    HMAC(EVP_sha256(), session_key, sizeof(session_key), (unsigned char*)data, len, mac, &mac_len);
+    for (unsigned int i = 0; i < mac_len; i++) {
+        sprintf(hex + i * 2, "%02x", mac[i]);
+    }
+}
+
+// Token layout is "<username>:<expiry>:<hex HMAC-SHA256>"
+void issue_session(const char *username, char *token) {
+    long long expires = (long long)time(NULL) + SESSION_TTL;
+    char hex[SHA256_DIGEST_LENGTH * 2 + 1];
+    session_mac(username, expires, hex);
+    snprintf(token, SESSION_TOKEN_LEN, "%s:%lld:%s", username, expires, hex);
+}
+
+// Returns 1 if the token is intact and unexpired; copies the username if asked
+int verify_session(const char *token, char *username, size_t size) {
+    const char *mac = strrchr(token, ':');
+    if (!mac || mac == token || strlen(mac + 1) != SHA256_DIGEST_LENGTH * 2) {
+        return 0;
+    }
+    const char *exp = mac - 1;
+    while (exp > token && *exp != ':') exp--;
+    if (exp == token || exp - token >= 50) {
+        return 0;
+    }
+    char user[50];
+    memcpy(user, token, exp - token);
+    user[exp - token] = '\0';
+    long long expires = atoll(exp + 1);
+    if (expires < (long long)time(NULL)) {
+        return 0;
+    }
+    char hex[SHA256_DIGEST_LENGTH * 2 + 1];
+    session_mac(user, expires, hex);
+    if (CRYPTO_memcmp(hex, mac + 1, SHA256_DIGEST_LENGTH * 2) != 0) {
+        return 0;
+    }
+    if (username) snprintf(username, size, "%s", user);
+    return 1;
+}
+
+// Login throughput: clients submit concurrently so the pool's queue stays full
+typedef struct {
+    const char *username;
+    const char *password;
+    int logins;
+    int failed;
+} BenchClient;
+
+void *bench_login_client(void *arg) {
+    BenchClient *client = arg;
+    for (int i = 0; i < client->logins; i++) {
+        if (!authenticate_user(client->username, client->password)) client->failed++;
+    }
+    return NULL;
+}
+
+int bench_logins(const char *username, const char *password, int count) {
+    int clients = auth_pool.workers > 0 ? auth_pool.workers * 2 : 1;
+    if (clients > count) clients = count;
+    pthread_t *threads = calloc(clients, sizeof(pthread_t));
+    BenchClient *work = calloc(clients, sizeof(BenchClient));
+    if (!threads || !work) {
+        free(threads);
+        free(work);
+        return 0;
+    }
+    long long start = now_ns();
+    for (int i = 0; i < clients; i++) {
+        work[i].username = username;
+        work[i].password = password;
+        work[i].logins = count / clients + (i < count % clients);
+        pthread_create(&threads[i], NULL, bench_login_client, &work[i]);
+    }
+    int failed = 0;
+    for (int i = 0; i < clients; i++) {
+        pthread_join(threads[i], NULL);
+        failed += work[i].failed;
+    }
+    double login_secs = (now_ns() - start) / 1e9;
+
+    char token[SESSION_TOKEN_LEN];
+    issue_session(username, token);
+    int verifications = 100000, valid = 0;
+    start = now_ns();
+    for (int i = 0; i < verifications; i++) {
+        valid += verify_session(token, NULL, 0);
+    }
+    double verify_secs = (now_ns() - start) / 1e9;
+
+    printf("Logins: %d (%d failed) on %d workers, %d clients in %.2fs: %.1f logins/sec, %.2f ms each\n",
+           count, failed, auth_pool.workers, clients, login_secs, count / login_secs,
+           login_secs * 1e3 * clients / count);
+    printf("Session checks: %d in %.3fs: %.2f us each\n", valid, verify_secs, verify_secs * 1e6 / verifications);
+    free(threads);
+    free(work);
+    return failed == 0 && valid == verifications;
+}
+
+// ================== ADMIN FUNCTIONS ==================
+// Reads an optional line; an empty answer leaves buf empty
+void prompt_line(const char *label, char *buf, size_t size) {
+    printf("%s: ", label);
+    if (!fgets(buf, size, stdin)) {
+        buf[0] = '\0';
+        return;
+    }
+    if (!strchr(buf, '\n')) clear_input_buffer();
+    buf[strcspn(buf, "\n")] = '\0';
+}
+
+void admin_register_citizen() {
+    Citizen new_citizen;
+    DuplicateMatch match;
+    input_citizen(&new_citizen,1);
+    
+    if(register_citizen(&new_citizen, &match)) {
+        printf("Generated NID: %s\n", new_citizen.nid);
+        printf("Citizen registered successfully!\n");
+        if (match.count > 0) {
+            printf("Flagged for review: possible duplicate of NID %s (score %.2f)\n", match.nid, match.score);
+        }
+        audit_log(new_citizen.nid, "REGISTERED");
+    } else {
+        fprintf(stderr, "Execution failed: %s\n", sqlite3_errmsg(db));
+        printf("Failed to register citizen!\n");
+    }
+}
+#define BROWSE_DEFAULT_PAGE 20
+#define BROWSE_MAX_PAGE 1000
+
+void append_column(Buffer *out, sqlite3_stmt *stmt, int col) {
+    const char *text = (const char*)sqlite3_column_text(stmt, col);
+    buf_append(out, text ? text : "", sqlite3_column_bytes(stmt, col));
+}
+
+// Same layout as ctime(): "Thu Jan  1 00:00:00 1970\n"
+void append_time(Buffer *out, time_t t) {
+    struct tm tm;
+    char text[32];
+    localtime_r(&t, &tm);
+    buf_append(out, text, strftime(text, sizeof(text), "%a %b %e %H:%M:%S %Y\n", &tm));
+}
+
+// Display text of columns 0-7 of a "SELECT * FROM citizens" row: the coded columns
+// (NID, DOB, gender, blood group) formatted, the PII columns decrypted if need be.
+// scratch must hold PII_MAX_TEXT bytes. Returns NULL for the integer columns.
+const char *citizen_column_text(sqlite3_stmt *stmt, int col, char *scratch, int *len) {
+    const char *text = scratch;
+    switch (col) {
+        case 0:
+            format_nid(sqlite3_column_int64(stmt, 0), scratch);
+            break;
+        case 2:
+            format_dob(sqlite3_column_int(stmt, 2), scratch);
+            break;
+        case 3:
+            text = gender_name(sqlite3_column_int(stmt, 3));
+            break;
+        case 7:
+            text = blood_group_name(sqlite3_column_int(stmt, 7));
+            break;
+        case 1: case 4: case 5: case 6:
+            return pii_column(stmt, col, scratch, len);
+        default:
+            return NULL;
+    }
+    *len = (int)strlen(text);
+    return text;
+}
+
+void append_citizen_column(Buffer *out, sqlite3_stmt *stmt, int col) {
+    char scratch[PII_MAX_TEXT];
+    int len;
+    const char *text = citizen_column_text(stmt, col, scratch, &len);
+    if (text) buf_append(out, text, len);
+    else append_column(out, stmt, col);
+}
+
+// Formats a "SELECT * FROM citizens" row like display_citizen(), straight from the columns
+void append_citizen_row(Buffer *out, sqlite3_stmt *stmt) {
+    static const char *labels[] = {"\nNID: ", "\nName: ", "\nDOB: ", "\nGender: ", "\nAddress: ",
+                                   "\nFather: ", "\nMother: ", "\nBlood Group: "};
+    for (int col = 0; col < 8; col++) {
+        buf_append(out, labels[col], strlen(labels[col]));
+        append_citizen_column(out, stmt, col);
+    }
+    buf_printf(out, "\nStatus: %s\nCreated: ", sqlite3_column_int(stmt, 8) ? "Active" : "Inactive");
+    append_time(out, (time_t)sqlite3_column_int64(stmt, 9));
+    buf_append(out, "Last Modified: ", 15);
+    append_time(out, (time_t)sqlite3_column_int64(stmt, 10));
+    buf_append(out, "-----------------------------\n", 30);
+}
+
+// Fetches one page after (or, going back, before) the cursor into out, in NID order.
+// first/last receive the page's boundary NIDs for the next move.
+int browse_page(const char *cursor, int backward, int page_size, Buffer *out, char *first, char *last) {
+    long long started = now_ns();
+    StmtId id = backward ? STMT_CITIZEN_PAGE_PREV : STMT_CITIZEN_PAGE_NEXT;
+    sqlite3_stmt *stmt = stmt_acquire(id);
+    // Going back reads rows in descending order, so each row is formatted into its own slot
+    size_t offsets[BROWSE_MAX_PAGE + 1];
+    int count = 0;
+    sqlite3_int64 key = backward ? INT64_MAX : -1;
+    if (cursor[0] && !nid_key(cursor, &key)) {
+        stmt_release(id);
+        return 0;
+    }
+    sqlite3_bind_int64(stmt, 1, key);
+    sqlite3_bind_int(stmt, 2, page_size);
+    out->len = 0;
+    while (count < page_size && sqlite3_step(stmt) == SQLITE_ROW) {
+        if (count == 0) format_nid(sqlite3_column_int64(stmt, 0), first);
+        format_nid(sqlite3_column_int64(stmt, 0), last);
+        offsets[count++] = out->len;
+        append_citizen_row(out, stmt);
+    }
+    offsets[count] = out->len;
+    stmt_release(id);
+
+    if (backward && count > 1) {
+        // Rows came back newest-first; rebuild the page in ascending order
+        Buffer ordered = {0};
+        buf_reserve(&ordered, out->len);
+        for (int i = count - 1; i >= 0; i--) {
+            buf_append(&ordered, out->data + offsets[i], offsets[i + 1] - offsets[i]);
+        }
+        buf_free(out);
+        *out = ordered;
+        char tmp[20];
+        strcpy(tmp, first);
+        strcpy(first, last);
+        strcpy(last, tmp);
+    }
+    op_record(OP_VIEW, started);
+    return count;
+}
+
+void admin_view_citizens() {
+    char answer[16], first[20] = "", last[20] = "", page_first[20], page_last[20];
+    prompt_line("Page size (Enter for 20)", answer, sizeof(answer));
+    int page_size = atoi(answer);
+    if (page_size <= 0) page_size = BROWSE_DEFAULT_PAGE;
+    if (page_size > BROWSE_MAX_PAGE) page_size = BROWSE_MAX_PAGE;
+
+    Buffer page = {0};
+    int backward = 0;
+    const char *cursor = "";
+    printf("\nRegistered Citizens:\n");
+    while (1) {
+        int count = browse_page(cursor, backward, page_size, &page, page_first, page_last);
+        if (count == 0) {
+            printf(first[0] ? "No more citizens in that direction.\n" : "No citizens registered yet!\n");
+            if (!first[0]) break;
+        } else {
+            strcpy(first, page_first);
+            strcpy(last, page_last);
+            fwrite(page.data, 1, page.len, stdout);
+        }
+        prompt_line("n = next page, p = previous page, q = back to menu", answer, sizeof(answer));
+        if (answer[0] == 'n' || answer[0] == 'N') {
+            cursor = last;
+            backward = 0;
+        } else if (answer[0] == 'p' || answer[0] == 'P') {
+            cursor = first;
+            backward = 1;
+        } else {
+            break;
+        }
+    }
+    buf_free(&page);
+}
+
+#define DUMP_BUFFER_SIZE (1 << 20)
+
+// Streams every citizen as tab-separated lines in NID order, flushing in large writes
+int dump_citizens(int fd) {
+    static const char *header = "nid\tname\tdob\tgender\taddress\tfather_name\tmother_name\t"
+                                "blood_group\tis_active\tcreated_at\tlast_modified\n";
+    Buffer out = {0};
+    buf_reserve(&out, DUMP_BUFFER_SIZE);
+    buf_append(&out, header, strlen(header));
+    sqlite3_stmt *stmt = stmt_acquire(STMT_CITIZEN_SELECT_ALL);
+    long rows = 0;
+    int ok = 1, rc;
+    while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+        for (int col = 0; col < 11; col++) {
+            append_citizen_column(&out, stmt, col);
+            buf_append(&out, col == 10 ? "\n" : "\t", 1);
+        }
+        rows++;
+        if (out.len >= DUMP_BUFFER_SIZE) {
+            if (!write_full(fd, out.data, out.len)) {
+                ok = 0;
+                break;
+            }
+            out.len = 0;
+        }
+    }
+    stmt_release(STMT_CITIZEN_SELECT_ALL);
+    if (ok && rc != SQLITE_DONE && rc != SQLITE_ROW) {
+        fprintf(stderr, "Dump failed: %s\n", sqlite3_errmsg(db));
+        ok = 0;
+    }
+    if (ok && out.len > 0 && !write_full(fd, out.data, out.len)) {
+        ok = 0;
+    }
+    buf_free(&out);
+    if (!ok) {
+        perror("Dump failed");
+        return 0;
+    }
+    fprintf(stderr, "Dumped %ld citizens\n", rows);
+    return 1;
+}
+void admin_search_citizen() {
+    char nid[20];
+    printf("Enter NID to search: ");
+    scanf("%19s", nid);
+    clear_input_buffer();
+    
+    Citizen c; 
+    if(find_citizen(nid, &c)) { 
+        display_citizen(&c); 
+        audit_log(c.nid, "SEARCHED");
+    } else { 
+        printf("Citizen with NID %s not found!\n", nid); 
+    } 
+} 
+// Sets is_active on every NID in one transaction, or in the caller's if one is open.
+// Returns how many citizens changed, or -1 if the batch failed and was rolled back.
+int set_citizens_active(char **nids, int count, int is_active) {
+    int own = sqlite3_get_autocommit(db);
+    if (own && sqlite3_exec(db, "BEGIN IMMEDIATE;", 0, 0, 0) != SQLITE_OK) {
+        return -1;
+    }
+    Citizen status = {0};
+    status.is_active = is_active;
+    status.last_modified = time(NULL);
+    int changed = 0;
+    for (int i = 0; i < count; i++) {
+        int rc = update_citizen_fields(nids[i], &status, FIELD_ACTIVE);
+        if (rc < 0) {
+            changed = -1;
+            break;
+        }
+        if (rc > 0) {
+            char nid[20];
+            canonical_nid(nids[i], nid);
+            if (!audit_log_details(nid, "UPDATED", "is_active")) {
+                changed = -1;
+                break;
+            }
+            changed++;
+        }
+    }
+    if (own) {
+        if (changed < 0 || sqlite3_exec(db, "COMMIT;", 0, 0, 0) != SQLITE_OK) {
+            sqlite3_exec(db, "ROLLBACK;", 0, 0, 0);
+            changed = -1;
+        }
+        cache_transaction_done();
+    }
+    return changed;
+}
+
+void admin_update_citizen() {
+    char line[512];
+    char *nids[256];
+    prompt_line("Enter NID to update (several NIDs separated by spaces to change only their status)",
+                line, sizeof(line));
+    int count = 0;
+    for (char *p = strtok(line, " ,"); p && count < 256; p = strtok(NULL, " ,")) {
+        nids[count++] = p;
+    }
+    if (count == 0) {
+        return;
+    }
+
+    char value[MAX_ADDRESS];
+    if (count > 1) {
+        do {
+            prompt_line("Is Active (1=Yes, 0=No)", value, sizeof(value));
+        } while (strcmp(value, "0") != 0 && strcmp(value, "1") != 0);
+        int changed = set_citizens_active(nids, count, value[0] == '1');
+        if (changed < 0) {
+            printf("Failed to update citizens!\n");
+        } else {
+            printf("Updated %d of %d citizens.\n", changed, count);
+        }
+        return;
+    }
+
+    // Only the fields given a new value are written
+    Citizen updated = {0};
+    int mask = 0;
+    printf("Enter new details for citizen with NID %s (Enter keeps the current value):\n", nids[0]);
+    for (int i = 0; i < UPDATE_FIELDS; i++) {
+        while (1) {
+            prompt_line(citizen_fields[i].prompt, value, sizeof(value));
+            if (!value[0]) break;
+            if (set_citizen_field(&updated, 1 << i, value)) {
+                mask |= 1 << i;
+                break;
+            }
+            printf("Invalid %s, please try again.\n", citizen_fields[i].column);
+        }
+    }
+    if (!mask) {
+        printf("Nothing to update.\n");
+        return;
+    }
+    updated.last_modified = time(NULL);
+    int rc = update_citizen_fields(nids[0], &updated, mask);
+    if (rc > 0) {
+        char changed[AUDIT_DETAILS_LEN], nid[20];
+        describe_fields(mask, changed, sizeof(changed));
+        canonical_nid(nids[0], nid);
+        printf("Citizen updated successfully!\n");
+        audit_log_details(nid, "UPDATED", changed);
+    } else if (rc == 0) {
+        printf("Citizen with NID %s not found!\n", nids[0]);
+    } else {
+        printf("Failed to update citizen!\n");
+    }
+}
+void admin_delete_citizen() {
+    char nid[20];
+    printf("Enter NID to delete: ");
+    scanf("%19s", nid);
+    clear_input_buffer();
+    
+    int rc = delete_citizen(nid);
+    if(rc > 0) {
+        printf("Citizen with NID %s deleted successfully!\n", nid);
+        
+        // Log deletion activity
+        canonical_nid(nid, nid);
+        audit_log(nid, "DELETED");
+    } else if (rc == 0) {
+        printf("Citizen not found!\n");
+    } else {
+        printf("Failed to delete citizen!\n");
+    }
+}
+
+#define REVIEW_PAGE 20
+
+// Records a reviewer's decision on a flagged pair. When both are the same person
+// the later registration is deactivated.
+int resolve_duplicate(const Citizen *a, const Citizen *b, int same_person) {
+    sqlite3_int64 key_a, key_b;
+    if (!nid_key(a->nid, &key_a) || !nid_key(b->nid, &key_b) ||
+        sqlite3_exec(db, "BEGIN IMMEDIATE;", 0, 0, 0) != SQLITE_OK) {
+        return 0;
+    }
+    sqlite3_stmt *stmt;
+    int ok = sqlite3_prepare_v2(db, "UPDATE duplicate_reviews SET status = ?1, reviewed_at = ?2 "
+                                    "WHERE nid = ?3 AND candidate_nid = ?4;", -1, &stmt, 0) == SQLITE_OK;
+    if (ok) {
+        sqlite3_bind_text(stmt, 1, same_person ? "duplicate" : "distinct", -1, SQLITE_STATIC);
+        sqlite3_bind_int64(stmt, 2, (sqlite3_int64)time(NULL));
+        sqlite3_bind_int64(stmt, 3, key_a);
+        sqlite3_bind_int64(stmt, 4, key_b);
+        ok = sqlite3_step(stmt) == SQLITE_DONE;
+        sqlite3_finalize(stmt);
+    }
+    char details[AUDIT_DETAILS_LEN];
+    snprintf(details, sizeof(details), "%s %s", same_person ? "same person as" : "distinct from", b->nid);
+    if (ok && same_person) {
+        char *later = (char*)(a->created_at >= b->created_at ? a->nid : b->nid);
+        ok = set_citizens_active(&later, 1, 0) >= 0;
+    }
+    if (!ok || sqlite3_exec(db, "COMMIT;", 0, 0, 0) != SQLITE_OK) {
+        fprintf(stderr, "SQL error: %s\n", sqlite3_errmsg(db));
+        sqlite3_exec(db, "ROLLBACK;", 0, 0, 0);
+        cache_transaction_done();
+        return 0;
+    }
+    cache_transaction_done();
+    audit_log_details(a->nid, "DUPLICATE_REVIEWED", details);
+    return 1;
+}
+
+void admin_review_duplicates() {
+    sqlite3_stmt *stmt;
+    if (sqlite3_prepare_v2(db, "SELECT nid, candidate_nid, score FROM duplicate_reviews "
+                               "WHERE status = 'pending' ORDER BY flagged_at LIMIT ?;", -1, &stmt, 0) != SQLITE_OK) {
+        fprintf(stderr, "SQL error: %s\n", sqlite3_errmsg(db));
+        return;
+    }
+    Citizen pairs[REVIEW_PAGE][2];
+    int count = 0;
+    sqlite3_bind_int(stmt, 1, REVIEW_PAGE);
+    printf("\nSuspected duplicates:\n");
+    while (sqlite3_step(stmt) == SQLITE_ROW) {
+        char nid[20], candidate[20];
+        format_nid(sqlite3_column_int64(stmt, 0), nid);
+        format_nid(sqlite3_column_int64(stmt, 1), candidate);
+        if (!find_citizen(nid, &pairs[count][0]) || !find_citizen(candidate, &pairs[count][1])) {
+            continue;
+        }
+        count++;
+        printf("%2d. score %.2f\n", count, sqlite3_column_double(stmt, 2));
+        for (int i = 0; i < 2; i++) {
+            const Citizen *c = &pairs[count - 1][i];
+            printf("    %s | %s | %s | father %s | mother %s%s\n", c->nid, c->name, c->dob,
+                   c->father_name, c->mother_name, c->is_active ? "" : " | inactive");
+        }
+    }
+    sqlite3_finalize(stmt);
+    if (count == 0) {
+        printf("None pending.\n");
+        return;
+    }
+
+    char line[16];
+    prompt_line("Pair to resolve (Enter to go back)", line, sizeof(line));
+    int pick = atoi(line);
+    if (pick < 1 || pick > count) {
+        return;
+    }
+    prompt_line("1. Same person (deactivate the later registration)  2. Different people", line, sizeof(line));
+    if (line[0] != '1' && line[0] != '2') {
+        printf("Invalid choice!\n");
+        return;
+    }
+    if (resolve_duplicate(&pairs[pick - 1][0], &pairs[pick - 1][1], line[0] == '1')) {
+        printf("Review recorded.\n");
+    } else {
+        printf("Failed to record the review!\n");
+    }
+}
+
+// Accepts DD-MM-YYYY (local midnight) or "<N>h" for N hours ago; empty means unbounded
+int parse_time_bound(const char *text, time_t *out) {
+    int day, month, year, hours;
+    char unit;
+    *out = 0;
+    if (!has_value(text)) {
+        return 1;
+    }
+    if (sscanf(text, "%d%c", &hours, &unit) == 2 && unit == 'h' && hours > 0) {
+        *out = time(NULL) - (time_t)hours * 3600;
+        return 1;
+    }
+    if (sscanf(text, "%d-%d-%d", &day, &month, &year) == 3) {
+        struct tm tm = {0};
+        tm.tm_mday = day;
+        tm.tm_mon = month - 1;
+        tm.tm_year = year - 1900;
+        tm.tm_isdst = -1;
+        *out = mktime(&tm);
+        return *out != (time_t)-1;
+    }
+    return 0;
+}
+
+void print_audit_row(sqlite3_stmt *stmt, void *ctx) {
+    Buffer *out = ctx;
+    buf_append(out, "NID: ", 5);
+    append_column(out, stmt, 1);
+    buf_append(out, "\nActivity: ", 11);
+    append_column(out, stmt, 3);
+    if (sqlite3_column_type(stmt, 4) != SQLITE_NULL) {
+        buf_append(out, " (", 2);
+        append_column(out, stmt, 4);
+        buf_append(out, ")", 1);
+    }
+    buf_append(out, "\nTime: ", 7);
+    append_time(out, (time_t)sqlite3_column_int64(stmt, 2));
+    buf_append(out, "\n----------------------------------------\n", 42);
+}
+
+void admin_view_audit_logs() {
+    char nid[20], activity[AUDIT_ACTIVITY_LEN], from_text[16], to_text[16], answer[8];
+    char cursor[AUDIT_CURSOR_LEN] = "", next[AUDIT_CURSOR_LEN];
+    AuditQuery q = {0};
+    printf("\nLeave a filter empty to skip it.\n");
+    prompt_line("NID", nid, sizeof(nid));
+    prompt_line("Activity (REGISTERED/SEARCHED/UPDATED/DELETED)", activity, sizeof(activity));
+    prompt_line("From (DD-MM-YYYY or e.g. 24h)", from_text, sizeof(from_text));
+    prompt_line("To (DD-MM-YYYY, exclusive)", to_text, sizeof(to_text));
+    if (nid[0] && !canonical_nid(nid, nid)) {
+        printf("Invalid NID!\n");
+        return;
+    }
+    if (!parse_time_bound(from_text, &q.from) || !parse_time_bound(to_text, &q.to)) {
+        printf("Invalid date!\n");
+        return;
+    }
+    q.nid = nid;
+    q.activity = activity;
+    q.before = cursor;
+    q.limit = AUDIT_DEFAULT_LIMIT;
+    audit_flush();
+
+    Buffer page = {0};
+    printf("\nAudit Logs:\n");
+    printf("----------------------------------------\n");
+    while (1) {
+        page.len = 0;
+        int count = query_audit_logs(&q, print_audit_row, &page, next);
+        if (count < 0) {
+            printf("Failed to fetch audit logs!\n");
+            break;
+        }
+        if (count == 0 && !cursor[0]) {
+            printf("No matching audit entries.\n");
+        }
+        if (page.len) fwrite(page.data, 1, page.len, stdout);
+        if (!next[0]) break;
+        prompt_line("Show older entries? (y/n)", answer, sizeof(answer));
+        if (answer[0] != 'y' && answer[0] != 'Y') break;
+        strcpy(cursor, next);
+    }
+    buf_free(&page);
+}
+
+void print_query_row(const Citizen *c, void *ctx) {
+    (void)ctx;
+    display_citizen(c);
+    printf("-----------------------------\n");
+}
+
+// A date filter: empty to skip it, otherwise asked again until it parses
+void prompt_dob_filter(const char *label, char *buf, size_t size) {
+    while (1) {
+        prompt_line(label, buf, size);
+        if (!buf[0] || dob_key(buf)) return;
+        printf("Invalid date! Use DD-MM-YYYY, or leave it empty.\n");
+    }
+}
+
+void admin_query_citizens() {
+    char name[MAX_NAME], dob_from[11], dob_to[11], age_min[8], age_max[8], father[MAX_NAME], mother[MAX_NAME];
+    char blood[4], address[MAX_ADDRESS], text[MAX_ADDRESS], cursor[20] = "", answer[8];
+    printf("\nLeave a filter empty to skip it.\n");
+    prompt_line("Name starts with", name, sizeof(name));
+    prompt_dob_filter("Born on or after (DD-MM-YYYY)", dob_from, sizeof(dob_from));
+    prompt_dob_filter("Born on or before (DD-MM-YYYY)", dob_to, sizeof(dob_to));
+    prompt_line("Minimum age", age_min, sizeof(age_min));
+    prompt_line("Maximum age", age_max, sizeof(age_max));
+    prompt_line("Father Name", father, sizeof(father));
+    prompt_line("Mother Name", mother, sizeof(mother));
+    prompt_line("Blood Group", blood, sizeof(blood));
+    prompt_line("Address contains words", address, sizeof(address));
+    prompt_line("Any field contains words", text, sizeof(text));
+
+    CitizenQuery q = {name, dob_key(dob_from), dob_key(dob_to), father, mother, blood, address, text,
+                      cursor, QUERY_DEFAULT_LIMIT};
+    age_to_dob_range(has_value(age_min) ? atoi(age_min) : -1, has_value(age_max) ? atoi(age_max) : -1,
+                     &q.dob_from, &q.dob_to);
+    int total = 0;
+    while (1) {
+        char next[20];
+        int count = query_citizens(&q, print_query_row, NULL, next);
+        if (count < 0) {
+            printf("Query failed!\n");
+            return;
+        }
+        total += count;
+        if (!next[0]) break;
+        prompt_line("Show next page? (y/n)", answer, sizeof(answer));
+        if (answer[0] != 'y' && answer[0] != 'Y') break;
+        strcpy(cursor, next);
+    }
+    if (total == 0) {
+        printf("No matching citizens found!\n");
+    }
+}
+
+typedef struct {
+    const char *name;
+    const char *help;
+    int is_counter;
+    double value;
+} NamedMetric;
+
+int collect_cache_metrics(NamedMetric *out) {
+    uint64_t hits = __atomic_load_n(&cache_counters.hits, __ATOMIC_RELAXED);
+    uint64_t misses = __atomic_load_n(&cache_counters.misses, __ATOMIC_RELAXED);
+    size_t entries = 0, bytes = 0;
+    for (int i = 0; i < CACHE_SHARDS; i++) {
+        pthread_mutex_lock(&cache_shards[i].lock);
+        entries += cache_shards[i].entries;
+        bytes += cache_shards[i].bytes;
+        pthread_mutex_unlock(&cache_shards[i].lock);
+    }
+    int n = 0;
+    out[n++] = (NamedMetric){"hits_total", "Citizen lookups served from the cache", 1, hits};
+    out[n++] = (NamedMetric){"misses_total", "Citizen lookups that went to the database", 1, misses};
+    out[n++] = (NamedMetric){"hit_ratio", "Share of lookups served from the cache", 0, hits + misses ? (double)hits / (hits + misses) : 0.0};
+    out[n++] = (NamedMetric){"evictions_total", "Entries evicted to stay within the budget", 1, __atomic_load_n(&cache_counters.evictions, __ATOMIC_RELAXED)};
+    out[n++] = (NamedMetric){"invalidations_total", "Entries dropped after updates and deletes", 1, __atomic_load_n(&cache_counters.invalidations, __ATOMIC_RELAXED)};
+    out[n++] = (NamedMetric){"entries", "Citizens currently cached", 0, entries};
+    out[n++] = (NamedMetric){"bytes", "Memory held by cached citizens", 0, bytes};
+    out[n++] = (NamedMetric){"budget_bytes", "Configured cache memory budget", 0, cache_shard_budget * CACHE_SHARDS};
+    return n;
+}
+
+// Process-wide SQLite figures plus the counters gathered from every connection
+int collect_sqlite_metrics(NamedMetric *out) {
+    sqlite3_int64 memory = 0, memory_high = 0, mallocs = 0, mallocs_high = 0, overflow = 0, overflow_high = 0;
+    sqlite3_status64(SQLITE_STATUS_MEMORY_USED, &memory, &memory_high, 0);
+    sqlite3_status64(SQLITE_STATUS_MALLOC_COUNT, &mallocs, &mallocs_high, 0);
+    sqlite3_status64(SQLITE_STATUS_PAGECACHE_OVERFLOW, &overflow, &overflow_high, 0);
+    publish_db_status(db);
+    int n = 0;
+    out[n++] = (NamedMetric){"memory_used_bytes", "Heap memory held by SQLite", 0, (uint64_t)memory};
+    out[n++] = (NamedMetric){"memory_highwater_bytes", "Peak heap memory held by SQLite", 0, (uint64_t)memory_high};
+    out[n++] = (NamedMetric){"allocations", "Outstanding SQLite allocations", 0, (uint64_t)mallocs};
+    out[n++] = (NamedMetric){"pagecache_overflow_bytes", "Page cache bytes that spilled to the heap", 0, (uint64_t)overflow};
+    out[n++] = (NamedMetric){"cache_hits_total", "Page cache hits", 1, __atomic_load_n(&db_counters.cache_hits, __ATOMIC_RELAXED)};
+    out[n++] = (NamedMetric){"cache_misses_total", "Page cache misses", 1, __atomic_load_n(&db_counters.cache_misses, __ATOMIC_RELAXED)};
+    out[n++] = (NamedMetric){"cache_writes_total", "Pages written from the cache", 1, __atomic_load_n(&db_counters.cache_writes, __ATOMIC_RELAXED)};
+    out[n++] = (NamedMetric){"cache_spills_total", "Dirty pages spilled mid-transaction", 1, __atomic_load_n(&db_counters.cache_spills, __ATOMIC_RELAXED)};
+    out[n++] = (NamedMetric){"lock_waits_total", "Statements that found the database locked", 1, __atomic_load_n(&db_counters.lock_waits, __ATOMIC_RELAXED)};
+    out[n++] = (NamedMetric){"lock_wait_us_total", "Time spent waiting for locks", 1, __atomic_load_n(&db_counters.lock_wait_ns, __ATOMIC_RELAXED) / 1000};
+    out[n++] = (NamedMetric){"lock_timeouts_total", "Lock waits that gave up with SQLITE_BUSY", 1, __atomic_load_n(&db_counters.lock_timeouts, __ATOMIC_RELAXED)};
+    return n;
+}
+
+#define NAMED_METRICS_MAX 16
+
+void append_named_json(Buffer *out, const char *section, const NamedMetric *metrics, int count, int last) {
+    buf_printf(out, "  \"%s\": {\n", section);
+    for (int i = 0; i < count; i++) {
+        buf_printf(out, "    \"%s\": %.15g%s\n", metrics[i].name, metrics[i].value, i + 1 < count ? "," : "");
+    }
+    buf_printf(out, "  }%s\n", last ? "" : ",");
+}
+
+void append_named_prometheus(Buffer *out, const char *prefix, const NamedMetric *metrics, int count) {
+    for (int i = 0; i < count; i++) {
+        buf_printf(out, "# HELP %s_%s %s\n# TYPE %s_%s %s\n%s_%s %.15g\n",
+                   prefix, metrics[i].name, metrics[i].help, prefix, metrics[i].name,
+                   metrics[i].is_counter ? "counter" : "gauge", prefix, metrics[i].name, metrics[i].value);
+    }
+}
+
+void append_hist_json(Buffer *out, const char *name, const Histogram *h, int last) {
+    uint64_t total = __atomic_load_n(&h->total, __ATOMIC_RELAXED);
+    buf_printf(out, "    \"%s\": {\"count\": %llu, \"mean_us\": %.2f, \"p50_us\": %.2f, \"p99_us\": %.2f, "
+               "\"p999_us\": %.2f, \"max_us\": %.2f}%s\n", name, (unsigned long long)total,
+               total ? __atomic_load_n(&h->sum_ns, __ATOMIC_RELAXED) / 1e3 / total : 0.0,
+               hist_percentile(h, 0.50) / 1e3, hist_percentile(h, 0.99) / 1e3, hist_percentile(h, 0.999) / 1e3,
+               __atomic_load_n(&h->max_ns, __ATOMIC_RELAXED) / 1e3, last ? "" : ",");
+}
+
+void append_metrics_json(Buffer *out) {
+    buf_printf(out, "{\n  \"operations\": {\n");
+    for (int i = 0; i < OP_COUNT; i++) {
+        append_hist_json(out, operations[i].name, &operations[i].hist, i + 1 == OP_COUNT);
+    }
+    buf_printf(out, "  },\n  \"statements\": {\n");
+    for (int i = 0; i < STMT_COUNT; i++) {
+        append_hist_json(out, statements[i].name, &statements[i].hist, i + 1 == STMT_COUNT);
+    }
+    buf_printf(out, "  },\n");
+    NamedMetric metrics[NAMED_METRICS_MAX];
+    append_named_json(out, "cache", metrics, collect_cache_metrics(metrics), 0);
+    append_named_json(out, "sqlite", metrics, collect_sqlite_metrics(metrics), 1);
+    buf_printf(out, "}\n");
+}
+
+void append_prometheus_summary(Buffer *out, const char *metric, const char *label, const char *name, const Histogram *h) {
+    static const double quantiles[] = {0.5, 0.99, 0.999};
+    for (int q = 0; q < 3; q++) {
+        buf_printf(out, "%s{%s=\"%s\",quantile=\"%g\"} %.9f\n", metric, label, name, quantiles[q],
+                   hist_percentile(h, quantiles[q]) / 1e9);
+    }
+    buf_printf(out, "%s_sum{%s=\"%s\"} %.9f\n", metric, label, name, __atomic_load_n(&h->sum_ns, __ATOMIC_RELAXED) / 1e9);
+    buf_printf(out, "%s_count{%s=\"%s\"} %llu\n", metric, label, name,
+               (unsigned long long)__atomic_load_n(&h->total, __ATOMIC_RELAXED));
+}
+
+void append_metrics_prometheus(Buffer *out) {
+    buf_printf(out, "# HELP nid_operation_duration_seconds Latency of citizen, audit and login operations\n"
+                    "# TYPE nid_operation_duration_seconds summary\n");
+    for (int i = 0; i < OP_COUNT; i++) {
+        append_prometheus_summary(out, "nid_operation_duration_seconds", "op", operations[i].name, &operations[i].hist);
+    }
+    buf_printf(out, "# HELP nid_statement_duration_seconds Latency of each prepared SQL statement\n"
+                    "# TYPE nid_statement_duration_seconds summary\n");
+    for (int i = 0; i < STMT_COUNT; i++) {
+        append_prometheus_summary(out, "nid_statement_duration_seconds", "stmt", statements[i].name, &statements[i].hist);
+    }
+    NamedMetric metrics[NAMED_METRICS_MAX];
+    append_named_prometheus(out, "nid_cache", metrics, collect_cache_metrics(metrics));
+    append_named_prometheus(out, "nid_sqlite", metrics, collect_sqlite_metrics(metrics));
+}
+
+void print_hist_row(const char *name, const Histogram *h) {
+    uint64_t total = __atomic_load_n(&h->total, __ATOMIC_RELAXED);
+    printf("%-20s %10llu %10.1f %10.1f %10.1f %10.1f\n", name, (unsigned long long)total,
+           total ? __atomic_load_n(&h->sum_ns, __ATOMIC_RELAXED) / 1e3 / total : 0.0,
+           hist_percentile(h, 0.50) / 1e3, hist_percentile(h, 0.99) / 1e3, hist_percentile(h, 0.999) / 1e3);
+}
+
+void print_named_metrics(const char *title, const NamedMetric *metrics, int count) {
+    printf("\n%s\n------------------------------------------------------------------------\n", title);
+    for (int i = 0; i < count; i++) {
+        printf("%-28s %16.15g\n", metrics[i].name, metrics[i].value);
+    }
+}
+
+// Prints the lines of citizen_statistics() as a table
+void print_citizen_statistics(const StatsFilter *f) {
+    Buffer report = {0};
+    if (!citizen_statistics(f, &report)) {
+        printf("Citizen statistics unavailable.\n");
+        buf_free(&report);
+        return;
+    }
+    printf("\n%-20s %-12s %10s\n", "Citizens by", "Value", "Count");
+    printf("--------------------------------------------\n");
+    char *save = NULL;
+    for (char *line = strtok_r(report.data, "\n", &save); line; line = strtok_r(NULL, "\n", &save)) {
+        char *value = strchr(line, '\t');
+        char *count = value ? strchr(value + 1, '\t') : NULL;
+        if (!count) continue;
+        *value++ = '\0';
+        *count++ = '\0';
+        printf("%-20s %-12s %10s\n", line, value, count);
+    }
+    buf_free(&report);
+}
+
+void admin_statistics() {
+    StatsFilter all = {-1, -1, -1, -1};
+    print_citizen_statistics(&all);
+    printf("\n%-20s %10s %10s %10s %10s %10s\n", "Operation", "Count", "Mean (us)", "p50 (us)", "p99 (us)", "p999 (us)");
+    printf("------------------------------------------------------------------------\n");
+    for (int i = 0; i < OP_COUNT; i++) {
+        print_hist_row(operations[i].name, &operations[i].hist);
+    }
+    printf("\n%-20s %10s %10s %10s %10s %10s\n", "Statement", "Calls", "Mean (us)", "p50 (us)", "p99 (us)", "p999 (us)");
+    printf("------------------------------------------------------------------------\n");
+    for (int i = 0; i < STMT_COUNT; i++) {
+        print_hist_row(statements[i].name, &statements[i].hist);
+    }
+    NamedMetric metrics[NAMED_METRICS_MAX];
+    print_named_metrics("Citizen cache", metrics, collect_cache_metrics(metrics));
+    print_named_metrics("SQLite", metrics, collect_sqlite_metrics(metrics));
+
+    char path[256];
+    prompt_line("\nExport to file (.json for JSON, anything else for Prometheus text; blank to skip)", path, sizeof(path));
+    if (!path[0]) {
+        return;
+    }
+    Buffer out = {0};
+    size_t len = strlen(path);
+    if (len > 5 && strcmp(path + len - 5, ".json") == 0) append_metrics_json(&out);
+    else append_metrics_prometheus(&out);
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    if (fd < 0 || !write_full(fd, out.data, out.len)) {
+        perror(path);
+    } else {
+        printf("Metrics written to %s\n", path);
+    }
+    if (fd >= 0) close(fd);
+    buf_free(&out);
+}
+
+char cli_session[SESSION_TOKEN_LEN];
+
+void admin_menu() {
+    int running = 1;
+    while(running) {
+        printf("\nADMIN PANEL\n");
+        printf("1. Register Citizen\n");
+        printf("2. View Citizens\n");
+        printf("3. Search Citizen\n");
+        printf("4. Update Citizen\n");
+        printf("5. Delete Citizen\n");
+        printf("6. View Audit Logs\n");
+        printf("7. Statistics\n");
+        printf("8. Query Citizens\n");
+        printf("9. Review Duplicates\n");
+        printf("10. Logout\n");
+        printf("Choice: ");
+
+        int choice;
+        scanf("%d", &choice);
+        clear_input_buffer();
+        if (choice != 10 && !verify_session(cli_session, NULL, 0)) {
+            printf("Session expired, please log in again.\n");
+            break;
+        }
+
+        switch(choice) {
+            case 1: admin_register_citizen(); break;
+            case 2: admin_view_citizens(); break;
+            case 3: admin_search_citizen(); break;
+            case 4: admin_update_citizen(); break;
+            case 5: admin_delete_citizen(); break;
+            case 6: admin_view_audit_logs(); break;
+            case 7: admin_statistics(); break;
+            case 8: admin_query_citizens(); break;
+            case 9: admin_review_duplicates(); break;
+            case 10: running = 0; break;
+            default: printf("Invalid choice!\n");
+        }
+    }
+}
+
+// ================== BULK IMPORT ==================
+#define IMPORT_FIELDS 7
+#define IMPORT_LINE_MAX 2048
+#define IMPORT_BATCH_SIZE 10000
+
+// Splits a CSV/TSV line in place. Quoted CSV fields may contain commas and "" escapes.
+// Returns the number of fields, or max_fields + 1 if the line has too many.
+int split_import_line(char *line, char delim, char **fields, int max_fields) {
+    int count = 0;
+    char *p = line;
+    while (1) {
+        if (count == max_fields) {
+            return max_fields + 1;
+        }
+        char *out = p;
+        fields[count++] = p;
+        if (delim == ',' && *p == '"') {
+            p++;
+            while (*p) {
+                if (*p == '"' && p[1] == '"') {
+                    *out++ = '"';
+                    p += 2;
+                } else if (*p == '"') {
+                    p++;
+                    break;
+                } else {
+                    *out++ = *p++;
+                }
+            }
+            while (*p && *p != delim) p++;
+        } else {
+            while (*p && *p != delim) *out++ = *p++;
+        }
+        int more = (*p == delim);
+        *out = '\0';
+        if (!more) {
+            return count;
+        }
+        p++;
+    }
+}
+
+// Applies the same rules as input_citizen() to one import row.
+// Field order: name, dob, gender, address, father_name, mother_name, blood_group
+int parse_import_row(char **fields, Citizen *citizen, const char **reason) {
+    static const struct { size_t size; const char *what; } limits[IMPORT_FIELDS] = {
+        {MAX_NAME, "name"}, {11, "dob"}, {10, "gender"}, {MAX_ADDRESS, "address"},
+        {MAX_NAME, "father_name"}, {MAX_NAME, "mother_name"}, {4, "blood_group"}
+    };
+    char *targets[IMPORT_FIELDS] = {
+        citizen->name, citizen->dob, citizen->gender, citizen->address,
+        citizen->father_name, citizen->mother_name, citizen->blood_group
+    };
+    for (int i = 0; i < IMPORT_FIELDS; i++) {
+        size_t len = strlen(fields[i]);
+        if (len == 0 || len >= limits[i].size) {
+            *reason = limits[i].what;
+            return 0;
+        }
+        memcpy(targets[i], fields[i], len + 1);
+    }
+    if (!validate_date(citizen->dob)) {
+        *reason = "dob (expected DD-MM-YYYY between 1900 and 2007)";
+        return 0;
+    }
+    if (!validate_gender(citizen->gender)) {
+        *reason = "gender (expected Male, Female or Other)";
+        return 0;
+    }
+    if (!validate_blood_group(citizen->blood_group)) {
+        *reason = "blood_group";
+        return 0;
+    }
+    strcpy(citizen->gender, gender_name(gender_code(citizen->gender)));
+    citizen->is_active = 1;
+    citizen->created_at = time(NULL);
+    citizen->last_modified = citizen->created_at;
+    return 1;
+}
+
+// Loads citizens from a CSV/TSV stream. Rows are committed batch_size at a time
+// through the registry's citizen and audit INSERT statements; each row has a
+// savepoint, so one whose citizen or audit insert fails leaves nothing behind.
+// Only rows of committed batches count as imported.
+int import_citizens(FILE *in, int batch_size) {
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    char line[IMPORT_LINE_MAX];
+    long line_no = 0, imported = 0, rejected = 0, flagged = 0, batch_flagged = 0, batch_line = 0;
+    int in_batch = 0, ok = sqlite3_exec(db, "BEGIN IMMEDIATE;", 0, 0, 0) == SQLITE_OK;
+    if (!ok) {
+        fprintf(stderr, "Import: database busy: %s\n", sqlite3_errmsg(db));
+    }
+
+    while (ok && fgets(line, sizeof(line), in)) {
+        line_no++;
+        size_t len = strlen(line);
+        if (len == sizeof(line) - 1 && line[len - 1] != '\n') {
+            int ch;
+            while ((ch = fgetc(in)) != EOF && ch != '\n');
+            fprintf(stderr, "line %ld: rejected, line too long\n", line_no);
+            rejected++;
+            continue;
+        }
+        line[strcspn(line, "\r\n")] = '\0';
+        if (line[0] == '\0') {
+            continue;
+        }
+
+        char *fields[IMPORT_FIELDS];
+        char delim = strchr(line, '\t') ? '\t' : ',';
+        int count = split_import_line(line, delim, fields, IMPORT_FIELDS);
+        if (line_no == 1 && strcasecmp(fields[0], "name") == 0) {
+            continue;
+        }
+        if (count != IMPORT_FIELDS) {
+            fprintf(stderr, "line %ld: rejected, expected %d fields but found %s%d\n",
+                    line_no, IMPORT_FIELDS, count > IMPORT_FIELDS ? "more than " : "",
+                    count > IMPORT_FIELDS ? IMPORT_FIELDS : count);
+            rejected++;
+            continue;
+        }
+
+        Citizen citizen;
+        const char *reason = NULL;
+        if (!parse_import_row(fields, &citizen, &reason)) {
+            fprintf(stderr, "line %ld: rejected, invalid %s\n", line_no, reason);
+            rejected++;
+            continue;
+        }
+
+        DuplicateMatch match;
+        sqlite3_exec(db, "SAVEPOINT row;", 0, 0, 0);
+        if (!register_citizen(&citizen, &match) || !insert_audit_row(citizen.nid, "REGISTERED", NULL, time(NULL))) {
+            fprintf(stderr, "line %ld: rejected, %s\n", line_no, sqlite3_errmsg(db));
+            sqlite3_exec(db, "ROLLBACK TO row; RELEASE row;", 0, 0, 0);
+            rejected++;
+        } else {
+            sqlite3_exec(db, "RELEASE row;", 0, 0, 0);
+            if (match.count > 0) {
+                fprintf(stderr, "line %ld: possible duplicate of NID %s (score %.2f), flagged for review\n",
+                        line_no, match.nid, match.score);
+                batch_flagged++;
+            }
+            if (in_batch++ == 0) batch_line = line_no;
+        }
+        if (sqlite3_get_autocommit(db)) {       // an I/O error can roll the whole transaction back
+            fprintf(stderr, "Import: transaction rolled back: %s\n", sqlite3_errmsg(db));
+            ok = 0;
+            break;
+        }
+        if (in_batch >= batch_size) {
+            if (sqlite3_exec(db, "COMMIT;", 0, 0, 0) != SQLITE_OK) {
+                fprintf(stderr, "Commit failed: %s\n", sqlite3_errmsg(db));
+                ok = 0;
+                break;
+            }
+            imported += in_batch;
+            flagged += batch_flagged;
+            in_batch = 0;
+            batch_flagged = 0;
+            if (sqlite3_exec(db, "BEGIN IMMEDIATE;", 0, 0, 0) != SQLITE_OK) {
+                fprintf(stderr, "Import: database busy: %s\n", sqlite3_errmsg(db));
+                ok = 0;
+            }
+        }
+    }
+
+    if (ok && sqlite3_exec(db, "COMMIT;", 0, 0, 0) != SQLITE_OK) {
+        fprintf(stderr, "Commit failed: %s\n", sqlite3_errmsg(db));
+        ok = 0;
+    }
+    if (ok) {
+        imported += in_batch;
+        flagged += batch_flagged;
+    } else {
+        if (!sqlite3_get_autocommit(db)) sqlite3_exec(db, "ROLLBACK;", 0, 0, 0);
+        if (in_batch) {
+            fprintf(stderr, "Import stopped at line %ld; the %d rows read since line %ld were not imported\n",
+                    line_no, in_batch, batch_line);
+        }
+    }
+    cache_transaction_done();
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double elapsed = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    fprintf(stderr, "Imported %ld citizens, rejected %ld rows in %.2fs (%.0f rows/sec)\n",
+            imported, rejected, elapsed, elapsed > 0 ? imported / elapsed : 0.0);
+    if (flagged) {
+        fprintf(stderr, "%ld possible duplicates flagged for review\n", flagged);
+    }
+    return ok;
+}
+
+// ================== CHANGE FEED ==================
+// Replicas follow the register through citizen_changes, where triggers number every
+// insert, update and delete (create_change_triggers()). SQLite admits one writer at a
+// time and the number is taken inside its transaction, so numbers become visible in
+// order and a reader never passes one that commits later. An entry holds only the
+// NID: readers send the row as it is when read, which a replica applies as an
+// upsert, so replaying a change twice is harmless. Consumers acknowledge what they
+// have applied, and entries every consumer has acknowledged are deleted; the highest
+// deleted number is kept in settings as 'changes_compacted'. Entries older than
+// CHANGES_RETENTION_DAYS are deleted by the purge (see TOMBSTONE PURGE) whether or
+// not they were acknowledged, so the table stays bounded with no replica, or with
+// one that stopped reading; such a consumer is logged and must start again. A new
+// replica loads an export and reads on from the change_seq in its manifest.
+#define CHANGES_DEFAULT_LIMIT 500
+#define CHANGES_MAX_LIMIT 10000
+#define CHANGES_RETENTION_DAYS 7
+
+const char *change_ops[] = {"", "insert", "update", "delete"};
+
+// Last number handed out, and the highest one compacted away
+int change_position(sqlite3_int64 *last, sqlite3_int64 *compacted) {
+    sqlite3_stmt *stmt = stmt_acquire(STMT_CHANGE_POSITION);
+    int ok = sqlite3_step(stmt) == SQLITE_ROW;
+    if (ok) {
+        *last = sqlite3_column_int64(stmt, 0);
+        *compacted = sqlite3_column_int64(stmt, 1);
+    }
+    stmt_release(STMT_CHANGE_POSITION);
+    return ok;
+}
+
+// Appends up to limit changes numbered after since, oldest first, as
+// "\n<seq>\t<op>\t<citizen columns as in the dump>" ("\n<seq>\tdelete\t<nid>" once
+// deleted). An insert or update whose citizen has since been deleted is passed over.
+// Stops early rather than let out grow past max_bytes (0: no limit). *last is the
+// number to read on from; *more is set when the batch ended before the feed did.
+// Returns the entries read, -1 on error, or -2 if entries after since were compacted.
+int read_changes(sqlite3_int64 since, int limit, size_t max_bytes, Buffer *out, sqlite3_int64 *last, int *more) {
+    sqlite3_int64 head, compacted;
+    if (!change_position(&head, &compacted)) {
+        return -1;
+    }
+    if (since < compacted) {
+        return -2;
+    }
+    if (limit <= 0) limit = CHANGES_DEFAULT_LIMIT;
+    if (limit > CHANGES_MAX_LIMIT) limit = CHANGES_MAX_LIMIT;
+    *last = since;
+    *more = 0;
+    int read = 0, rc;
+    sqlite3_stmt *stmt = stmt_acquire(STMT_CHANGE_SELECT);
+    sqlite3_bind_int64(stmt, 1, since);
+    sqlite3_bind_int(stmt, 2, limit);
+    while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+        if (max_bytes && out->len + sizeof(Citizen) + 64 > max_bytes) {
+            *more = 1;
+            break;
+        }
+        sqlite3_int64 seq = sqlite3_column_int64(stmt, 0);
+        int op = sqlite3_column_int(stmt, 1);
+        sqlite3_int64 key = sqlite3_column_int64(stmt, 2);
+        if (op == 3) {
+            char nid[20];
+            format_nid(key, nid);
+            buf_printf(out, "\n%lld\tdelete\t%s", (long long)seq, nid);
+        } else {
+            sqlite3_stmt *row = stmt_acquire_shard(STMT_CITIZEN_SELECT, citizen_shard(key));
+            sqlite3_bind_int64(row, 1, key);
+            if (sqlite3_step(row) == SQLITE_ROW) {
+                buf_printf(out, "\n%lld\t%s", (long long)seq, change_ops[op == 1 ? 1 : 2]);
+                for (int col = 0; col < 11; col++) {
+                    buf_append(out, "\t", 1);
+                    append_citizen_column(out, row, col);
+                }
+            }
+            stmt_release(STMT_CITIZEN_SELECT);
+        }
+        *last = seq;
+        read++;
+    }
+    stmt_release(STMT_CHANGE_SELECT);
+    if (rc != SQLITE_ROW && rc != SQLITE_DONE) {
+        return -1;
+    }
+    if (read == limit) *more = 1;
+    return read;
+}
+
+// Records that consumer has applied every change up to seq, then deletes the entries
+// all consumers have. Forgetting a consumer (seq < 0) lets compaction pass it by.
+// Runs in the caller's transaction or one of its own. Returns the number compacted up
+// to, -1 on error, or -2 if seq has not been handed out yet or was compacted already.
+sqlite3_int64 ack_changes(const char *consumer, sqlite3_int64 seq) {
+    sqlite3_int64 head, compacted;
+    int own = sqlite3_get_autocommit(db);
+    if (own && sqlite3_exec(db, "BEGIN IMMEDIATE;", 0, 0, 0) != SQLITE_OK) {
+        return -1;
+    }
+    int ok = change_position(&head, &compacted);
+    if (ok && (seq > head || (seq >= 0 && seq < compacted))) {
+        if (own) sqlite3_exec(db, "ROLLBACK;", 0, 0, 0);
+        return -2;
+    }
+    StmtId id = seq < 0 ? STMT_CONSUMER_DELETE : STMT_CHANGE_ACK;
+    sqlite3_stmt *stmt = stmt_acquire(id);
+    sqlite3_bind_text(stmt, 1, consumer, -1, SQLITE_STATIC);
+    if (seq >= 0) {
+        sqlite3_bind_int64(stmt, 2, seq);
+        sqlite3_bind_int64(stmt, 3, (sqlite3_int64)time(NULL));
+    }
+    ok = ok && sqlite3_step(stmt) == SQLITE_DONE;
+    stmt_release(id);
+    StmtId steps[] = {STMT_CHANGE_COMPACT, STMT_CHANGE_MARK};
+    for (int i = 0; ok && i < 2; i++) {
+        ok = sqlite3_step(stmt_acquire(steps[i])) == SQLITE_DONE;
+        stmt_release(steps[i]);
+    }
+    ok = ok && change_position(&head, &compacted);
+    if (own) {
+        if (!ok || sqlite3_exec(db, "COMMIT;", 0, 0, 0) != SQLITE_OK) {
+            sqlite3_exec(db, "ROLLBACK;", 0, 0, 0);
+            ok = 0;
+        }
+    }
+    return ok ? compacted : -1;
+}
+
+// Deletes the entries older than retention_days, logging the consumers left behind.
+// Returns how many were deleted, or -1 on error.
+long expire_changes(int retention_days) {
+    sqlite3_int64 head, compacted, expired = 0;
+    if (sqlite3_exec(db, "BEGIN IMMEDIATE;", 0, 0, 0) != SQLITE_OK) {
+        return -1;
+    }
+    int ok = change_position(&head, &compacted);
+    sqlite3_stmt *stmt = stmt_acquire(STMT_CHANGE_EXPIRY);
+    sqlite3_bind_int64(stmt, 1, (sqlite3_int64)(time(NULL) - (time_t)retention_days * 86400));
+    ok = ok && sqlite3_step(stmt) == SQLITE_ROW;
+    if (ok) expired = sqlite3_column_int64(stmt, 0);
+    stmt_release(STMT_CHANGE_EXPIRY);
+    long deleted = 0;
+    if (ok && expired > compacted) {
+        StmtId steps[] = {STMT_CHANGE_TRIM, STMT_CHANGE_MARK_AT};
+        for (int i = 0; ok && i < 2; i++) {
+            stmt = stmt_acquire(steps[i]);
+            sqlite3_bind_int64(stmt, 1, expired);
+            ok = sqlite3_step(stmt) == SQLITE_DONE;
+            if (i == 0) deleted = sqlite3_changes(db);
+            stmt_release(steps[i]);
+        }
+        stmt = stmt_acquire(STMT_CONSUMER_STALE);
+        sqlite3_bind_int64(stmt, 1, expired);
+        while (ok && sqlite3_step(stmt) == SQLITE_ROW) {
+            char when[32];
+            time_t at = (time_t)sqlite3_column_int64(stmt, 2);
+            strftime(when, sizeof(when), "%Y-%m-%d %H:%M", localtime(&at));
+            fprintf(stderr, "Changes: consumer %s last acknowledged %lld on %s, older than %d days; it must "
+                            "reload from an export (or drop it with --forget-consumer)\n",
+                    (const char *)sqlite3_column_text(stmt, 0), sqlite3_column_int64(stmt, 1), when, retention_days);
+        }
+        stmt_release(STMT_CONSUMER_STALE);
+    }
+    if (!ok || sqlite3_exec(db, "COMMIT;", 0, 0, 0) != SQLITE_OK) {
+        fprintf(stderr, "Changes: expiring old entries failed: %s\n", sqlite3_errmsg(db));
+        sqlite3_exec(db, "ROLLBACK;", 0, 0, 0);
+        return -1;
+    }
+    return deleted;
+}
+
+// Writes the changes after since to fd as tab-separated lines, batch by batch until
+// the feed is read to the end. since < 0 resumes after consumer's acknowledgement.
+// With a consumer each batch is acknowledged once written, so only use one when fd
+// leads somewhere that keeps the lines.
+int stream_changes(sqlite3_int64 since, const char *consumer, int batch_size, int fd) {
+    if (since < 0 && consumer) {
+        sqlite3_stmt *stmt = stmt_acquire(STMT_CONSUMER_SELECT);
+        sqlite3_bind_text(stmt, 1, consumer, -1, SQLITE_STATIC);
+        if (sqlite3_step(stmt) == SQLITE_ROW) since = sqlite3_column_int64(stmt, 0);
+        stmt_release(STMT_CONSUMER_SELECT);
+    }
+    if (since < 0) {
+        fprintf(stderr, "Changes: no acknowledgement to resume from; give a sequence number\n");
+        return 0;
+    }
+    static const char *header = "seq\top\tnid\tname\tdob\tgender\taddress\tfather_name\tmother_name\t"
+                                "blood_group\tis_active\tcreated_at\tlast_modified\n";
+    int ok = 1, batches = 0;
+    long entries = 0;
+    sqlite3_int64 last = since;
+    Buffer out = {0};
+    int more = 1;
+    while (ok && more) {
+        out.len = 0;
+        int read = read_changes(since, batch_size, 0, &out, &last, &more);
+        if (read < 0) {
+            if (read == -2) {
+                fprintf(stderr, "Changes after %lld have been compacted; reload from an export and "
+                                "read on from its change_seq\n", (long long)since);
+            } else {
+                fprintf(stderr, "Changes: reading the feed failed: %s\n", sqlite3_errmsg(db));
+            }
+            ok = 0;
+            break;
+        }
+        if (batches++ == 0) {
+            ok = write_full(fd, header, strlen(header));
+        }
+        if (ok && out.len > 0) {
+            ok = write_full(fd, out.data + 1, out.len - 1) && write_full(fd, "\n", 1);
+            if (!ok) perror("Changes");
+        }
+        if (ok && consumer && read > 0 && ack_changes(consumer, last) < 0) {
+            fprintf(stderr, "Changes: acknowledging %lld failed: %s\n", (long long)last, sqlite3_errmsg(db));
+            ok = 0;
+        }
+        entries += read;
+        since = last;
+    }
+    buf_free(&out);
+    if (ok) fprintf(stderr, "Changes: %ld entries, read up to %lld\n", entries, (long long)last);
+    return ok;
+}
+
+// ================== PARALLEL EXPORT ==================
+// Splits the NID keyspace into equal ranges and scans each on its own read
+// connection and thread, formatting rows straight from the column values into a
+// large buffer per shard. When the database itself is sharded there is one export
+// shard per database shard instead, each scanning only its own file. The main
+// connection holds the write lock only until every thread has opened its read
+// transaction, so all shards read the same committed state while writes carry on
+// (the database is switched to WAL mode for this). Shard files are renamed into
+// place when complete and manifest.json is written last.
+#define EXPORT_BUFFER_SIZE (1 << 20)
+#define EXPORT_MAX_SHARDS 64
+#define EXPORT_SNAPSHOT_MAGIC "NIDSNAP1"
+
+typedef enum {
+    EXPORT_CSV,
+    EXPORT_NDJSON,
+    EXPORT_BINARY
+} ExportFormat;
+
+const char *export_extensions[] = {"csv", "ndjson", "bin"};
+const char *export_columns[] = {"nid", "name", "dob", "gender", "address", "father_name",
+                                "mother_name", "blood_group", "is_active", "created_at", "last_modified"};
+
+typedef struct {
+    ExportFormat format;
+    int compress;
+    const char *schema;             // that holds the citizens table to scan
+    sqlite3_int64 from;             // NIDs in [from, to)
+    sqlite3_int64 to;
+    char path[1024];
+    long rows;
+    unsigned long long bytes;       // before compression
+    unsigned char digest[SHA256_DIGEST_LENGTH];
+    int ok;
+    struct ExportGate *gate;
+} ExportShard;
+
+// Counts down the threads that still have to open their read transaction
+typedef struct ExportGate {
+    pthread_mutex_t lock;
+    pthread_cond_t opened;
+    int pending;
+} ExportGate;
+
+void export_gate_pass(ExportGate *gate) {
+    pthread_mutex_lock(&gate->lock);
+    gate->pending--;
+    pthread_cond_signal(&gate->opened);
+    pthread_mutex_unlock(&gate->lock);
+}
+
+typedef struct {
+    int fd;
+    gzFile gz;
+    EVP_MD_CTX *sha;
+    Buffer buf;
+    unsigned long long bytes;
+} ExportWriter;
+
+int export_flush(ExportWriter *w) {
+    if (w->buf.len == 0) {
+        return 1;
+    }
+    EVP_DigestUpdate(w->sha, w->buf.data, w->buf.len);
+    w->bytes += w->buf.len;
+    int ok = w->gz ? gzwrite(w->gz, w->buf.data, (unsigned)w->buf.len) == (int)w->buf.len
+                   : write_full(w->fd, w->buf.data, w->buf.len);
+    w->buf.len = 0;
+    return ok;
+}
+
+void append_csv_field(Buffer *out, const char *text, size_t len) {
+    if (!memchr(text, ',', len) && !memchr(text, '"', len) && !memchr(text, '\n', len) && !memchr(text, '\r', len)) {
+        buf_append(out, text, len);
+        return;
+    }
+    buf_append(out, "\"", 1);
+    for (size_t i = 0; i < len; i++) {
+        if (text[i] == '"') buf_append(out, "\"", 1);
+        buf_append(out, text + i, 1);
+    }
+    buf_append(out, "\"", 1);
+}
+
+void append_json_string(Buffer *out, const char *text, size_t len) {
+    buf_append(out, "\"", 1);
+    size_t start = 0;
+    for (size_t i = 0; i < len; i++) {
+        unsigned char ch = (unsigned char)text[i];
+        if (ch != '"' && ch != '\\' && ch >= 0x20) continue;
+        buf_append(out, text + start, i - start);
+        if (ch == '"' || ch == '\\') buf_printf(out, "\\%c", ch);
+        else buf_printf(out, "\\u%04x", ch);
+        start = i + 1;
+    }
+    buf_append(out, text + start, len - start);
+    buf_append(out, "\"", 1);
+}
+
+void put_le(Buffer *out, uint64_t value, int bytes) {
+    unsigned char data[8];
+    for (int i = 0; i < bytes; i++) data[i] = (unsigned char)(value >> (8 * i));
+    buf_append(out, (const char*)data, bytes);
+}
+
+// Columns 0-7 come from citizen_column_text(): coded ones formatted as in the dump,
+// free text straight from the statement unless it has to be decrypted
+void export_csv_row(Buffer *out, sqlite3_stmt *stmt) {
+    char scratch[PII_MAX_TEXT];
+    int len;
+    for (int col = 0; col < 11; col++) {
+        if (col) buf_append(out, ",", 1);
+        const char *text = citizen_column_text(stmt, col, scratch, &len);
+        if (text) append_csv_field(out, text, len);
+        else append_column(out, stmt, col);
+    }
+    buf_append(out, "\n", 1);
+}
+
+void export_ndjson_row(Buffer *out, sqlite3_stmt *stmt) {
+    char scratch[PII_MAX_TEXT];
+    int len;
+    for (int col = 0; col < 11; col++) {
+        buf_printf(out, "%s\"%s\":", col ? "," : "{", export_columns[col]);
+        const char *text = citizen_column_text(stmt, col, scratch, &len);
+        if (text) append_json_string(out, text, len);
+        else buf_printf(out, "%lld", (long long)sqlite3_column_int64(stmt, col));
+    }
+    buf_append(out, "}\n", 2);
+}
+
+// Little-endian record laid out like CompactCitizen: u32 length of the rest,
+// i64 nid, created_at, last_modified, i32 dob, u8 gender, blood_group,
+// is_active, u8 lengths of name, address, father and mother, then their text.
+int export_binary_row(Buffer *out, sqlite3_stmt *stmt) {
+    static const int text_cols[] = {1, 4, 5, 6};
+    char scratch[4][PII_MAX_TEXT];
+    const char *texts[4];
+    int lengths[4], total = 0;
+    for (int i = 0; i < 4; i++) {
+        texts[i] = pii_column(stmt, text_cols[i], scratch[i], &lengths[i]);
+        if (lengths[i] > UINT8_MAX) return 0;
+        total += lengths[i];
+    }
+    put_le(out, 8 * 3 + 4 + 3 + 4 + total, 4);
+    put_le(out, (uint64_t)sqlite3_column_int64(stmt, 0), 8);
+    put_le(out, (uint64_t)sqlite3_column_int64(stmt, 9), 8);
+    put_le(out, (uint64_t)sqlite3_column_int64(stmt, 10), 8);
+    put_le(out, (uint32_t)sqlite3_column_int(stmt, 2), 4);
+    put_le(out, (uint64_t)sqlite3_column_int(stmt, 3), 1);
+    put_le(out, (uint64_t)sqlite3_column_int(stmt, 7), 1);
+    put_le(out, (uint64_t)sqlite3_column_int(stmt, 8), 1);
+    for (int i = 0; i < 4; i++) put_le(out, lengths[i], 1);
+    for (int i = 0; i < 4; i++) buf_append(out, texts[i], lengths[i]);
+    return 1;
+}
+
+void export_header(Buffer *out, ExportFormat format) {
+    if (format == EXPORT_CSV) {
+        for (int col = 0; col < 11; col++) {
+            buf_printf(out, "%s%s", col ? "," : "", export_columns[col]);
+        }
+        buf_append(out, "\n", 1);
+    } else if (format == EXPORT_BINARY) {
+        buf_append(out, EXPORT_SNAPSHOT_MAGIC, strlen(EXPORT_SNAPSHOT_MAGIC));
+    }
+}
+
+void *export_thread(void *arg) {
+    ExportShard *shard = arg;
+    char tmp_path[1040];
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", shard->path);
+    ExportWriter w = {0};
+    w.fd = -1;
+    shard->ok = 0;
+    if (!open_thread_connection(SQLITE_OPEN_READONLY)) {
+        export_gate_pass(shard->gate);
+        return NULL;
+    }
+    sqlite3_stmt *stmt = NULL;
+    char sql[128];
+    snprintf(sql, sizeof(sql), "SELECT * FROM %s.citizens WHERE nid >= ?1 AND nid < ?2 AND deleted_at IS NULL "
+                               "ORDER BY nid;", shard->schema);
+    if (sqlite3_prepare_v2(db, sql, -1, &stmt, 0) != SQLITE_OK) {
+        fprintf(stderr, "SQL error: %s\n", sqlite3_errmsg(db));
+        export_gate_pass(shard->gate);
+        close_connection();
+        return NULL;
+    }
+    // The first step opens the read transaction the whole scan runs in
+    sqlite3_bind_int64(stmt, 1, shard->from);
+    sqlite3_bind_int64(stmt, 2, shard->to);
+    int rc = sqlite3_step(stmt);
+    export_gate_pass(shard->gate);
+    w.fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    if (w.fd >= 0 && shard->compress) {
+        w.gz = gzdopen(w.fd, "wb1");
+        if (w.gz) {
+            gzbuffer(w.gz, EXPORT_BUFFER_SIZE);
+        } else {
+            close(w.fd);
+            w.fd = -1;
+        }
+    }
+    int ok = w.fd >= 0 && (!shard->compress || w.gz);
+    if (!ok) perror(tmp_path);
+    w.sha = EVP_MD_CTX_new();
+    ok = ok && w.sha && EVP_DigestInit_ex(w.sha, EVP_sha256(), NULL);
+    buf_reserve(&w.buf, EXPORT_BUFFER_SIZE + 4096);
+    export_header(&w.buf, shard->format);
+
+    while (ok && rc == SQLITE_ROW) {
+        if (shard->format == EXPORT_CSV) {
+            export_csv_row(&w.buf, stmt);
+        } else if (shard->format == EXPORT_NDJSON) {
+            export_ndjson_row(&w.buf, stmt);
+        } else if (!export_binary_row(&w.buf, stmt)) {
+            fprintf(stderr, "Export: field too long for the snapshot format in NID %lld\n",
+                    (long long)sqlite3_column_int64(stmt, 0));
+            ok = 0;
+        }
+        shard->rows++;
+        if (w.buf.len >= EXPORT_BUFFER_SIZE) ok = ok && export_flush(&w);
+        rc = sqlite3_step(stmt);
+    }
+    if (ok && rc != SQLITE_DONE) {
+        fprintf(stderr, "Export failed: %s\n", sqlite3_errmsg(db));
+        ok = 0;
+    }
+    ok = ok && export_flush(&w);
+    sqlite3_finalize(stmt);
+    close_connection();
+
+    if (w.gz) {
+        if (gzclose(w.gz) != Z_OK) ok = 0;
+    } else if (w.fd >= 0 && close(w.fd) != 0) {
+        ok = 0;
+    }
+    if (w.sha) {
+        EVP_DigestFinal_ex(w.sha, shard->digest, NULL);
+        EVP_MD_CTX_free(w.sha);
+    }
+    buf_free(&w.buf);
+    shard->bytes = w.bytes;
+    if (ok && rename(tmp_path, shard->path) != 0) {
+        perror(shard->path);
+        ok = 0;
+    }
+    if (!ok) unlink(tmp_path);
+    shard->ok = ok;
+    return NULL;
+}
+
+int write_export_manifest(const char *dir, ExportShard *shards, int count, time_t started, sqlite3_int64 change_seq) {
+    char path[1024], tmp_path[1040];
+    snprintf(path, sizeof(path), "%s/manifest.json", dir);
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+    FILE *f = fopen(tmp_path, "w");
+    if (!f) {
+        perror(tmp_path);
+        return 0;
+    }
+    long total = 0;
+    for (int i = 0; i < count; i++) total += shards[i].rows;
+    fprintf(f, "{\n  \"format\": \"%s\",\n  \"compression\": \"%s\",\n  \"exported_at\": %lld,\n"
+               "  \"change_seq\": %lld,\n  \"rows\": %ld,\n  \"columns\": [",
+            export_extensions[shards[0].format], shards[0].compress ? "gzip" : "none",
+            (long long)started, (long long)change_seq, total);
+    for (int col = 0; col < 11; col++) fprintf(f, "%s\"%s\"", col ? ", " : "", export_columns[col]);
+    fprintf(f, "],\n  \"shards\": [\n");
+    for (int i = 0; i < count; i++) {
+        const char *name = strrchr(shards[i].path, '/');
+        char hex[SHA256_DIGEST_LENGTH * 2 + 1];
+        for (int b = 0; b < SHA256_DIGEST_LENGTH; b++) sprintf(hex + b * 2, "%02x", shards[i].digest[b]);
+        fprintf(f, "    {\"file\": \"%s\", \"nid_from\": %lld, \"nid_to\": %lld, \"rows\": %ld, "
+                   "\"bytes\": %llu, \"sha256\": \"%s\"}%s\n",
+                name ? name + 1 : shards[i].path, (long long)shards[i].from, (long long)shards[i].to - 1,
+                shards[i].rows, shards[i].bytes, hex, i + 1 < count ? "," : "");
+    }
+    fprintf(f, "  ]\n}\n");
+    if (fclose(f) != 0 || rename(tmp_path, path) != 0) {
+        perror(path);
+        unlink(tmp_path);
+        return 0;
+    }
+    return 1;
+}
+
+// Exports every citizen into shard_count files under dir plus manifest.json, which
+// records the change feed position the export corresponds to
+int export_citizens(const char *dir, ExportFormat format, int shard_count, int compress) {
+    if (shard_count < 1) shard_count = 1;
+    if (shard_count > EXPORT_MAX_SHARDS) shard_count = EXPORT_MAX_SHARDS;
+    if (db_shards) shard_count = db_shards;
+    if (mkdir(dir, 0700) != 0 && errno != EEXIST) {
+        perror(dir);
+        return 0;
+    }
+    // The write lock keeps the shards consistent with each other until each thread
+    // has its read transaction
+    if (sqlite3_exec(db, "PRAGMA journal_mode=WAL;", 0, 0, 0) != SQLITE_OK ||
+        sqlite3_exec(db, "BEGIN IMMEDIATE;", 0, 0, 0) != SQLITE_OK) {
+        fprintf(stderr, "Export: cannot lock the database: %s\n", sqlite3_errmsg(db));
+        return 0;
+    }
+    // Replicas loading the export read the change feed on from here
+    sqlite3_int64 change_seq = 0, compacted;
+    change_position(&change_seq, &compacted);
+    ExportGate gate = {PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, shard_count};
+    ExportShard shards[EXPORT_MAX_SHARDS] = {0};
+    for (int i = 0; i < (db_shards ? db_shards : 1); i++) {
+        sqlite3_int64 low = 0, high = 0;
+        sqlite3_stmt *stmt;
+        char sql[128];
+        snprintf(sql, sizeof(sql), "SELECT MIN(nid), MAX(nid) FROM %s.citizens;", citizen_schema(i));
+        if (sqlite3_prepare_v2(db, sql, -1, &stmt, 0) == SQLITE_OK) {
+            if (sqlite3_step(stmt) == SQLITE_ROW && sqlite3_column_type(stmt, 0) != SQLITE_NULL) {
+                low = sqlite3_column_int64(stmt, 0);
+                high = sqlite3_column_int64(stmt, 1);
+            }
+            sqlite3_finalize(stmt);
+        }
+        shards[i].schema = citizen_schema(i);
+        shards[i].from = low;
+        shards[i].to = high + 1;
+    }
+
+    time_t started = time(NULL);
+    long long start_ns = now_ns();
+    pthread_t threads[EXPORT_MAX_SHARDS];
+    int started_threads[EXPORT_MAX_SHARDS] = {0};
+    sqlite3_int64 low = shards[0].from, high = shards[0].to - 1;
+    sqlite3_int64 width = (high - low) / shard_count + 1;
+    for (int i = 0; i < shard_count; i++) {
+        ExportShard *shard = &shards[i];
+        shard->format = format;
+        shard->compress = compress;
+        shard->gate = &gate;
+        if (!db_shards) {
+            shard->schema = "main";
+            shard->from = low + width * i;
+            shard->to = i + 1 == shard_count ? high + 1 : shard->from + width;
+        }
+        snprintf(shard->path, sizeof(shard->path), "%s/citizens-%03d.%s%s", dir, i,
+                 export_extensions[format], compress ? ".gz" : "");
+        started_threads[i] = pthread_create(&threads[i], NULL, export_thread, shard) == 0;
+        if (!started_threads[i]) {
+            fprintf(stderr, "Export: cannot start thread for shard %d\n", i);
+            export_gate_pass(&gate);
+        }
+    }
+    pthread_mutex_lock(&gate.lock);
+    while (gate.pending > 0) pthread_cond_wait(&gate.opened, &gate.lock);
+    pthread_mutex_unlock(&gate.lock);
+    sqlite3_exec(db, "ROLLBACK;", 0, 0, 0);
+    int ok = 1;
+    long rows = 0;
+    unsigned long long bytes = 0;
+    for (int i = 0; i < shard_count; i++) {
+        if (started_threads[i]) pthread_join(threads[i], NULL);
+        ok = ok && started_threads[i] && shards[i].ok;
+        rows += shards[i].rows;
+        bytes += shards[i].bytes;
+    }
+    ok = ok && write_export_manifest(dir, shards, shard_count, started, change_seq);
+
+    double elapsed = (now_ns() - start_ns) / 1e9;
+    if (ok) {
+        fprintf(stderr, "Exported %ld citizens in %d shards (%.1f MB) in %.2fs (%.0f rows/sec, %.1f MB/s)\n",
+                rows, shard_count, bytes / 1e6, elapsed, elapsed > 0 ? rows / elapsed : 0.0,
+                elapsed > 0 ? bytes / 1e6 / elapsed : 0.0);
+    } else {
+        fprintf(stderr, "Export failed; no manifest written\n");
+    }
+    return ok;
+}
+
+// ================== AUDIT RETENTION ==================
+// Whole calendar months (UTC) older than the retention window are copied from
+// audit_logs into gzip-compressed TSV files, recorded in audit_archives, and then
+// deleted in small transactions so live inserts keep flowing. A file is cataloged
+// as pending before it is renamed into place and completed after, and rows are only
+// deleted once their file is complete. Re-running after an interruption first
+// settles pending entries against the files, then deletes rows that are already
+// archived instead of exporting them twice.
+#define ARCHIVE_KEEP_MONTHS 12
+#define ARCHIVE_CHUNK 5000
+
+time_t utc_month_start(int year, int month) {
+    struct tm tm = {0};
+    tm.tm_year = year - 1900 + (month >= 0 ? month / 12 : (month - 11) / 12);
+    tm.tm_mon = ((month % 12) + 12) % 12;
+    tm.tm_mday = 1;
+    return timegm(&tm);
+}
+
+int exec_sql(const char *sql) {
+    char *err_msg = 0;
+    if (sqlite3_exec(db, sql, 0, 0, &err_msg) != SQLITE_OK) {
+        fprintf(stderr, "SQL error: %s\n", err_msg ? err_msg : sqlite3_errmsg(db));
+        sqlite3_free(err_msg);
+        return 0;
+    }
+    return 1;
+}
+
+// Deletes archived rows of one month in short transactions; returns rows deleted or -1
+long delete_archived_rows(time_t start, time_t end, long long first_id, long long last_id) {
+    sqlite3_stmt *stmt;
+    if (sqlite3_prepare_v2(db,
+            "DELETE FROM audit_logs WHERE id IN (SELECT id FROM audit_logs "
+            "WHERE timestamp >= ?1 AND timestamp < ?2 AND id BETWEEN ?3 AND ?4 LIMIT ?5);",
+            -1, &stmt, 0) != SQLITE_OK) {
+        fprintf(stderr, "SQL error: %s\n", sqlite3_errmsg(db));
+        return -1;
+    }
+    long total = 0;
+    int changed;
+    do {
+        sqlite3_bind_int64(stmt, 1, (sqlite3_int64)start);
+        sqlite3_bind_int64(stmt, 2, (sqlite3_int64)end);
+        sqlite3_bind_int64(stmt, 3, first_id);
+        sqlite3_bind_int64(stmt, 4, last_id);
+        sqlite3_bind_int(stmt, 5, ARCHIVE_CHUNK);
+        if (sqlite3_step(stmt) != SQLITE_DONE) {
+            fprintf(stderr, "Delete failed: %s\n", sqlite3_errmsg(db));
+            sqlite3_finalize(stmt);
+            return -1;
+        }
+        changed = sqlite3_changes(db);
+        total += changed;
+        sqlite3_reset(stmt);
+    } while (changed == ARCHIVE_CHUNK);
+    sqlite3_finalize(stmt);
+    return total;
+}
+
+// Removes rows left behind by an interrupted run, using the catalog's id ranges
+int purge_cataloged_rows(const char *month, time_t start, time_t end) {
+    sqlite3_stmt *stmt;
+    if (sqlite3_prepare_v2(db, "SELECT first_id, last_id FROM audit_archives WHERE month = ? AND status = 'complete';",
+                           -1, &stmt, 0) != SQLITE_OK) {
+        return 0;
+    }
+    sqlite3_bind_text(stmt, 1, month, -1, SQLITE_STATIC);
+    int ok = 1;
+    while (ok && sqlite3_step(stmt) == SQLITE_ROW) {
+        ok = delete_archived_rows(start, end, sqlite3_column_int64(stmt, 0), sqlite3_column_int64(stmt, 1)) >= 0;
+    }
+    sqlite3_finalize(stmt);
+    return ok;
+}
+
+// Exports one month inside a single read transaction, so the exported id range is
+// exactly what a later delete may remove. Returns rows written or -1.
+long export_audit_month(const char *path, time_t start, time_t end, long long *first_id, long long *last_id) {
+    gzFile gz = gzopen(path, "wb6");
+    if (!gz) {
+        perror(path);
+        return -1;
+    }
+    sqlite3_stmt *stmt;
+    if (sqlite3_prepare_v2(db,
+            "SELECT id, nid, timestamp, activity_type, details FROM audit_logs "
+            "WHERE timestamp >= ?1 AND timestamp < ?2 AND (timestamp > ?1 OR id > ?3) "
+            "ORDER BY timestamp, id LIMIT ?4;", -1, &stmt, 0) != SQLITE_OK) {
+        fprintf(stderr, "SQL error: %s\n", sqlite3_errmsg(db));
+        gzclose(gz);
+        return -1;
+    }
+    long rows = 0;
+    int ok = exec_sql("BEGIN;") && gzputs(gz, "id\tnid\ttimestamp\tactivity_type\tdetails\n") > 0;
+    long long after_ts = start, after_id = -1;
+    *first_id = LLONG_MAX;
+    *last_id = -1;
+    while (ok) {
+        int chunk = 0, rc;
+        sqlite3_bind_int64(stmt, 1, after_ts);
+        sqlite3_bind_int64(stmt, 2, (sqlite3_int64)end);
+        sqlite3_bind_int64(stmt, 3, after_id);
+        sqlite3_bind_int(stmt, 4, ARCHIVE_CHUNK);
+        while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+            after_id = sqlite3_column_int64(stmt, 0);
+            after_ts = sqlite3_column_int64(stmt, 2);
+            if (after_id < *first_id) *first_id = after_id;
+            if (after_id > *last_id) *last_id = after_id;
+            const char *details = (const char*)sqlite3_column_text(stmt, 4);
+            if (gzprintf(gz, "%lld\t%s\t%lld\t%s\t%s\n", after_id, (const char*)sqlite3_column_text(stmt, 1),
+                         after_ts, (const char*)sqlite3_column_text(stmt, 3), details ? details : "") <= 0) {
+                ok = 0;
+                break;
+            }
+            chunk++;
+        }
+        sqlite3_reset(stmt);
+        if (rc != SQLITE_DONE && rc != SQLITE_ROW) {
+            fprintf(stderr, "Export failed: %s\n", sqlite3_errmsg(db));
+            ok = 0;
+        }
+        rows += chunk;
+        if (chunk < ARCHIVE_CHUNK) break;
+    }
+    sqlite3_finalize(stmt);
+    exec_sql("COMMIT;");
+    if (gzclose(gz) != Z_OK) {
+        fprintf(stderr, "%s: write failed\n", path);
+        ok = 0;
+    }
+    return ok ? rows : -1;
+}
+
+// Entries in an archive file, or -1 if it cannot be read to its end
+long count_archive_rows(const char *path) {
+    gzFile gz = gzopen(path, "rb");
+    if (!gz) {
+        return -1;
+    }
+    char line[4096];
+    long lines = 0;
+    while (gzgets(gz, line, sizeof(line))) {
+        if (strchr(line, '\n')) lines++;
+    }
+    int err;
+    gzerror(gz, &err);
+    int whole = err == Z_OK && gzeof(gz);
+    gzclose(gz);
+    return whole && lines > 0 ? lines - 1 : -1;     // less the header line
+}
+
+int set_archive_status(const char *path, const char *status) {
+    sqlite3_stmt *stmt;
+    const char *sql = status ? "UPDATE audit_archives SET status = ?2 WHERE path = ?1;"
+                             : "DELETE FROM audit_archives WHERE path = ?1;";
+    if (sqlite3_prepare_v2(db, sql, -1, &stmt, 0) != SQLITE_OK) {
+        fprintf(stderr, "SQL error: %s\n", sqlite3_errmsg(db));
+        return 0;
+    }
+    sqlite3_bind_text(stmt, 1, path, -1, SQLITE_STATIC);
+    if (status) sqlite3_bind_text(stmt, 2, status, -1, SQLITE_STATIC);
+    int ok = sqlite3_step(stmt) == SQLITE_DONE;
+    sqlite3_finalize(stmt);
+    return ok;
+}
+
+// Settles what an interrupted run left: a pending file that reached its name whole
+// is completed, anything else pending is removed with its entry (its rows were not
+// deleted, so the month is archived again). Leftover .tmp files in dir go too;
+// archive files the catalog does not know are reported and kept.
+int reconcile_audit_archives(const char *dir) {
+    sqlite3_stmt *stmt;
+    if (sqlite3_prepare_v2(db, "SELECT path, row_count FROM audit_archives WHERE status = 'pending' LIMIT 1;",
+                           -1, &stmt, 0) != SQLITE_OK) {
+        fprintf(stderr, "SQL error: %s\n", sqlite3_errmsg(db));
+        return 0;
+    }
+    int ok = 1;
+    while (ok && sqlite3_step(stmt) == SQLITE_ROW) {
+        char path[1024], tmp_path[1040];
+        snprintf(path, sizeof(path), "%s", (const char*)sqlite3_column_text(stmt, 0));
+        snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+        long expected = sqlite3_column_int64(stmt, 1);
+        sqlite3_reset(stmt);
+        unlink(tmp_path);
+        if (count_archive_rows(path) == expected) {
+            ok = set_archive_status(path, "complete");
+            fprintf(stderr, "Archive %s was written before an interruption; cataloged it\n", path);
+        } else {
+            unlink(path);
+            ok = set_archive_status(path, NULL);
+            fprintf(stderr, "Archive %s was interrupted; its month will be archived again\n", path);
+        }
+    }
+    sqlite3_finalize(stmt);
+
+    DIR *d = opendir(dir);
+    if (!ok || !d) {
+        if (d) closedir(d);
+        return ok;
+    }
+    ok = sqlite3_prepare_v2(db, "SELECT 1 FROM audit_archives WHERE path = ?;", -1, &stmt, 0) == SQLITE_OK;
+    struct dirent *entry;
+    while (ok && (entry = readdir(d))) {
+        size_t len = strlen(entry->d_name);
+        if (strncmp(entry->d_name, "audit-", 6) != 0) continue;
+        char path[1024];
+        snprintf(path, sizeof(path), "%s/%s", dir, entry->d_name);
+        if (len > 4 && strcmp(entry->d_name + len - 4, ".tmp") == 0) {
+            unlink(path);
+            continue;
+        }
+        sqlite3_bind_text(stmt, 1, path, -1, SQLITE_STATIC);
+        if (sqlite3_step(stmt) != SQLITE_ROW) {
+            fprintf(stderr, "Archive %s is not in the catalog; its entries may still be in the database\n", path);
+        }
+        sqlite3_reset(stmt);
+    }
+    sqlite3_finalize(stmt);
+    closedir(d);
+    return ok;
+}
+
+int archive_audit_logs(const char *dir, int keep_months) {
+    // WAL lets officers keep writing while a month is being exported
+    if (!exec_sql("PRAGMA journal_mode=WAL;") || !reconcile_audit_archives(dir)) {
+        return 0;
+    }
+    time_t now = time(NULL);
+    struct tm today;
+    gmtime_r(&now, &today);
+    time_t cutoff = utc_month_start(today.tm_year + 1900, today.tm_mon - keep_months);
+
+    time_t oldest = 0;
+    sqlite3_stmt *stmt;
+    if (sqlite3_prepare_v2(db, "SELECT MIN(timestamp) FROM audit_logs;", -1, &stmt, 0) == SQLITE_OK) {
+        if (sqlite3_step(stmt) == SQLITE_ROW && sqlite3_column_type(stmt, 0) != SQLITE_NULL) {
+            oldest = (time_t)sqlite3_column_int64(stmt, 0);
+        }
+        sqlite3_finalize(stmt);
+    }
+    if (!oldest || oldest >= cutoff) {
+        fprintf(stderr, "Nothing older than %d months to archive\n", keep_months);
+        return 1;
+    }
+
+    struct tm first;
+    gmtime_r(&oldest, &first);
+    long long start_ns = now_ns();
+    long total_rows = 0;
+    int months = 0;
+    for (int m = first.tm_mon; ; m++) {
+        int year = first.tm_year + 1900;
+        time_t start = utc_month_start(year, m), end = utc_month_start(year, m + 1);
+        if (start >= cutoff) break;
+        struct tm month_tm;
+        gmtime_r(&start, &month_tm);
+        char month[8], path[1024], tmp_path[1040];
+        strftime(month, sizeof(month), "%Y-%m", &month_tm);
+        snprintf(path, sizeof(path), "%s/audit-%s-%lld.tsv.gz", dir, month, (long long)now);
+        snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+
+        if (!purge_cataloged_rows(month, start, end)) {
+            return 0;
+        }
+        long long first_id, last_id;
+        long rows = export_audit_month(tmp_path, start, end, &first_id, &last_id);
+        if (rows < 0) {
+            unlink(tmp_path);
+            return 0;
+        }
+        if (rows == 0) {
+            unlink(tmp_path);
+            continue;
+        }
+        // Cataloged before the rename, so no file takes its name without an entry
+        sqlite3_stmt *insert;
+        int ok = sqlite3_prepare_v2(db, "INSERT INTO audit_archives (path, month, row_count, first_id, last_id, "
+                                        "archived_at, status) VALUES (?,?,?,?,?,?,'pending');", -1, &insert, 0) == SQLITE_OK;
+        if (ok) {
+            sqlite3_bind_text(insert, 1, path, -1, SQLITE_STATIC);
+            sqlite3_bind_text(insert, 2, month, -1, SQLITE_STATIC);
+            sqlite3_bind_int64(insert, 3, rows);
+            sqlite3_bind_int64(insert, 4, first_id);
+            sqlite3_bind_int64(insert, 5, last_id);
+            sqlite3_bind_int64(insert, 6, (sqlite3_int64)now);
+            ok = sqlite3_step(insert) == SQLITE_DONE;
+            sqlite3_finalize(insert);
+        }
+        if (!ok) {
+            fprintf(stderr, "Archive of %s not cataloged: %s\n", month, sqlite3_errmsg(db));
+            unlink(tmp_path);
+            return 0;
+        }
+        if (rename(tmp_path, path) != 0) {
+            perror(path);
+            unlink(tmp_path);
+            set_archive_status(path, NULL);
+            return 0;
+        }
+        if (!set_archive_status(path, "complete") || delete_archived_rows(start, end, first_id, last_id) < 0) {
+            fprintf(stderr, "Archive of %s incomplete: %s\n", month, sqlite3_errmsg(db));
+            return 0;
+        }
+        fprintf(stderr, "Archived %ld audit entries from %s to %s\n", rows, month, path);
+        total_rows += rows;
+        months++;
+    }
+    double elapsed = (now_ns() - start_ns) / 1e9;
+    fprintf(stderr, "Archived %ld entries from %d months in %.2fs\n", total_rows, months, elapsed);
+    return 1;
+}
+
+// ================== ONLINE BACKUP ==================
+// Snapshots are copied with SQLite's backup API from a separate read-only
+// connection. It holds one read transaction for the whole copy, so the snapshot is
+// a single point in time and, in WAL mode, officers keep writing meanwhile. Pages
+// are copied a bounded step at a time with a pause between steps so the copy never
+// hogs the CPU or the disk, and the copy is synced as it goes: left to one fsync at
+// the end, hundreds of MB of dirty pages stall the officers' own commits. Each copy
+// is checked with PRAGMA integrity_check before it takes its name in the rotation;
+// the NID sequence sidecar is saved next to it. A sharded database is copied file
+// by file inside the same read transaction, and the copies are checked in parallel.
+#define BACKUP_PAGES_PER_STEP 256
+#define BACKUP_STEP_PAUSE_MS 10
+#define BACKUP_SYNC_EVERY 4         // steps between syncs of the copy
+#define BACKUP_KEEP 7
+#define BACKUP_PREFIX "nid-snapshot-"
+#define BACKUP_MAX_FILES 1024
+
+int backup_pages_per_step = BACKUP_PAGES_PER_STEP;
+
+// Copies everything in schema of src to a new file at path, step by step
+int copy_database(sqlite3 *src, const char *schema, const char *path, long *pages) {
+    sqlite3 *dst;
+    if (sqlite3_open_v2(path, &dst, SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE, NULL) != SQLITE_OK) {
+        fprintf(stderr, "Backup: cannot create %s: %s\n", path, sqlite3_errmsg(dst));
+        sqlite3_close(dst);
+        return 0;
+    }
+    sqlite3_backup *backup = sqlite3_backup_init(dst, "main", src, schema);
+    int rc = backup ? SQLITE_OK : sqlite3_errcode(dst);
+    int sync_fd = open(path, O_RDWR), steps = 0;
+    while (rc == SQLITE_OK || rc == SQLITE_BUSY || rc == SQLITE_LOCKED) {
+        rc = sqlite3_backup_step(backup, backup_pages_per_step);
+        if (sync_fd >= 0 && ++steps % BACKUP_SYNC_EVERY == 0) fdatasync(sync_fd);
+        if (rc != SQLITE_DONE) usleep(BACKUP_STEP_PAUSE_MS * 1000);
+    }
+    if (sync_fd >= 0) close(sync_fd);
+    *pages = backup ? sqlite3_backup_pagecount(backup) : 0;
+    sqlite3_backup_finish(backup);
+    if (rc != SQLITE_DONE) {
+        fprintf(stderr, "Backup: copying to %s failed: %s\n", path, sqlite3_errstr(rc));
+        sqlite3_close(dst);
+        return 0;
+    }
+    // A snapshot is one self-contained file
+    int ok = sqlite3_exec(dst, "PRAGMA journal_mode=DELETE;", 0, 0, 0) == SQLITE_OK;
+    sqlite3_close(dst);
+    return ok;
+}
+
+// Runs PRAGMA integrity_check on a copy; it is only kept if this passes
+int verify_database(const char *path) {
+    sqlite3 *copy;
+    sqlite3_stmt *stmt;
+    int ok = sqlite3_open_v2(path, &copy, SQLITE_OPEN_READONLY, NULL) == SQLITE_OK &&
+             sqlite3_prepare_v2(copy, "PRAGMA integrity_check;", -1, &stmt, 0) == SQLITE_OK;
+    if (ok) {
+        while (sqlite3_step(stmt) == SQLITE_ROW) {
+            const char *line = (const char*)sqlite3_column_text(stmt, 0);
+            if (line && strcmp(line, "ok") != 0) {
+                fprintf(stderr, "Backup: integrity check of %s: %s\n", path, line);
+                ok = 0;
+            }
+        }
+        sqlite3_finalize(stmt);
+    } else {
+        fprintf(stderr, "Backup: cannot check %s: %s\n", path, sqlite3_errmsg(copy));
+    }
+    sqlite3_close(copy);
+    return ok;
+}
+
+int compare_names(const void *a, const void *b) {
+    return strcmp(*(char* const*)a, *(char* const*)b);
+}
+
+int is_snapshot_name(const char *name) {
+    size_t len = strlen(name);
+    return len > 3 && strcmp(name + len - 3, ".db") == 0;
+}
+
+// Deletes all but the newest keep snapshots in dir, with their sidecar files
+// (.nidseq, .shard-*), whose names start with the snapshot's
+void rotate_backups(const char *dir, int keep) {
+    DIR *d = opendir(dir);
+    if (!d) {
+        return;
+    }
+    char *names[BACKUP_MAX_FILES];
+    int count = 0, snapshots = 0;
+    struct dirent *entry;
+    while ((entry = readdir(d)) && count < BACKUP_MAX_FILES) {
+        if (strncmp(entry->d_name, BACKUP_PREFIX, strlen(BACKUP_PREFIX)) == 0) {
+            names[count++] = strdup(entry->d_name);
+            snapshots += is_snapshot_name(entry->d_name);
+        }
+    }
+    closedir(d);
+    qsort(names, count, sizeof(char*), compare_names);     // timestamped names sort oldest first
+    const char *doomed = NULL;
+    for (int i = 0, seen = 0; i < count; i++) {
+        if (is_snapshot_name(names[i])) {
+            doomed = seen++ < snapshots - keep ? names[i] : NULL;
+        }
+        if (doomed && strncmp(names[i], doomed, strlen(doomed)) == 0) {
+            char path[1024];
+            snprintf(path, sizeof(path), "%s/%s", dir, names[i]);
+            unlink(path);
+        }
+    }
+    for (int i = 0; i < count; i++) free(names[i]);
+}
+
+typedef struct {
+    const char *schema;
+    char path[1100];
+    char tmp[1110];
+    long pages;
+    int ok;
+} BackupFile;
+
+void *verify_thread(void *arg) {
+    BackupFile *file = arg;
+    file->ok = verify_database(file->tmp);
+    return NULL;
+}
+
+// Takes one verified snapshot of the database into dir and keeps the newest keep.
+// Runs on its own connections, so any thread may call it.
+int backup_database(const char *dir, int keep) {
+    long long started = now_ns();
+    time_t now = time(NULL);
+    struct tm tm;
+    char stamp[32], path[1024];
+    gmtime_r(&now, &tm);
+    strftime(stamp, sizeof(stamp), "%Y%m%dT%H%M%SZ", &tm);
+    snprintf(path, sizeof(path), "%s/" BACKUP_PREFIX "%s.db", dir, stamp);
+    if (mkdir(dir, 0700) != 0 && errno != EEXIST) {
+        perror(dir);
+        return 0;
+    }
+
+    // The main file and each shard; shard copies are named like the live shards
+    BackupFile files[DB_MAX_SHARDS + 1] = {0};
+    int file_count = db_shards + 1;
+    char begin[1024] = "BEGIN; SELECT COUNT(*) FROM main.sqlite_master;";
+    for (int i = 0; i < file_count; i++) {
+        BackupFile *file = &files[i];
+        file->schema = i ? shard_schemas[i - 1] : "main";
+        if (i) {
+            snprintf(file->path, sizeof(file->path), "%s.shard-%d-of-%d", path, i - 1, db_shards);
+            snprintf(begin + strlen(begin), sizeof(begin) - strlen(begin), " SELECT COUNT(*) FROM %s.sqlite_master;",
+                     file->schema);
+        } else {
+            snprintf(file->path, sizeof(file->path), "%s", path);
+        }
+        snprintf(file->tmp, sizeof(file->tmp), "%s.tmp", file->path);
+    }
+
+    sqlite3 *src;
+    if (sqlite3_open_v2(DB_NAME, &src, SQLITE_OPEN_READONLY | SQLITE_OPEN_NOMUTEX, NULL) != SQLITE_OK) {
+        fprintf(stderr, "Backup: cannot open database: %s\n", sqlite3_errmsg(src));
+        sqlite3_close(src);
+        return 0;
+    }
+    sqlite3_busy_handler(src, busy_wait, NULL);
+    // Each file's read snapshot starts when it is first read. With shards, a second
+    // connection holds the write lock on every file until all of them have started,
+    // so no commit can land in one snapshot and not another; writers wait only that long.
+    sqlite3 *lock = NULL;
+    int ok = attach_shards(src);
+    if (ok && db_shards) {
+        ok = sqlite3_open_v2(DB_NAME, &lock, SQLITE_OPEN_READWRITE | SQLITE_OPEN_NOMUTEX, NULL) == SQLITE_OK;
+        if (ok) sqlite3_busy_handler(lock, busy_wait, NULL);
+        ok = ok && attach_shards(lock) && sqlite3_exec(lock, "BEGIN IMMEDIATE;", 0, 0, 0) == SQLITE_OK;
+        if (!ok) fprintf(stderr, "Backup: cannot lock the database: %s\n", sqlite3_errmsg(lock ? lock : src));
+    }
+    ok = ok && sqlite3_exec(src, begin, 0, 0, 0) == SQLITE_OK;
+    if (lock) {
+        sqlite3_exec(lock, "ROLLBACK;", 0, 0, 0);
+        sqlite3_close(lock);
+    }
+    long pages = 0;
+    for (int i = 0; ok && i < file_count; i++) {
+        ok = copy_database(src, files[i].schema, files[i].tmp, &files[i].pages);
+        pages += files[i].pages;
+    }
+    sqlite3_exec(src, "COMMIT;", 0, 0, 0);
+    double copy_seconds = (now_ns() - started) / 1e9;
+    int page_size = 0;
+    sqlite3_stmt *stmt;
+    if (sqlite3_prepare_v2(src, "PRAGMA page_size;", -1, &stmt, 0) == SQLITE_OK) {
+        if (sqlite3_step(stmt) == SQLITE_ROW) page_size = sqlite3_column_int(stmt, 0);
+        sqlite3_finalize(stmt);
+    }
+    sqlite3_close(src);
+
+    // The sequence is tiny; a copy taken after the snapshot never hands out a NID
+    // the snapshot could already hold
+    if (ok) {
+        char seq_tmp[1130];
+        long seq_pages;
+        snprintf(seq_tmp, sizeof(seq_tmp), "%s.nidseq", files[0].tmp);
+        pthread_mutex_lock(&nid_refill_lock);
+        ok = copy_database(nid_db, "main", seq_tmp, &seq_pages);
+        pthread_mutex_unlock(&nid_refill_lock);
+        ok = ok && verify_database(seq_tmp);
+        if (ok) {
+            char seq_path[1060];
+            snprintf(seq_path, sizeof(seq_path), "%s.nidseq", path);
+            ok = rename(seq_tmp, seq_path) == 0;
+        } else {
+            unlink(seq_tmp);
+        }
+    }
+    long long verify_started = now_ns();
+    pthread_t threads[DB_MAX_SHARDS + 1];
+    int started_threads[DB_MAX_SHARDS + 1] = {0};
+    for (int i = 0; ok && i < file_count; i++) {
+        started_threads[i] = pthread_create(&threads[i], NULL, verify_thread, &files[i]) == 0;
+        if (!started_threads[i]) verify_thread(&files[i]);
+    }
+    for (int i = 0; i < file_count; i++) {
+        if (started_threads[i]) pthread_join(threads[i], NULL);
+        ok = ok && files[i].ok;
+    }
+    // The main file goes last: a snapshot is only listed once it is complete
+    for (int i = file_count - 1; ok && i >= 0; i--) {
+        if (rename(files[i].tmp, files[i].path) != 0) {
+            perror(files[i].path);
+            ok = 0;
+        }
+    }
+    if (!ok) {
+        for (int i = 0; i < file_count; i++) {
+            unlink(files[i].tmp);
+            if (i) unlink(files[i].path);
+        }
+        return 0;
+    }
+
+    fprintf(stderr, "Backup: %s, %ld pages (%.1f MB) copied in %.2fs (%.0f pages/sec), integrity ok in %.2fs\n",
+            path, pages, pages * (double)page_size / (1024 * 1024), copy_seconds,
+            copy_seconds > 0 ? pages / copy_seconds : 0.0, (now_ns() - verify_started) / 1e9);
+    if (db_shards) fprintf(stderr, "Backup: %d shard files saved alongside\n", db_shards);
+    rotate_backups(dir, keep);
+    return 1;
+}
+
+// Server-side schedule: a snapshot every interval until the server stops
+typedef struct {
+    const char *dir;
+    int keep;
+    int interval_s;
+    int stopping;
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+} BackupSchedule;
+
+BackupSchedule backup_schedule = {NULL, BACKUP_KEEP, 0, 0, PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER};
+
+void *backup_thread(void *arg) {
+    (void)arg;
+    pthread_mutex_lock(&backup_schedule.lock);
+    while (!backup_schedule.stopping) {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += backup_schedule.interval_s;
+        while (!backup_schedule.stopping &&
+               pthread_cond_timedwait(&backup_schedule.wake, &backup_schedule.lock, &deadline) != ETIMEDOUT);
+        if (backup_schedule.stopping) break;
+        pthread_mutex_unlock(&backup_schedule.lock);
+        backup_database(backup_schedule.dir, backup_schedule.keep);
+        pthread_mutex_lock(&backup_schedule.lock);
+    }
+    pthread_mutex_unlock(&backup_schedule.lock);
+    return NULL;
+}
+
+// ================== TOMBSTONE PURGE ==================
+// A deleted citizen stays as a tombstone (deleted_at set) for the retention period,
+// left out of every lookup, then purge_tombstones() removes it for good. Tombstones
+// are found through a partial index and removed a small batch per transaction, so
+// officers' writes wait milliseconds at most. Files created since tombstones were
+// introduced use auto_vacuum=INCREMENTAL: the pages a purge frees go back to the file
+// system a bounded step at a time with PRAGMA incremental_vacuum, pausing between
+// steps, instead of in one stop-the-world VACUUM. An older file is switched over by
+// one full VACUUM the first time --purge runs. The server purges on a schedule. Each
+// purge also expires old change feed entries (expire_changes()).
+#define PURGE_RETENTION_DAYS 30
+#define PURGE_BATCH 500
+#define PURGE_INTERVAL_S 3600
+#define VACUUM_PAGES_PER_STEP 128
+#define VACUUM_STEP_PAUSE_MS 10
+
+typedef struct {
+    int retention_days;
+    int interval_s;
+    int stopping;
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+} PurgeSchedule;
+
+PurgeSchedule purge_schedule = {PURGE_RETENTION_DAYS, PURGE_INTERVAL_S, 0, PTHREAD_MUTEX_INITIALIZER,
+                                PTHREAD_COND_INITIALIZER};
+
+// Value of a numeric pragma of schema, or -1
+long pragma_value(const char *schema, const char *pragma) {
+    char sql[128];
+    sqlite3_stmt *stmt;
+    long value = -1;
+    snprintf(sql, sizeof(sql), "PRAGMA %s.%s;", schema, pragma);
+    if (sqlite3_prepare_v2(db, sql, -1, &stmt, 0) == SQLITE_OK) {
+        if (sqlite3_step(stmt) == SQLITE_ROW) value = sqlite3_column_int64(stmt, 0);
+        sqlite3_finalize(stmt);
+    }
+    return value;
+}
+
+// Deletes the tombstones in schema older than cutoff. Returns how many, or -1.
+long purge_schema(const char *schema, time_t cutoff) {
+    char sql[256];
+    sqlite3_stmt *stmt;
+    snprintf(sql, sizeof(sql), "DELETE FROM %s.citizens WHERE nid IN "
+                               "(SELECT nid FROM %s.citizens WHERE deleted_at < ?1 LIMIT ?2);", schema, schema);
+    if (sqlite3_prepare_v2(db, sql, -1, &stmt, 0) != SQLITE_OK) {
+        fprintf(stderr, "Purge: %s\n", sqlite3_errmsg(db));
+        return -1;
+    }
+    long purged = 0;
+    int batch;
+    do {
+        batch = -1;
+        if (sqlite3_exec(db, "BEGIN IMMEDIATE;", 0, 0, 0) == SQLITE_OK) {
+            sqlite3_bind_int64(stmt, 1, (sqlite3_int64)cutoff);
+            sqlite3_bind_int(stmt, 2, PURGE_BATCH);
+            if (sqlite3_step(stmt) == SQLITE_DONE) batch = sqlite3_changes(db);
+            sqlite3_reset(stmt);
+        }
+        if (batch < 0 || sqlite3_exec(db, "COMMIT;", 0, 0, 0) != SQLITE_OK) {
+            fprintf(stderr, "Purge: removing tombstones from %s failed: %s\n", schema, sqlite3_errmsg(db));
+            sqlite3_exec(db, "ROLLBACK;", 0, 0, 0);
+            batch = -1;
+            break;
+        }
+        purged += batch;
+    } while (batch == PURGE_BATCH);
+    sqlite3_finalize(stmt);
+    return batch < 0 ? -1 : purged;
+}
+
+// Hands schema's free pages back a step at a time. Returns the pages returned, or -1.
+long vacuum_schema(const char *schema, int *steps, long long *longest_ns) {
+    char sql[96];
+    long before = pragma_value(schema, "freelist_count"), left = before;
+    snprintf(sql, sizeof(sql), "PRAGMA %s.incremental_vacuum(%d);", schema, VACUUM_PAGES_PER_STEP);
+    while (left > 0) {
+        long long started = now_ns();
+        if (sqlite3_exec(db, sql, 0, 0, 0) != SQLITE_OK) {
+            fprintf(stderr, "Purge: vacuuming %s failed: %s\n", schema, sqlite3_errmsg(db));
+            return -1;
+        }
+        long long took = now_ns() - started;
+        if (took > *longest_ns) *longest_ns = took;
+        (*steps)++;
+        long now_left = pragma_value(schema, "freelist_count");
+        if (now_left < 0 || now_left >= left) break;     // nothing more it can give back
+        left = now_left;
+        if (left > 0) usleep(VACUUM_STEP_PAUSE_MS * 1000);
+    }
+    return before > left ? before - left : 0;
+}
+
+// Removes tombstones older than retention_days and returns the space. With convert,
+// a file not yet in incremental auto-vacuum mode is switched over by a full VACUUM,
+// which holds the write lock while it runs; otherwise such files are left as they are.
+int purge_tombstones(int retention_days, int convert) {
+    long long started = now_ns();
+    time_t cutoff = time(NULL) - (time_t)retention_days * 86400;
+    long purged = 0, pages = 0;
+    int steps = 0, ok = 1;
+    long long longest_ns = 0;
+    for (int i = 0; ok && i < (db_shards ? db_shards : 1); i++) {
+        long n = purge_schema(citizen_schema(i), cutoff);
+        ok = n >= 0;
+        purged += ok ? n : 0;
+    }
+    long expired = ok ? expire_changes(CHANGES_RETENTION_DAYS) : 0;
+    ok = ok && expired >= 0;
+    for (int i = -1; ok && i < db_shards; i++) {
+        const char *schema = i < 0 ? "main" : shard_schemas[i];
+        if (pragma_value(schema, "auto_vacuum") != 2) {
+            if (!convert) continue;
+            char sql[96];
+            long long convert_started = now_ns();
+            snprintf(sql, sizeof(sql), "PRAGMA %s.auto_vacuum = INCREMENTAL; VACUUM %s;", schema, schema);
+            if (sqlite3_exec(db, sql, 0, 0, 0) != SQLITE_OK) {
+                fprintf(stderr, "Purge: converting %s to incremental vacuum failed: %s\n", schema, sqlite3_errmsg(db));
+                ok = 0;
+                break;
+            }
+            fprintf(stderr, "Purge: switched %s to incremental auto-vacuum (one-time VACUUM, %.2fs)\n",
+                    schema, (now_ns() - convert_started) / 1e9);
+        }
+        long n = vacuum_schema(schema, &steps, &longest_ns);
+        ok = n >= 0;
+        pages += ok ? n : 0;
+    }
+    if (ok) {
+        fprintf(stderr, "Purge: removed %ld tombstones older than %d days and %ld change feed entries older than "
+                        "%d days, returned %ld free pages in %d steps (longest %.1f ms) in %.2fs\n", purged,
+                retention_days, expired, CHANGES_RETENTION_DAYS, pages, steps, longest_ns / 1e6,
+                (now_ns() - started) / 1e9);
+    }
+    return ok;
+}
+
+void *purge_thread(void *arg) {
+    (void)arg;
+    if (!open_thread_connection(SQLITE_OPEN_READWRITE)) {
+        return NULL;
+    }
+    pthread_mutex_lock(&purge_schedule.lock);
+    while (!purge_schedule.stopping) {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += purge_schedule.interval_s;
+        while (!purge_schedule.stopping &&
+               pthread_cond_timedwait(&purge_schedule.wake, &purge_schedule.lock, &deadline) != ETIMEDOUT);
+        if (purge_schedule.stopping) break;
+        pthread_mutex_unlock(&purge_schedule.lock);
+        purge_tombstones(purge_schedule.retention_days, 0);
+        pthread_mutex_lock(&purge_schedule.lock);
+    }
+    pthread_mutex_unlock(&purge_schedule.lock);
+    close_connection();
+    return NULL;
+}
+
+// ================== REQUEST SERVER ==================
+// Frames are a 4-byte big-endian length followed by a tab-separated request:
+//   REGISTER <name> <dob> <gender> <address> <father_name> <mother_name> <blood_group>
+//                                   replies "OK\t<nid>", plus "\tduplicate_of=<nid>" when flagged for review
+//   SEARCH <nid>
+//   UPDATE <nid> <name> <dob> <gender> <address> <father_name> <mother_name> <blood_group> <is_active>
+//   PATCH <nid> <column>=<value> ...   writes only those columns, e.g. is_active=0
+//   STATUS <0|1> <nid> [<nid> ...]  sets is_active on up to 1000 citizens, replies "OK\t<changed>"
+//   DELETE <nid>
+//   AUDIT [nid=..] [activity=..] [from=<epoch>] [to=<epoch>] [before=<cursor>] [limit=N]
+//   QUERY [name=<prefix>] [dob=..] [dob_from=..] [dob_to=..]
+//         [age_min=N] [age_max=N] [father=..] [mother=..] [blood=..] [address=..] [text=..] [after=<nid>] [limit=N]
+//   STATS [gender=..] [blood=..] [decade=<year>] [active=0|1]
+//                                   head counts in total and by each column, one "<column>\t<value>\t<count>"
+//                                   line each, for the citizens matching the filters
+//   CHANGES <since> [limit=N]       the change feed after number since, oldest first: replies
+//                                   "OK\t<last>\t<more>", then one "<seq>\t<insert|update>\t<citizen
+//                                   fields>" or "<seq>\tdelete\t<nid>" line per change; read on from last
+//   ACK <consumer> <seq>            consumer has applied changes up to seq; replies "OK\t<n>",
+//                                   changes up to n having been compacted
+//   METRICS [json]                  Prometheus text exposition, or JSON
+//   LOGIN <username> <password>     replies "OK\t<token>" and binds the session to the connection
+//   SESSION <token>                 binds a token from an earlier LOGIN to the connection
+// Replies are "OK[\t...]" or "ERR\t<message>". The main thread polls every open
+// connection and hands each request that arrives to a pool of reader threads with
+// their own database connections, so an idle client holds no thread; writes are
+// group-committed by one writer.
+// Everything but METRICS needs a session, since lookups return citizens' details
+// (decrypted when NID_DATA_KEY is set).
+#define SERVER_MAX_FRAME 65536
+#define STATUS_MAX_NIDS 1000
+#define SERVER_MAX_FIELDS (STATUS_MAX_NIDS + 2)
+#define SERVER_POLL_MS 500
+#define SERVER_IO_TIMEOUT_S 10
+
+typedef struct WriteJob {
+    char *payload;
+    Buffer response;
+    int done;
+    struct WriteJob *next;
+} WriteJob;
+
+struct {
+    pthread_mutex_t lock;
+    pthread_cond_t ready;
+    pthread_cond_t finished;
+    WriteJob *head;
+    WriteJob *tail;
+    int stopping;
+} write_queue = {.lock = PTHREAD_MUTEX_INITIALIZER, .ready = PTHREAD_COND_INITIALIZER, .finished = PTHREAD_COND_INITIALIZER};
+
+// One open connection. busy is set while a reader serves its request, and closed
+// once it has gone; the dispatcher then closes the fd, so a reused fd number never
+// reaches a reader still holding the old client.
+typedef struct Client {
+    int fd;
+    char session[SESSION_TOKEN_LEN];
+    int busy;
+    int closed;
+    struct Client *next;
+} Client;
+
+struct {
+    pthread_mutex_t lock;
+    pthread_cond_t ready;
+    Client *head;
+    Client *tail;
+    int wake_fd;            // readers write a byte here when a client is free to poll again
+    int stopping;
+} client_queue = {.lock = PTHREAD_MUTEX_INITIALIZER, .ready = PTHREAD_COND_INITIALIZER, .wake_fd = -1};
+
+volatile sig_atomic_t server_stop = 0;
+
+void on_server_signal(int sig) {
+    (void)sig;
+    server_stop = 1;
+}
+
+int is_write_request(const char *payload) {
+    return strncmp(payload, "REGISTER\t", 9) == 0 || strncmp(payload, "UPDATE\t", 7) == 0 ||
+           strncmp(payload, "PATCH\t", 6) == 0 || strncmp(payload, "STATUS\t", 7) == 0 ||
+           strncmp(payload, "DELETE\t", 7) == 0 || strncmp(payload, "ACK\t", 4) == 0;
+}
+
+int is_privileged_request(const char *payload) {
+    return strcmp(payload, "METRICS") != 0 && strncmp(payload, "METRICS\t", 8) != 0;
+}
+
+void enqueue_write(WriteJob *job) {
+    pthread_mutex_lock(&write_queue.lock);
+    job->next = NULL;
+    if (write_queue.tail) write_queue.tail->next = job;
+    else write_queue.head = job;
+    write_queue.tail = job;
+    pthread_cond_signal(&write_queue.ready);
+    pthread_mutex_unlock(&write_queue.lock);
+}
+
+void submit_write(char *payload, Buffer *response) {
+    WriteJob job = {0};
+    job.payload = payload;
+    enqueue_write(&job);
+    pthread_mutex_lock(&write_queue.lock);
+    while (!job.done) {
+        pthread_cond_wait(&write_queue.finished, &write_queue.lock);
+    }
+    pthread_mutex_unlock(&write_queue.lock);
+    *response = job.response;
+}
+
+void append_citizen_fields(Buffer *out, const Citizen *c) {
+    buf_printf(out, "%s\t%s\t%s\t%s\t%s\t%s\t%s\t%s\t%d\t%lld\t%lld",
+               c->nid, c->name, c->dob, c->gender, c->address, c->father_name,
+               c->mother_name, c->blood_group, c->is_active,
+               (long long)c->created_at, (long long)c->last_modified);
+}
+
+void append_audit_row(sqlite3_stmt *stmt, void *ctx) {
+    const char *details = (const char*)sqlite3_column_text(stmt, 4);
+    buf_printf(ctx, "\n%s\t%lld\t%s\t%s", (const char*)sqlite3_column_text(stmt, 1),
+               (long long)sqlite3_column_int64(stmt, 2), (const char*)sqlite3_column_text(stmt, 3),
+               details ? details : "");
+}
+
+void append_query_row(const Citizen *c, void *ctx) {
+    buf_printf(ctx, "\n");
+    append_citizen_fields(ctx, c);
+}
+
+// Runs one request on the calling thread's connection. Returns 0 if it failed
+// so the writer can roll back its savepoint.
+int handle_request(char *payload, Buffer *out) {
+    char *fields[SERVER_MAX_FIELDS];
+    int count = split_import_line(payload, '\t', fields, SERVER_MAX_FIELDS);
+    const char *cmd = fields[0];
+    const char *reason = NULL;
+    Citizen c;
+
+    if (strcmp(cmd, "REGISTER") == 0 && count == 8) {
+        if (!parse_import_row(fields + 1, &c, &reason)) {
+            buf_printf(out, "ERR\tinvalid %s", reason);
+            return 0;
+        }
+        DuplicateMatch match;
+        if (!register_citizen(&c, &match)) {
+            buf_printf(out, "ERR\t%s", sqlite3_errmsg(db));
+            return 0;
+        }
+        if (!audit_log(c.nid, "REGISTERED")) {
+            buf_printf(out, "ERR\taudit log failed");
+            return 0;
+        }
+        buf_printf(out, "OK\t%s", c.nid);
+        if (match.count > 0) buf_printf(out, "\tduplicate_of=%s", match.nid);
+        return 1;
+    }
+    if (strcmp(cmd, "SEARCH") == 0 && count == 2) {
+        if (!find_citizen(fields[1], &c)) {
+            buf_printf(out, "ERR\tnot found");
+            return 0;
+        }
+        buf_printf(out, "OK\t");
+        append_citizen_fields(out, &c);
+        audit_log(c.nid, "SEARCHED");
+        return 1;
+    }
+    if ((strcmp(cmd, "UPDATE") == 0 && count == 10) || (strcmp(cmd, "PATCH") == 0 && count >= 3 && count <= 10)) {
+        int mask = FIELD_ALL;
+        if (cmd[0] == 'U') {
+            if (!parse_import_row(fields + 2, &c, &reason)) {
+                buf_printf(out, "ERR\tinvalid %s", reason);
+                return 0;
+            }
+            c.is_active = atoi(fields[9]) ? 1 : 0;
+        } else {
+            mask = 0;
+            for (int i = 2; i < count; i++) {
+                char *value = strchr(fields[i], '=');
+                int field = 0;
+                if (value) {
+                    *value++ = '\0';
+                    for (int f = 0; f < UPDATE_FIELDS; f++) {
+                        if (strcmp(fields[i], citizen_fields[f].column) == 0) field = 1 << f;
+                    }
+                }
+                if (!field || !set_citizen_field(&c, field, value)) {
+                    buf_printf(out, "ERR\tinvalid %s", fields[i]);
+                    return 0;
+                }
+                mask |= field;
+            }
+        }
+        c.last_modified = time(NULL);
+        int rc = update_citizen_fields(fields[1], &c, mask);
+        if (rc <= 0) {
+            buf_printf(out, "ERR\t%s", rc == 0 ? "not found" : sqlite3_errmsg(db));
+            return 0;
+        }
+        char changed[AUDIT_DETAILS_LEN], nid[20];
+        describe_fields(mask, changed, sizeof(changed));
+        canonical_nid(fields[1], nid);
+        if (!audit_log_details(nid, "UPDATED", changed)) {
+            buf_printf(out, "ERR\taudit log failed");
+            return 0;
+        }
+        buf_printf(out, "OK\t%s", fields[1]);
+        return 1;
+    }
+    if (strcmp(cmd, "STATUS") == 0 && count >= 3 && count <= SERVER_MAX_FIELDS &&
+        (strcmp(fields[1], "0") == 0 || strcmp(fields[1], "1") == 0)) {
+        int changed = set_citizens_active(fields + 2, count - 2, fields[1][0] == '1');
+        if (changed < 0) {
+            buf_printf(out, "ERR\t%s", sqlite3_errmsg(db));
+            return 0;
+        }
+        buf_printf(out, "OK\t%d", changed);
+        return 1;
+    }
+    if (strcmp(cmd, "DELETE") == 0 && count == 2) {
+        int rc = delete_citizen(fields[1]);
+        if (rc <= 0) {
+            buf_printf(out, "ERR\t%s", rc == 0 ? "not found" : sqlite3_errmsg(db));
+            return 0;
+        }
+        char nid[20];
+        canonical_nid(fields[1], nid);
+        if (!audit_log(nid, "DELETED")) {
+            buf_printf(out, "ERR\taudit log failed");
+            return 0;
+        }
+        buf_printf(out, "OK\t%s", fields[1]);
+        return 1;
+    }
+    if (strcmp(cmd, "ACK") == 0 && count == 3) {
+        char *end;
+        sqlite3_int64 seq = strtoll(fields[2], &end, 10);
+        sqlite3_int64 compacted = *end || seq < 0 ? -2 : ack_changes(fields[1], seq);
+        if (compacted < 0) {
+            buf_printf(out, "ERR\t%s", compacted == -2 ? "invalid seq" : sqlite3_errmsg(db));
+            return 0;
+        }
+        buf_printf(out, "OK\t%lld", (long long)compacted);
+        return 1;
+    }
+    if (strcmp(cmd, "METRICS") == 0 && count <= 2) {
+        buf_printf(out, "OK\n");
+        if (count == 2 && strcmp(fields[1], "json") == 0) append_metrics_json(out);
+        else append_metrics_prometheus(out);
+        return 1;
+    }
+
+    if (strcmp(cmd, "AUDIT") == 0) {
+        AuditQuery q = {0};
+        char nid[20];
+        for (int i = 1; i < count && i < SERVER_MAX_FIELDS; i++) {
+            char *value = strchr(fields[i], '=');
+            if (!value) continue;
+            *value++ = '\0';
+            if (strcmp(fields[i], "nid") == 0) q.nid = value;
+            else if (strcmp(fields[i], "activity") == 0) q.activity = value;
+            else if (strcmp(fields[i], "from") == 0) q.from = (time_t)atoll(value);
+            else if (strcmp(fields[i], "to") == 0) q.to = (time_t)atoll(value);
+            else if (strcmp(fields[i], "before") == 0) q.before = value;
+            else if (strcmp(fields[i], "limit") == 0) q.limit = atoi(value);
+        }
+        if (has_value(q.nid)) {
+            if (!canonical_nid(q.nid, nid)) {
+                buf_printf(out, "ERR\tinvalid nid");
+                return 0;
+            }
+            q.nid = nid;
+        }
+        audit_flush();
+        char next[AUDIT_CURSOR_LEN];
+        Buffer rows = {0};
+        if (query_audit_logs(&q, append_audit_row, &rows, next) < 0) {
+            buf_free(&rows);
+            buf_printf(out, "ERR\taudit query failed");
+            return 0;
+        }
+        buf_printf(out, "OK\t%s%s", next[0] ? next : "-", rows.data ? rows.data : "");
+        buf_free(&rows);
+        return 1;
+    }
+    if (strcmp(cmd, "QUERY") == 0) {
+        CitizenQuery q = {0};
+        int age_min = -1, age_max = -1;
+        for (int i = 1; i < count && i < SERVER_MAX_FIELDS; i++) {
+            char *value = strchr(fields[i], '=');
+            if (!value) continue;
+            *value++ = '\0';
+            if (strcmp(fields[i], "name") == 0) q.name_prefix = value;
+            else if (strncmp(fields[i], "dob", 3) == 0 && value[0] && !dob_key(value)) {
+                buf_printf(out, "ERR\tinvalid %s (expected DD-MM-YYYY)", fields[i]);
+                return 0;
+            }
+            else if (strcmp(fields[i], "dob") == 0) q.dob_from = q.dob_to = dob_key(value);
+            else if (strcmp(fields[i], "dob_from") == 0) q.dob_from = dob_key(value);
+            else if (strcmp(fields[i], "dob_to") == 0) q.dob_to = dob_key(value);
+            else if (strcmp(fields[i], "age_min") == 0) age_min = atoi(value);
+            else if (strcmp(fields[i], "age_max") == 0) age_max = atoi(value);
+            else if (strcmp(fields[i], "father") == 0) q.father_name = value;
+            else if (strcmp(fields[i], "mother") == 0) q.mother_name = value;
+            else if (strcmp(fields[i], "blood") == 0) q.blood_group = value;
+            else if (strcmp(fields[i], "address") == 0) q.address = value;
+            else if (strcmp(fields[i], "text") == 0) q.text = value;
+            else if (strcmp(fields[i], "after") == 0) q.after_nid = value;
+            else if (strcmp(fields[i], "limit") == 0) q.limit = atoi(value);
+        }
+        age_to_dob_range(age_min, age_max, &q.dob_from, &q.dob_to);
+        char next[20];
+        Buffer rows = {0};
+        int found = query_citizens(&q, append_query_row, &rows, next);
+        if (found < 0) {
+            buf_free(&rows);
+            buf_printf(out, "ERR\tquery failed");
+            return 0;
+        }
+        buf_printf(out, "OK\t%s%s", next[0] ? next : "-", rows.data ? rows.data : "");
+        buf_free(&rows);
+        return 1;
+    }
+    if (strcmp(cmd, "CHANGES") == 0 && count >= 2) {
+        int limit = 0;
+        for (int i = 2; i < count; i++) {
+            if (strncmp(fields[i], "limit=", 6) == 0) limit = atoi(fields[i] + 6);
+        }
+        sqlite3_int64 last;
+        int more;
+        Buffer rows = {0};
+        int read = read_changes(strtoll(fields[1], NULL, 10), limit, SERVER_MAX_FRAME - 64, &rows, &last, &more);
+        if (read < 0) {
+            buf_free(&rows);
+            buf_printf(out, "ERR\t%s", read == -2 ? "compacted; reload from an export" : "change feed failed");
+            return 0;
+        }
+        buf_printf(out, "OK\t%lld\t%d%s", (long long)last, more, rows.data ? rows.data : "");
+        buf_free(&rows);
+        return 1;
+    }
+    if (strcmp(cmd, "STATS") == 0) {
+        StatsFilter f = {-1, -1, -1, -1};
+        for (int i = 1; i < count && i < SERVER_MAX_FIELDS; i++) {
+            char *value = strchr(fields[i], '=');
+            if (!value) continue;
+            *value++ = '\0';
+            if (set_stats_filter(&f, fields[i], value) == 0) {
+                buf_printf(out, "ERR\tinvalid %s", fields[i]);
+                return 0;
+            }
+        }
+        buf_printf(out, "OK");
+        if (!citizen_statistics(&f, out)) {
+            out->len = 0;
+            buf_printf(out, "ERR\tstatistics failed");
+            return 0;
+        }
+        return 1;
+    }
+    buf_printf(out, "ERR\tunknown command or wrong number of fields");
+    return 0;
+}
+
+void fail_write_batch(WriteJob *batch, const char *why, const char *err) {
+    for (WriteJob *job = batch; job; job = job->next) {
+        job->response.len = 0;
+        buf_printf(&job->response, err ? "ERR\t%s: %s" : "ERR\t%s", why, err);
+    }
+}
+
+// Runs the jobs in one transaction, each under a savepoint so that a failing job
+// only undoes its own changes. Without the transaction each savepoint would commit
+// on its own, so when BEGIN fails (the busy timeout ran out) no job is run. If the
+// transaction is lost or the commit fails, every response becomes the error.
+// Returns 1 if committed, 0 if rolled back and -1 if nothing was run.
+int commit_write_batch(WriteJob *batch) {
+    if (sqlite3_exec(db, "BEGIN IMMEDIATE;", 0, 0, 0) != SQLITE_OK) {
+        fail_write_batch(batch, "database busy, not run", sqlite3_errmsg(db));
+        return -1;
+    }
+    int open = 1;
+    for (WriteJob *job = batch; open && job; job = job->next) {
+        sqlite3_exec(db, "SAVEPOINT job;", 0, 0, 0);
+        int ok = handle_request(job->payload, &job->response);
+        sqlite3_exec(db, ok ? "RELEASE job;" : "ROLLBACK TO job; RELEASE job;", 0, 0, 0);
+        open = !sqlite3_get_autocommit(db);     // an I/O error can roll the whole transaction back
+    }
+    int committed = open && sqlite3_exec(db, "COMMIT;", 0, 0, 0) == SQLITE_OK;
+    if (!committed) {
+        fail_write_batch(batch, open ? "commit failed" : "transaction rolled back", open ? sqlite3_errmsg(db) : NULL);
+        if (!sqlite3_get_autocommit(db)) sqlite3_exec(db, "ROLLBACK;", 0, 0, 0);
+    }
+    cache_transaction_done();
+    return committed;
+}
+
+void *writer_thread(void *arg) {
+    (void)arg;
+    if (!open_thread_connection(SQLITE_OPEN_READWRITE)) {
+        exit(EXIT_FAILURE);
+    }
+    while (1) {
+        pthread_mutex_lock(&write_queue.lock);
+        while (!write_queue.head && !write_queue.stopping) {
+            pthread_cond_wait(&write_queue.ready, &write_queue.lock);
+        }
+        WriteJob *batch = write_queue.head;
+        write_queue.head = write_queue.tail = NULL;
+        pthread_mutex_unlock(&write_queue.lock);
+        if (!batch) {
+            break;
+        }
+
+        // One transaction for everything queued
+        commit_write_batch(batch);
+
+        pthread_mutex_lock(&write_queue.lock);
+        for (WriteJob *job = batch, *next; job; job = next) {
+            next = job->next;
+            job->done = 1;
+        }
+        pthread_cond_broadcast(&write_queue.finished);
+        pthread_mutex_unlock(&write_queue.lock);
+    }
+    close_connection();
+    return NULL;
+}
+
+int send_frame(int fd, const char *data, size_t len) {
+    uint32_t header = htonl((uint32_t)len);
+    return write_full(fd, &header, sizeof(header)) && write_full(fd, data, len);
+}
+
+// Reads one frame into a NUL-terminated malloc'd buffer
+char *recv_frame(int fd) {
+    uint32_t header;
+    if (!read_full(fd, &header, sizeof(header))) return NULL;
+    uint32_t len = ntohl(header);
+    if (len > SERVER_MAX_FRAME) return NULL;
+    char *data = malloc(len + 1);
+    if (!data || !read_full(fd, data, len)) {
+        free(data);
+        return NULL;
+    }
+    data[len] = '\0';
+    return data;
+}
+
+// LOGIN and SESSION change the connection's session instead of touching citizens
+void handle_session_request(char *payload, char *session, Buffer *out) {
+    char *fields[3];
+    int count = 0;
+    for (char *p = payload; count < 3; count++) {
+        fields[count] = p;
+        p = strchr(p, '\t');
+        if (!p) {
+            count++;
+            break;
+        }
+        *p++ = '\0';
+    }
+    if (strcmp(fields[0], "LOGIN") == 0 && count == 3) {
+        AuthJob job = {0};
+        job.username = fields[1];
+        job.password = fields[2];
+        int result = auth_submit(&job);
+        if (result == AUTH_OK) {
+            issue_session(fields[1], session);
+            buf_printf(out, "OK\t%s", session);
+        } else {
+            buf_printf(out, "ERR\t%s", result == AUTH_BUSY ? "login service busy" : "authentication failed");
+        }
+    } else if (strcmp(fields[0], "SESSION") == 0 && count == 2 && verify_session(fields[1], NULL, 0)) {
+        snprintf(session, SESSION_TOKEN_LEN, "%s", fields[1]);
+        buf_printf(out, "OK");
+    } else {
+        buf_printf(out, "ERR\tinvalid or expired session");
+    }
+}
+
+int is_session_request(const char *payload) {
+    return strncmp(payload, "LOGIN\t", 6) == 0 || strncmp(payload, "SESSION\t", 8) == 0;
+}
+
+// Reads and answers the one request waiting on the client. Returns 0 if the
+// connection is finished
+int serve_request(Client *client) {
+    char *payload = recv_frame(client->fd);
+    if (!payload) return 0;
+    Buffer response = {0};
+    if (is_session_request(payload)) {
+        handle_session_request(payload, client->session, &response);
+    } else if (is_privileged_request(payload) && !verify_session(client->session, NULL, 0)) {
+        buf_printf(&response, "ERR\tlogin required");
+    } else if (is_write_request(payload)) {
+        submit_write(payload, &response);
+    } else {
+        handle_request(payload, &response);
+    }
+    int sent = send_frame(client->fd, response.data ? response.data : "", response.len);
+    buf_free(&response);
+    free(payload);
+    return sent;
+}
+
+void *reader_thread(void *arg) {
+    (void)arg;
+    if (!open_thread_connection(SQLITE_OPEN_READONLY)) {
+        exit(EXIT_FAILURE);
+    }
+    while (1) {
+        pthread_mutex_lock(&client_queue.lock);
+        while (!client_queue.head && !client_queue.stopping) {
+            pthread_cond_wait(&client_queue.ready, &client_queue.lock);
+        }
+        Client *client = client_queue.head;
+        if (!client) {
+            pthread_mutex_unlock(&client_queue.lock);
+            break;
+        }
+        client_queue.head = client->next;
+        if (!client_queue.head) client_queue.tail = NULL;
+        pthread_mutex_unlock(&client_queue.lock);
+
+        int open = serve_request(client);
+
+        pthread_mutex_lock(&client_queue.lock);
+        client->busy = 0;
+        client->closed = !open;
+        pthread_mutex_unlock(&client_queue.lock);
+        if (write(client_queue.wake_fd, "", 1) < 0 && errno != EAGAIN) {
+            perror("Server wake-up");
+        }
+    }
+    close_connection();
+    return NULL;
+}
+
+int run_server(const char *socket_path, int workers) {
+    char *err_msg = 0;
+    if (sqlite3_exec(db, "PRAGMA journal_mode=WAL; PRAGMA synchronous=NORMAL;", 0, 0, &err_msg) != SQLITE_OK) {
+        fprintf(stderr, "SQL error: %s\n", err_msg);
+        sqlite3_free(err_msg);
+        return 0;
+    }
+
+    int listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    struct sockaddr_un addr = {0};
+    addr.sun_family = AF_UNIX;
+    if (listen_fd < 0 || strlen(socket_path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "Invalid socket path: %s\n", socket_path);
+        if (listen_fd >= 0) close(listen_fd);
+        return 0;
+    }
+    strcpy(addr.sun_path, socket_path);
+    unlink(socket_path);
+    mode_t old_mask = umask(0177);  // only the server's own user may connect
+    int bound = bind(listen_fd, (struct sockaddr*)&addr, sizeof(addr)) == 0;
+    umask(old_mask);
+    if (!bound || listen(listen_fd, SOMAXCONN) != 0) {
+        perror(socket_path);
+        close(listen_fd);
+        return 0;
+    }
+
+    struct sigaction sa = {0};
+    sa.sa_handler = on_server_signal;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    signal(SIGPIPE, SIG_IGN);
+
+    int wake[2];
+    if (pipe(wake) != 0) {
+        perror("pipe");
+        close(listen_fd);
+        return 0;
+    }
+    fcntl(wake[0], F_SETFL, O_NONBLOCK);
+    fcntl(wake[1], F_SETFL, O_NONBLOCK);
+    client_queue.wake_fd = wake[1];
+
+    pthread_t writer, backup, purge;
+    pthread_t *readers = calloc(workers, sizeof(pthread_t));
+    pthread_create(&writer, NULL, writer_thread, NULL);
+    int scheduled = backup_schedule.dir && backup_schedule.interval_s > 0 &&
+                    pthread_create(&backup, NULL, backup_thread, NULL) == 0;
+    if (scheduled) {
+        fprintf(stderr, "Backing up to %s every %d minutes, keeping %d\n", backup_schedule.dir,
+                backup_schedule.interval_s / 60, backup_schedule.keep);
+    }
+    int purging = purge_schedule.interval_s > 0 && pthread_create(&purge, NULL, purge_thread, NULL) == 0;
+    if (purging) {
+        fprintf(stderr, "Purging tombstones older than %d days every %d minutes\n", purge_schedule.retention_days,
+                purge_schedule.interval_s / 60);
+    }
+    for (int i = 0; i < workers; i++) {
+        pthread_create(&readers[i], NULL, reader_thread, NULL);
+    }
+    fprintf(stderr, "Listening on %s with %d reader threads\n", socket_path, workers);
+
+    // The dispatcher: poll the listening socket, the wake-up pipe and every client
+    // not being served, and queue each client with a request waiting for a reader.
+    // A request is read with a timeout, so a client that stalls mid-frame is dropped
+    // rather than holding a reader.
+    struct timeval io_timeout = {SERVER_IO_TIMEOUT_S, 0};
+    int client_count = 0, capacity = 64;
+    Client **clients = malloc(capacity * sizeof(Client*));
+    Client **polled = malloc(capacity * sizeof(Client*));
+    struct pollfd *pfds = malloc(capacity * sizeof(struct pollfd));
+    if (!clients || !polled || !pfds) {
+        fprintf(stderr, "Out of memory\n");
+        server_stop = 1;
+    }
+    while (!server_stop) {
+        int n = 2;
+        pfds[0] = (struct pollfd){listen_fd, POLLIN, 0};
+        pfds[1] = (struct pollfd){wake[0], POLLIN, 0};
+        pthread_mutex_lock(&client_queue.lock);
+        for (int i = 0; i < client_count; i++) {
+            Client *client = clients[i];
+            if (client->busy) continue;
+            if (client->closed) {
+                close(client->fd);
+                free(client);
+                clients[i--] = clients[--client_count];
+                continue;
+            }
+            polled[n] = client;
+            pfds[n++] = (struct pollfd){client->fd, POLLIN, 0};
+        }
+        pthread_mutex_unlock(&client_queue.lock);
+
+        if (poll(pfds, n, SERVER_POLL_MS) <= 0) continue;
+        if (pfds[1].revents) {
+            char drain[64];
+            while (read(wake[0], drain, sizeof(drain)) > 0) {}
+        }
+        pthread_mutex_lock(&client_queue.lock);
+        for (int i = 2; i < n; i++) {
+            if (!pfds[i].revents) continue;
+            Client *client = polled[i];
+            client->busy = 1;
+            client->next = NULL;
+            if (client_queue.tail) client_queue.tail->next = client;
+            else client_queue.head = client;
+            client_queue.tail = client;
+            pthread_cond_signal(&client_queue.ready);
+        }
+        pthread_mutex_unlock(&client_queue.lock);
+
+        if (!pfds[0].revents) continue;
+        int fd = accept(listen_fd, NULL, NULL);
+        if (fd < 0) continue;
+        Client *client = calloc(1, sizeof(Client));
+        if (client_count + 2 >= capacity) {
+            int grown = capacity * 2;
+            Client **more_clients = realloc(clients, grown * sizeof(Client*));
+            if (more_clients) clients = more_clients;
+            Client **more_polled = realloc(polled, grown * sizeof(Client*));
+            if (more_polled) polled = more_polled;
+            struct pollfd *more_pfds = realloc(pfds, grown * sizeof(struct pollfd));
+            if (more_pfds) pfds = more_pfds;
+            if (more_clients && more_polled && more_pfds) capacity = grown;
+        }
+        if (!client || client_count + 2 >= capacity) {
+            fprintf(stderr, "Out of memory, refusing a connection\n");
+            free(client);
+            close(fd);
+            continue;
+        }
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &io_timeout, sizeof(io_timeout));
+        setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &io_timeout, sizeof(io_timeout));
+        client->fd = fd;
+        clients[client_count++] = client;
+    }
+
+    close(listen_fd);
+    unlink(socket_path);
+    pthread_mutex_lock(&client_queue.lock);
+    client_queue.stopping = 1;
+    pthread_cond_broadcast(&client_queue.ready);
+    pthread_mutex_unlock(&client_queue.lock);
+    for (int i = 0; i < workers; i++) {
+        pthread_join(readers[i], NULL);
+    }
+    for (int i = 0; i < client_count; i++) {
+        close(clients[i]->fd);
+        free(clients[i]);
+    }
+    free(clients);
+    free(polled);
+    free(pfds);
+    close(wake[0]);
+    close(wake[1]);
+    client_queue.wake_fd = -1;
+    pthread_mutex_lock(&write_queue.lock);
+    write_queue.stopping = 1;
+    pthread_cond_signal(&write_queue.ready);
+    pthread_mutex_unlock(&write_queue.lock);
+    pthread_join(writer, NULL);
+    if (scheduled) {
+        pthread_mutex_lock(&backup_schedule.lock);
+        backup_schedule.stopping = 1;
+        pthread_cond_signal(&backup_schedule.wake);
+        pthread_mutex_unlock(&backup_schedule.lock);
+        pthread_join(backup, NULL);
+    }
+    if (purging) {
+        pthread_mutex_lock(&purge_schedule.lock);
+        purge_schedule.stopping = 1;
+        pthread_cond_signal(&purge_schedule.wake);
+        pthread_mutex_unlock(&purge_schedule.lock);
+        pthread_join(purge, NULL);
+    }
+    free(readers);
+    fprintf(stderr, "Server stopped\n");
+    return 1;
+}
+
+// Sends one request built from argv and prints the reply. "LOGIN <user>" takes the
+// password from NID_PASSWORD; other requests present the NID_SESSION token if set.
+int run_client(const char *socket_path, int argc, char **argv) {
+    Buffer request = {0};
+    for (int i = 0; i < argc; i++) {
+        buf_printf(&request, i ? "\t%s" : "%s", argv[i]);
+    }
+    int login = argc == 2 && strcmp(argv[0], "LOGIN") == 0;
+    if (login && getenv("NID_PASSWORD")) {
+        buf_printf(&request, "\t%s", getenv("NID_PASSWORD"));
+    }
+    const char *token = login ? NULL : getenv("NID_SESSION");
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    struct sockaddr_un addr = {0};
+    addr.sun_family = AF_UNIX;
+    snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", socket_path);
+    if (fd < 0 || connect(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0) {
+        perror(socket_path);
+        if (fd >= 0) close(fd);
+        buf_free(&request);
+        return 0;
+    }
+    char *reply = NULL;
+    if (token) {
+        Buffer session = {0};
+        buf_printf(&session, "SESSION\t%s", token);
+        if (send_frame(fd, session.data, session.len)) {
+            reply = recv_frame(fd);
+        }
+        buf_free(&session);
+        // A rejected token is reported in place of the request's reply
+        if (reply && strcmp(reply, "OK") == 0) {
+            free(reply);
+            reply = NULL;
+        }
+    }
+    if (!reply && send_frame(fd, request.data ? request.data : "", request.len)) {
+        reply = recv_frame(fd);
+    }
+    close(fd);
+    buf_free(&request);
+    if (!reply) {
+        fprintf(stderr, "No reply from server\n");
+        return 0;
+    }
+    printf("%s\n", reply);
+    int ok = strncmp(reply, "OK", 2) == 0;
+    free(reply);
+    return ok;
+}
+
+// ================== BATCH MODE ==================
+// Runs a script of server requests, one tab-separated line each (blank lines and
+// lines starting with # are skipped), as the user signed in with --user. Runs of
+// consecutive writes are committed together, up to group_size at a time, like the
+// server's writer does; a read first commits the writes before it, so it sees them.
+// Each request gets one JSON line on out, in input order, once its transaction has
+// committed:
+//   {"line":N,"ok":true,"reply":[<fields after OK>],"rows":[[<fields>],...]}
+//   {"line":N,"ok":false,"error":"<message>"}
+// A group whose transaction cannot start, because another process (a running
+// server) holds the write lock past the busy timeout, is tried again; if it still
+// cannot start, its requests fail with "database busy, not run" and none of them
+// was stored, so the script can resend them.
+// Returns 0 if a request failed or the input could not be read.
+#define BATCH_DEFAULT_GROUP 1000
+#define BATCH_BEGIN_ATTEMPTS 3
+
+typedef struct {
+    long commands;
+    long writes;
+    long groups;
+    long failed;
+} BatchTotals;
+
+// Turns a server reply into a JSON line; the first line holds the reply fields, each
+// further line is a row
+void append_batch_reply(Buffer *out, long line, const char *reply, size_t len) {
+    int ok = len >= 2 && strncmp(reply, "OK", 2) == 0;
+    buf_printf(out, "{\"line\":%ld,\"ok\":%s", line, ok ? "true" : "false");
+    if (!ok) {
+        const char *message = len > 4 && strncmp(reply, "ERR\t", 4) == 0 ? reply + 4 : reply;
+        buf_append(out, ",\"error\":", 9);
+        append_json_string(out, message, len - (message - reply));
+        buf_append(out, "}\n", 2);
+        return;
+    }
+    const char *p = reply + 2, *end = reply + len;
+    while (end > p && end[-1] == '\n') end--;
+    const char *eol = memchr(p, '\n', end - p);
+    if (!eol) eol = end;
+    buf_append(out, ",\"reply\":[", 10);
+    for (int first = 1; p < eol; first = 0) {
+        p++;        // the tab before each field
+        const char *tab = memchr(p, '\t', eol - p);
+        if (!tab) tab = eol;
+        if (!first) buf_append(out, ",", 1);
+        append_json_string(out, p, tab - p);
+        p = tab;
+    }
+    buf_append(out, "]", 1);
+    if (eol < end) {
+        buf_append(out, ",\"rows\":[", 9);
+        for (p = eol + 1; p <= end; ) {
+            const char *row_end = memchr(p, '\n', end - p);
+            if (!row_end) row_end = end;
+            buf_append(out, p > eol + 1 ? ",[" : "[", p > eol + 1 ? 2 : 1);
+            for (const char *field = p; ; ) {
+                const char *tab = memchr(field, '\t', row_end - field);
+                if (!tab) tab = row_end;
+                if (field > p) buf_append(out, ",", 1);
+                append_json_string(out, field, tab - field);
+                if (tab == row_end) break;
+                field = tab + 1;
+            }
+            buf_append(out, "]", 1);
+            p = row_end + 1;
+        }
+        buf_append(out, "]", 1);
+    }
+    buf_append(out, "}\n", 2);
+}
+
+// Commits the pending writes and writes their replies out
+int flush_batch_writes(WriteJob **pending, long *lines, int count, BatchTotals *totals, Buffer *out, int fd) {
+    if (count == 0) {
+        return 1;
+    }
+    for (int i = 0; i < count; i++) pending[i]->next = i + 1 < count ? pending[i + 1] : NULL;
+    for (int attempt = 1; commit_write_batch(pending[0]) < 0 && attempt < BATCH_BEGIN_ATTEMPTS; attempt++) {
+        fprintf(stderr, "Batch: database busy, retrying the writes from line %ld\n", lines[0]);
+        for (int i = 0; i < count; i++) pending[i]->response.len = 0;
+    }
+    totals->groups++;
+    for (int i = 0; i < count; i++) {
+        WriteJob *job = pending[i];
+        const char *reply = job->response.data ? job->response.data : "";
+        totals->failed += strncmp(reply, "OK", 2) != 0;
+        append_batch_reply(out, lines[i], reply, job->response.len);
+        buf_free(&job->response);
+        free(job->payload);
+        free(job);
+    }
+    int ok = write_full(fd, out->data, out->len);
+    out->len = 0;
+    return ok;
+}
+
+int run_batch(FILE *in, int fd, int group_size) {
+    if (group_size < 1) group_size = 1;
+    WriteJob **pending = calloc(group_size, sizeof(*pending));
+    long *pending_lines = calloc(group_size, sizeof(*pending_lines));
+    if (!pending || !pending_lines) {
+        free(pending);
+        free(pending_lines);
+        return 0;
+    }
+    BatchTotals totals = {0};
+    Buffer out = {0};
+    char *line = NULL;
+    size_t line_size = 0;
+    ssize_t len;
+    long line_no = 0;
+    int count = 0, ok = 1;
+    long long started = now_ns();
+    while (ok && (len = getline(&line, &line_size, in)) >= 0) {
+        line_no++;
+        while (len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r')) line[--len] = '\0';
+        if (len == 0 || line[0] == '#') continue;
+        totals.commands++;
+        if (len > SERVER_MAX_FRAME) {
+            ok = flush_batch_writes(pending, pending_lines, count, &totals, &out, fd);
+            count = 0;
+            append_batch_reply(&out, line_no, "ERR\trequest too long", 20);
+            totals.failed++;
+            continue;
+        }
+        if (is_write_request(line)) {
+            WriteJob *job = calloc(1, sizeof(*job));
+            if (!job || !(job->payload = strdup(line))) {
+                free(job);
+                ok = 0;
+                break;
+            }
+            pending_lines[count] = line_no;
+            pending[count++] = job;
+            totals.writes++;
+            if (count == group_size) {
+                ok = flush_batch_writes(pending, pending_lines, count, &totals, &out, fd);
+                count = 0;
+            }
+            continue;
+        }
+        ok = flush_batch_writes(pending, pending_lines, count, &totals, &out, fd);
+        count = 0;
+        Buffer response = {0};
+        if (is_session_request(line)) buf_printf(&response, "ERR\tbatch mode is signed in with --user");
+        else handle_request(line, &response);
+        totals.failed += response.len < 2 || strncmp(response.data, "OK", 2) != 0;
+        append_batch_reply(&out, line_no, response.data ? response.data : "", response.len);
+        buf_free(&response);
+        if (out.len >= DUMP_BUFFER_SIZE) {
+            ok = ok && write_full(fd, out.data, out.len);
+            out.len = 0;
+        }
+    }
+    if (ferror(in)) {
+        perror("Batch input");
+        ok = 0;
+    }
+    ok = flush_batch_writes(pending, pending_lines, count, &totals, &out, fd) && ok;
+    ok = ok && (out.len == 0 || write_full(fd, out.data, out.len));
+    buf_free(&out);
+    free(line);
+    free(pending);
+    free(pending_lines);
+
+    double elapsed = (now_ns() - started) / 1e9;
+    fprintf(stderr, "Batch: %ld requests (%ld writes in %ld transactions), %ld failed, in %.2fs (%.0f requests/sec)\n",
+            totals.commands, totals.writes, totals.groups, totals.failed, elapsed,
+            elapsed > 0 ? totals.commands / elapsed : 0.0);
+    return ok && totals.failed == 0;
+}
+
+// ================== BENCHMARK ==================
+// Loads synthetic citizens into a scratch database and times each operation the
+// admin menu performs, so regressions and hardware sizing can be measured without
+// a terminal. The database runs in WAL mode as the server does, and the results
+// are written as JSON.
+#define BENCH_DEFAULT_OPS 10000
+#define BENCH_PAGE_SIZE 20
+
+const char *bench_male_names[] = {"Abdul", "Rahim", "Karim", "Hasan", "Mahmud", "Rafiq", "Jamal", "Kamal",
+    "Shafiq", "Nasir", "Tanvir", "Imran", "Sabbir", "Arif", "Faisal", "Mizanur", "Anisur", "Habib", "Sohel", "Rashed"};
+const char *bench_female_names[] = {"Fatema", "Ayesha", "Nasrin", "Shirin", "Rokeya", "Sultana", "Taslima", "Nazma",
+    "Farzana", "Sharmin", "Rehana", "Jannat", "Sadia", "Tahmina", "Nusrat", "Sumaiya", "Khadija", "Mariam", "Rupa", "Lima"};
+const char *bench_surnames[] = {"Ahmed", "Hossain", "Islam", "Rahman", "Khan", "Chowdhury", "Sarkar", "Mia",
+    "Uddin", "Akter", "Begum", "Haque", "Alam", "Sheikh", "Talukder", "Bhuiyan"};
+const char *bench_areas[] = {"Mirpur", "Dhanmondi", "Uttara", "Mohammadpur", "Gulshan", "Banani", "Motijheel",
+    "Khilgaon", "Badda", "Rampura", "Agrabad", "Pahartali", "Zindabazar", "Shibganj", "Kazipara", "Sadar"};
+const char *bench_districts[] = {"Dhaka", "Chattogram", "Sylhet", "Rajshahi", "Khulna", "Barishal", "Rangpur",
+    "Mymensingh", "Cumilla", "Gazipur", "Narayanganj", "Bogura"};
+// Roughly the national distribution, in percent
+const char *bench_blood_groups[] = {"O+", "B+", "A+", "AB+", "O-", "B-", "A-", "AB-"};
+const int bench_blood_weights[] = {35, 30, 22, 7, 2, 2, 1, 1};
+
+#define BENCH_PICK(rng, list) (list[bench_next(rng) % (sizeof(list) / sizeof(list[0]))])
+
+uint64_t bench_next(uint64_t *state) {
+    *state += 0x9e3779b97f4a7c15ULL;
+    return nid_mix(*state);
+}
+
+void bench_citizen(uint64_t *rng, Citizen *c) {
+    int male = bench_next(rng) & 1;
+    const char *surname = BENCH_PICK(rng, bench_surnames);
+    snprintf(c->name, MAX_NAME, "%s %s", male ? BENCH_PICK(rng, bench_male_names) : BENCH_PICK(rng, bench_female_names), surname);
+    snprintf(c->father_name, MAX_NAME, "%s %s", BENCH_PICK(rng, bench_male_names), surname);
+    snprintf(c->mother_name, MAX_NAME, "%s %s", BENCH_PICK(rng, bench_female_names), BENCH_PICK(rng, bench_surnames));
+    strcpy(c->gender, male ? "Male" : "Female");
+
+    static const int days_in_month[] = {31, 28, 31, 30, 31, 30, 31, 31, 30, 31, 30, 31};
+    int year = 1940 + (int)(bench_next(rng) % 68);
+    int month = 1 + (int)(bench_next(rng) % 12);
+    int days = days_in_month[month - 1] + (month == 2 && year % 4 == 0 && (year % 100 != 0 || year % 400 == 0));
+    unsigned day = 1 + (unsigned)(bench_next(rng) % days);
+    snprintf(c->dob, sizeof(c->dob), "%02u-%02d-%04d", day, month, year);
+
+    snprintf(c->address, MAX_ADDRESS, "House %d, Road %d, %s, %s", 1 + (int)(bench_next(rng) % 200),
+             1 + (int)(bench_next(rng) % 40), BENCH_PICK(rng, bench_areas), BENCH_PICK(rng, bench_districts));
+    int roll = (int)(bench_next(rng) % 100), group = 0;
+    while (roll >= bench_blood_weights[group]) roll -= bench_blood_weights[group++];
+    strcpy(c->blood_group, bench_blood_groups[group]);
+
+    c->is_active = 1;
+    c->created_at = c->last_modified = time(NULL);
+}
+
+typedef struct {
+    const char *name;
+    Histogram hist;
+    double seconds;
+} BenchResult;
+
+void bench_report(FILE *out, long rows, int ops, uint64_t seed, BenchResult *results, int count) {
+    fprintf(out, "{\n  \"rows\": %ld,\n  \"ops\": %d,\n  \"seed\": %llu,\n  \"journal_mode\": \"wal\",\n"
+                 "  \"field_encryption\": \"%s\",\n  \"workloads\": [\n",
+            rows, ops, (unsigned long long)seed, pii_encryption ? "aes-256-gcm" : "none");
+    for (int i = 0; i < count; i++) {
+        const Histogram *h = &results[i].hist;
+        double secs = results[i].seconds;
+        fprintf(out, "    {\"name\": \"%s\", \"ops\": %llu, \"seconds\": %.3f, \"ops_per_sec\": %.1f, "
+                "\"mean_us\": %.2f, \"p50_us\": %.2f, \"p99_us\": %.2f, \"p999_us\": %.2f, \"max_us\": %.2f}%s\n",
+                results[i].name, (unsigned long long)h->total, secs, secs > 0 ? h->total / secs : 0.0,
+                h->total ? h->sum_ns / 1e3 / h->total : 0.0, hist_percentile(h, 0.50) / 1e3,
+                hist_percentile(h, 0.99) / 1e3, hist_percentile(h, 0.999) / 1e3, h->max_ns / 1e3,
+                i + 1 < count ? "," : "");
+    }
+    fprintf(out, "  ]\n}\n");
+}
+
+void bench_count_row(sqlite3_stmt *stmt, void *ctx) {
+    (void)stmt;
+    (*(int*)ctx)++;
+}
+
+// Scale accepts a plain count or a K/M suffix (10K, 1M, 10M)
+long parse_scale(const char *text) {
+    char *end;
+    double value = strtod(text, &end);
+    if (*end == 'k' || *end == 'K') value *= 1e3;
+    else if (*end == 'm' || *end == 'M') value *= 1e6;
+    return value >= 1 ? (long)value : 0;
+}
+
+int run_benchmark(long rows, int ops, uint64_t seed, FILE *out) {
+    if (!exec_sql("PRAGMA journal_mode=WAL; PRAGMA synchronous=NORMAL;")) {
+        return 0;
+    }
+    uint64_t *nids = malloc(rows * sizeof(uint64_t));
+    BenchResult *results = calloc(6, sizeof(BenchResult));
+    if (!nids || !results) {
+        free(nids);
+        free(results);
+        fprintf(stderr, "Not enough memory for %ld rows\n", rows);
+        return 0;
+    }
+    uint64_t rng = seed;
+    long loaded = 0;
+    int count = 0, ok = 1;
+    Citizen c;
+    char nid[20];
+    long long start, t;
+
+    // register: bulk-import batching, with each commit charged to the row that triggered it
+    BenchResult *r = &results[count++];
+    r->name = "register";
+    fprintf(stderr, "Registering %ld citizens...\n", rows);
+    start = now_ns();
+    exec_sql("BEGIN;");
+    for (long i = 0; i < rows && ok; i++) {
+        bench_citizen(&rng, &c);
+        t = now_ns();
+        if (!save_citizen(&c)) {
+            fprintf(stderr, "Insert failed: %s\n", sqlite3_errmsg(db));
+            ok = 0;
+            break;
+        }
+        audit_log(c.nid, "REGISTERED");
+        if ((i + 1) % IMPORT_BATCH_SIZE == 0 || i + 1 == rows) {
+            ok = exec_sql("COMMIT;") && (i + 1 == rows || exec_sql("BEGIN;"));
+        }
+        hist_record(&r->hist, now_ns() - t);
+        nids[loaded++] = strtoull(c.nid, NULL, 10);
+    }
+    r->seconds = (now_ns() - start) / 1e9;
+    if (!ok) {
+        sqlite3_exec(db, "ROLLBACK;", 0, 0, 0);
+    }
+
+    // search: point lookups by NID, audited like the admin menu
+    r = &results[count++];
+    r->name = "search";
+    start = now_ns();
+    for (int i = 0; ok && i < ops; i++) {
+        snprintf(nid, sizeof(nid), "%010llu", (unsigned long long)nids[bench_next(&rng) % loaded]);
+        t = now_ns();
+        if (find_citizen(nid, &c)) audit_log(nid, "SEARCHED");
+        hist_record(&r->hist, now_ns() - t);
+    }
+    r->seconds = (now_ns() - start) / 1e9;
+
+    // update: read-modify-write of the address, one transaction each
+    r = &results[count++];
+    r->name = "update";
+    start = now_ns();
+    for (int i = 0; ok && i < ops; i++) {
+        snprintf(nid, sizeof(nid), "%010llu", (unsigned long long)nids[bench_next(&rng) % loaded]);
+        t = now_ns();
+        if (find_citizen(nid, &c)) {
+            snprintf(c.address, MAX_ADDRESS, "House %d, Road %d, %s, %s", 1 + (int)(bench_next(&rng) % 200),
+                     1 + (int)(bench_next(&rng) % 40), BENCH_PICK(&rng, bench_areas), BENCH_PICK(&rng, bench_districts));
+            c.last_modified = time(NULL);
+            if (update_citizen(nid, &c)) audit_log(nid, "UPDATED");
+        }
+        hist_record(&r->hist, now_ns() - t);
+    }
+    r->seconds = (now_ns() - start) / 1e9;
+
+    // view: one page of the register from a random position
+    r = &results[count++];
+    r->name = "view";
+    Buffer page = {0};
+    char first[20], last[20];
+    start = now_ns();
+    for (int i = 0; ok && i < ops; i++) {
+        snprintf(nid, sizeof(nid), "%010llu", (unsigned long long)nids[bench_next(&rng) % loaded]);
+        t = now_ns();
+        browse_page(nid, 0, BENCH_PAGE_SIZE, &page, first, last);
+        hist_record(&r->hist, now_ns() - t);
+    }
+    r->seconds = (now_ns() - start) / 1e9;
+    buf_free(&page);
+
+    // audit-query: a citizen's history, and every fourth query the latest updates
+    r = &results[count++];
+    r->name = "audit_query";
+    audit_flush();
+    char cursor[AUDIT_CURSOR_LEN];
+    start = now_ns();
+    for (int i = 0; ok && i < ops; i++) {
+        snprintf(nid, sizeof(nid), "%010llu", (unsigned long long)nids[bench_next(&rng) % loaded]);
+        AuditQuery q = {0};
+        if (i % 4 == 3) q.activity = "UPDATED";
+        else q.nid = nid;
+        int rows_seen = 0;
+        t = now_ns();
+        query_audit_logs(&q, bench_count_row, &rows_seen, cursor);
+        hist_record(&r->hist, now_ns() - t);
+    }
+    r->seconds = (now_ns() - start) / 1e9;
+
+    // delete: distinct citizens, removed from the pool as they go
+    r = &results[count++];
+    r->name = "delete";
+    start = now_ns();
+    for (int i = 0; ok && i < ops && loaded > 0; i++) {
+        long pick = (long)(bench_next(&rng) % loaded);
+        snprintf(nid, sizeof(nid), "%010llu", (unsigned long long)nids[pick]);
+        nids[pick] = nids[--loaded];
+        t = now_ns();
+        if (delete_citizen(nid) > 0) audit_log(nid, "DELETED");
+        hist_record(&r->hist, now_ns() - t);
+    }
+    r->seconds = (now_ns() - start) / 1e9;
+
+    if (ok) {
+        bench_report(out, rows, ops, seed, results, count);
+    }
+    free(nids);
+    free(results);
+    return ok;
+}
+
+const char *database_suffixes[] = {"", "-wal", "-shm", "-journal", ".nidseq", ".nidseq-journal"};
+
+// Removes a scratch database together with its journal and NID sequence files
+void remove_database_files(const char *path) {
+    char file[1024];
+    for (size_t i = 0; i < sizeof(database_suffixes) / sizeof(database_suffixes[0]); i++) {
+        snprintf(file, sizeof(file), "%s%s", path, database_suffixes[i]);
+        unlink(file);
+    }
+}
+
+int database_files_exist(const char *path) {
+    char file[1024];
+    for (size_t i = 0; i < sizeof(database_suffixes) / sizeof(database_suffixes[0]); i++) {
+        snprintf(file, sizeof(file), "%s%s", path, database_suffixes[i]);
+        if (access(file, F_OK) == 0) return 1;
+    }
+    return 0;
+}
+
+// Absolute form of a path whose last component need not exist yet
+int resolve_path(const char *path, char *out, size_t size) {
+    char dir[PATH_MAX], real[PATH_MAX];
+    const char *slash = strrchr(path, '/');
+    const char *base = slash ? slash + 1 : path;
+    if (!slash) {
+        strcpy(dir, ".");
+    } else {
+        snprintf(dir, sizeof(dir), "%.*s", slash == path ? 1 : (int)(slash - path), path);
+    }
+    if (!realpath(dir, real)) return 0;
+    return snprintf(out, size, "%s/%s", strcmp(real, "/") ? real : "", base) < (int)size;
 }
-int save_citizen(Citizen *citizen) {
-    char *sql = "INSERT INTO citizens VALUES (?,?,?,?,?,?,?,?,?,?,?);";
-    sqlite3_stmt *stmt;
-    if(sqlite3_prepare_v2(db, sql, -1, &stmt, 0) != SQLITE_OK) {
-        fprintf(stderr, "Failed to prepare statement: %s\n", sqlite3_errmsg(db));
+
+// The benchmark deletes its database before and after the run, so it only takes a
+// path that is not the register (or one of its shard or sidecar files) and, unless
+// overwrite is set, one where nothing exists yet
+int check_bench_path(const char *path, int overwrite) {
+    char bench[PATH_MAX], live[PATH_MAX];
+    if (!resolve_path(path, bench, sizeof(bench)) || !resolve_path(DB_NAME, live, sizeof(live))) {
+        fprintf(stderr, "Cannot resolve %s: %s\n", path, strerror(errno));
         return 0;
     }
-    
-    sqlite3_bind_text(stmt, 1, citizen->nid, -1, SQLITE_STATIC);
-    sqlite3_bind_text(stmt, 2, citizen->name, -1, SQLITE_STATIC);
-    sqlite3_bind_text(stmt, 3, citizen->dob, -1, SQLITE_STATIC);
-    sqlite3_bind_text(stmt, 4, citizen->gender, -1, SQLITE_STATIC);
-    sqlite3_bind_text(stmt, 5, citizen->address, -1, SQLITE_STATIC);
-    sqlite3_bind_text(stmt, 6, citizen->father_name, -1, SQLITE_STATIC);
-    sqlite3_bind_text(stmt, 7, citizen->mother_name, -1, SQLITE_STATIC);
-    sqlite3_bind_text(stmt, 8, citizen->blood_group, -1, SQLITE_STATIC);
-    sqlite3_bind_int(stmt, 9, citizen->is_active);
-    sqlite3_bind_int64(stmt, 10, (sqlite3_int64)citizen->created_at);
-    sqlite3_bind_int64(stmt, 11, (sqlite3_int64)citizen->last_modified);
-    int rc = sqlite3_step(stmt);
-    sqlite3_finalize(stmt);
-    
-    if(rc != SQLITE_DONE) {
-        fprintf(stderr, "Execution failed: %s\n", sqlite3_errmsg(db));
+    size_t len = strlen(live);
+    if (strncmp(bench, live, len) == 0 && strchr("-.", bench[len])) {    // "" is in every string
+        fprintf(stderr, "%s is the citizen register; choose another --bench-db\n", path);
+        return 0;
+    }
+    if (!overwrite && database_files_exist(path)) {
+        fprintf(stderr, "%s already exists; remove it or add --force to replace it\n", path);
         return 0;
     }
     return 1;
 }
-void display_citizen(const Citizen *citizen) {
-    printf("\nNID: %s\nName: %s\nDOB: %s\nGender: %s\nAddress: %s\nFather: %s\nMother: %s\nBlood Group: %s\nStatus: %s\nCreated: %sLast Modified: %s",
-           citizen->nid, citizen->name, citizen->dob, citizen->gender, citizen->address, citizen->father_name,
-           citizen->mother_name, citizen->blood_group, citizen->is_active ? "Active" : "Inactive",
-           ctime(&citizen->created_at), ctime(&citizen->last_modified));
+
+// ================== MAIN PROGRAM ==================
+void ensure_admin_user() {
+    sqlite3_stmt *stmt = stmt_acquire(STMT_USER_COUNT); 
+    int admin_exists = 0; 
+    sqlite3_bind_text(stmt, 1, "pub22$", -1, SQLITE_STATIC);
+    if(sqlite3_step(stmt) == SQLITE_ROW)  {
+        admin_exists = sqlite3_column_int(stmt, 0); 
+    } 
+    stmt_release(STMT_USER_COUNT);
+    if(!admin_exists) {
+        SystemUser  admin; 
+        strcpy(admin.username, "pub22$");
+        generate_salt(admin.salt);  
+        derive_key("Pubcse22$", admin.salt,admin.password_hash);
+        admin.role = ADMIN;
+        admin.failed_attempts = 0;
+        admin.last_login = 0;
+        stmt = stmt_acquire(STMT_USER_INSERT);
+        sqlite3_bind_text(stmt, 1, admin.username, -1, SQLITE_STATIC);
+        sqlite3_bind_blob(stmt, 2, admin.password_hash, SHA256_DIGEST_LENGTH, SQLITE_STATIC);
+        sqlite3_bind_blob(stmt, 3, admin.salt, SALT_LEN, SQLITE_STATIC);
+        sqlite3_bind_int(stmt, 4, admin.role);
+        sqlite3_bind_int(stmt, 5, admin.failed_attempts);
+        sqlite3_bind_int64(stmt, 6, admin.last_login);
+        if(sqlite3_step(stmt) == SQLITE_DONE) {
+            printf("Admin user created with password 'adminpass'\n");
+        }
+        stmt_release(STMT_USER_INSERT);
+    }
 }
 
-// ================== USER AUTHENTICATION ==================
-int authenticate_user(const char *username, const char *password) {
-    char *sql = "SELECT password_hash, salt FROM users WHERE username = ?;";
-    sqlite3_stmt *stmt;
+#define PII_CONVERT_BATCH 1000
 
-    if(sqlite3_prepare_v2(db, sql, -1, &stmt, NULL) != SQLITE_OK) {
-        fprintf(stderr, "Database error: Failed to prepare statement\n");
-        return 0;
+// Drops the word index (it would hold plaintext) and the plaintext name indexes
+int drop_plaintext_indexes(const char *schema) {
+    const char *objects[][2] = {{"TRIGGER", "citizens_fts_insert"}, {"TRIGGER", "citizens_fts_delete"},
+                                {"TRIGGER", "citizens_fts_update"}, {"TABLE", "citizens_fts"},
+                                {"INDEX", "idx_citizens_name"}, {"INDEX", "idx_citizens_father"},
+                                {"INDEX", "idx_citizens_mother"}};
+    for (size_t i = 0; i < sizeof(objects) / sizeof(objects[0]); i++) {
+        char sql[128];
+        snprintf(sql, sizeof(sql), "DROP %s IF EXISTS %s.%s;", objects[i][0], schema, objects[i][1]);
+        if (sqlite3_exec(db, sql, 0, 0, 0) != SQLITE_OK) {
+            return 0;
+        }
     }
-    if(sqlite3_bind_text(stmt, 1, username, -1, SQLITE_STATIC) != SQLITE_OK) {
-        fprintf(stderr, "Database error: Failed to bind parameters\n");
-        sqlite3_finalize(stmt);
+    return 1;
+}
+
+// Encrypts rows still stored as plaintext, a batch per transaction
+int encrypt_plaintext_rows() {
+    sqlite3_stmt *select, *update[DB_MAX_SHARDS] = {0};
+    if (sqlite3_prepare_v2(db, "SELECT nid, name, address, father_name, mother_name FROM citizens "
+                               "WHERE nid > ? ORDER BY nid LIMIT ?;", -1, &select, 0) != SQLITE_OK) {
+        fprintf(stderr, "SQL error: %s\n", sqlite3_errmsg(db));
         return 0;
     }
-    int rc = sqlite3_step(stmt);
-    if(rc == SQLITE_ROW) {
-        const unsigned char *db_hash = sqlite3_column_blob(stmt, 0);
-        const unsigned char *salt = sqlite3_column_blob(stmt, 1);
-        if(sqlite3_column_bytes(stmt, 0) != SHA256_DIGEST_LENGTH || 
-           sqlite3_column_bytes(stmt, 1) != SALT_LEN) {
-            sqlite3_finalize(stmt);
+    for (int i = 0; i < (db_shards ? db_shards : 1); i++) {
+        char sql[256];
+        snprintf(sql, sizeof(sql), "UPDATE %s.citizens SET name = ?1, address = ?2, father_name = ?3, mother_name = ?4, "
+                                   "name_bidx = ?5, father_bidx = ?6, mother_bidx = ?7 WHERE nid = ?8;", citizen_schema(i));
+        if (sqlite3_prepare_v2(db, sql, -1, &update[i], 0) != SQLITE_OK) {
+            fprintf(stderr, "SQL error: %s\n", sqlite3_errmsg(db));
+            sqlite3_finalize(select);
+            for (int j = 0; j < i; j++) sqlite3_finalize(update[j]);
             return 0;
         }
-        unsigned char derived_key[SHA256_DIGEST_LENGTH];
-        derive_key(password, salt, derived_key);
-        int result = (memcmp(db_hash, derived_key, SHA256_DIGEST_LENGTH) == 0);
-        sqlite3_finalize(stmt);
-        return result;
     }
-    if(rc == SQLITE_DONE) {
-        sqlite3_finalize(stmt);
+    // Replicas get the same rows back, so this is not recorded as a change
+    drop_change_triggers(db);
+    sqlite3_int64 after = -1;
+    long converted = 0;
+    int ok = 1, rows;
+    do {
+        rows = 0;
+        ok = sqlite3_exec(db, "BEGIN IMMEDIATE;", 0, 0, 0) == SQLITE_OK;
+        sqlite3_bind_int64(select, 1, after);
+        sqlite3_bind_int(select, 2, PII_CONVERT_BATCH);
+        while (ok && sqlite3_step(select) == SQLITE_ROW) {
+            rows++;
+            after = sqlite3_column_int64(select, 0);
+            if (sqlite3_column_type(select, 1) != SQLITE_TEXT) continue;
+            const char *texts[4];
+            for (int i = 0; i < 4; i++) texts[i] = (const char*)sqlite3_column_text(select, i + 1);
+            sqlite3_stmt *stmt = update[citizen_shard(after)];
+            bind_pii(stmt, 1, texts[0], after, 1);
+            bind_pii(stmt, 2, texts[1], after, 4);
+            bind_pii(stmt, 3, texts[2], after, 5);
+            bind_pii(stmt, 4, texts[3], after, 6);
+            bind_blind_index(stmt, 5, texts[0]);
+            bind_blind_index(stmt, 6, texts[2]);
+            bind_blind_index(stmt, 7, texts[3]);
+            sqlite3_bind_int64(stmt, 8, after);
+            ok = sqlite3_step(stmt) == SQLITE_DONE;
+            sqlite3_reset(stmt);
+            converted++;
+        }
+        sqlite3_reset(select);
+        if (!ok || sqlite3_exec(db, "COMMIT;", 0, 0, 0) != SQLITE_OK) {
+            fprintf(stderr, "Field encryption: converting rows failed: %s\n", sqlite3_errmsg(db));
+            sqlite3_exec(db, "ROLLBACK;", 0, 0, 0);
+            ok = 0;
+        }
+    } while (ok && rows == PII_CONVERT_BATCH);
+    sqlite3_finalize(select);
+    for (int i = 0; i < DB_MAX_SHARDS; i++) sqlite3_finalize(update[i]);
+    ok = create_change_triggers(db) && ok;
+    if (ok && converted) fprintf(stderr, "Field encryption: encrypted %ld existing citizens\n", converted);
+    return ok;
+}
+
+// Checks NID_DATA_KEY against the key check stored with the database. The first
+// time a key is given, the word index (it would hold plaintext) and the plaintext
+// name indexes are dropped and existing rows are encrypted.
+int setup_field_encryption() {
+    const char *hex = getenv("NID_DATA_KEY");
+    if (hex && !pii_load_key(hex)) {
+        fprintf(stderr, "NID_DATA_KEY must be %d hex digits\n", PII_KEY_LEN * 2);
         return 0;
     }
-    fprintf(stderr, "Database error: %s\n", sqlite3_errmsg(db));
+    sqlite3_stmt *stmt;
+    int stored = 0, matches = 0, converted = 0;
+    if (sqlite3_prepare_v2(db, "SELECT key, value FROM settings WHERE key IN ('pii_key_check', 'pii_converted');",
+                           -1, &stmt, 0) != SQLITE_OK) {
+        fprintf(stderr, "SQL error: %s\n", sqlite3_errmsg(db));
+        return 0;
+    }
+    while (sqlite3_step(stmt) == SQLITE_ROW) {
+        if (strcmp((const char*)sqlite3_column_text(stmt, 0), "pii_converted") == 0) {
+            converted = 1;
+            continue;
+        }
+        stored = 1;
+        matches = pii_encryption && sqlite3_column_bytes(stmt, 1) == SHA256_DIGEST_LENGTH &&
+                  CRYPTO_memcmp(sqlite3_column_blob(stmt, 1), pii_key_check, SHA256_DIGEST_LENGTH) == 0;
+    }
     sqlite3_finalize(stmt);
-    return 0;
-}
-// ================== ADMIN FUNCTIONS ==================
-void admin_register_citizen() {
-    Citizen new_citizen;
-    input_citizen(&new_citizen,1);
-    
-    if(save_citizen(&new_citizen)) {
-        printf("Citizen registered successfully!\n");
-        
-        char *sql = "INSERT INTO audit_logs (nid, timestamp, activity_type) VALUES (?,?,?);";
-        sqlite3_stmt *stmt;
-        if(sqlite3_prepare_v2(db, sql, -1, &stmt, 0) == SQLITE_OK) {
-            sqlite3_bind_text(stmt, 1, new_citizen.nid, -1, SQLITE_STATIC);
-            sqlite3_bind_int64(stmt, 2, (sqlite3_int64)time(NULL));
-            sqlite3_bind_text(stmt, 3, "REGISTERED", -1, SQLITE_STATIC);
-            sqlite3_step(stmt);
+    if (stored && !pii_encryption) {
+        fprintf(stderr, "Citizen fields are encrypted; set NID_DATA_KEY\n");
+        return 0;
+    }
+    if (stored && !matches) {
+        fprintf(stderr, "NID_DATA_KEY does not match the key this database was encrypted with\n");
+        return 0;
+    }
+    if (!pii_encryption) {
+        return 1;
+    }
+    if (converted) {
+        // A schema migration may have rebuilt them
+        for (int i = -1; i < db_shards; i++) {
+            if (!drop_plaintext_indexes(i < 0 ? "main" : shard_schemas[i])) {
+                fprintf(stderr, "Field encryption: cannot drop plaintext indexes: %s\n", sqlite3_errmsg(db));
+                return 0;
+            }
+        }
+        return 1;
+    }
+    if (!stored) {
+        int ok = sqlite3_exec(db, "PRAGMA secure_delete = ON; BEGIN IMMEDIATE;"
+                                  "DELETE FROM citizen_blocks;"
+                                  "DELETE FROM settings WHERE key = 'duplicate_blocks';", 0, 0, 0) == SQLITE_OK;
+        for (int i = -1; ok && i < db_shards; i++) {
+            ok = drop_plaintext_indexes(i < 0 ? "main" : shard_schemas[i]);
+        }
+        if (ok && sqlite3_prepare_v2(db, "INSERT INTO settings VALUES ('pii_key_check', ?);", -1, &stmt, 0) == SQLITE_OK) {
+            sqlite3_bind_blob(stmt, 1, pii_key_check, SHA256_DIGEST_LENGTH, SQLITE_STATIC);
+            ok = sqlite3_step(stmt) == SQLITE_DONE;
             sqlite3_finalize(stmt);
         }
-    } else {
-        printf("Failed to register citizen!\n");
+        if (!ok || sqlite3_exec(db, "COMMIT;", 0, 0, 0) != SQLITE_OK) {
+            fprintf(stderr, "Field encryption: setup failed: %s\n", sqlite3_errmsg(db));
+            sqlite3_exec(db, "ROLLBACK;", 0, 0, 0);
+            return 0;
+        }
     }
+    return encrypt_plaintext_rows() &&
+           sqlite3_exec(db, "INSERT INTO settings VALUES ('pii_converted', 1);", 0, 0, 0) == SQLITE_OK;
 }
-void admin_view_citizens() {
-    char *sql = "SELECT * FROM citizens;";
+
+// Files every citizen under its blocking keys, checking each against the ones
+// before it. Runs once, on the first start after the blocking table is added (or
+// after field encryption changes how keys are hashed).
+int build_duplicate_blocks() {
     sqlite3_stmt *stmt;
-    int count = 0;
-    if(sqlite3_prepare_v2(db, sql, -1, &stmt, 0) == SQLITE_OK) {
-        printf("\nRegistered Citizens:\n");
-        while(sqlite3_step(stmt) == SQLITE_ROW) {
+    int built = 0;
+    if (sqlite3_prepare_v2(db, "SELECT 1 FROM settings WHERE key = 'duplicate_blocks';", -1, &stmt, 0) != SQLITE_OK) {
+        fprintf(stderr, "SQL error: %s\n", sqlite3_errmsg(db));
+        return 0;
+    }
+    built = sqlite3_step(stmt) == SQLITE_ROW;
+    sqlite3_finalize(stmt);
+    if (built) {
+        return 1;
+    }
+    sqlite3_int64 after = -1;
+    long indexed = 0, flagged = 0;
+    int ok = 1, rows;
+    do {
+        rows = 0;
+        ok = sqlite3_exec(db, "BEGIN IMMEDIATE;", 0, 0, 0) == SQLITE_OK;
+        stmt = stmt_acquire(STMT_CITIZEN_PAGE_NEXT);
+        sqlite3_bind_int64(stmt, 1, after);
+        sqlite3_bind_int(stmt, 2, DEDUP_BATCH);
+        while (ok && sqlite3_step(stmt) == SQLITE_ROW) {
             Citizen c;
-            strncpy(c.nid, (const char*)sqlite3_column_text(stmt, 0), 20);
-            strncpy(c.name, (const char*)sqlite3_column_text(stmt, 1), MAX_NAME);
-            strncpy(c.dob, (const char*)sqlite3_column_text(stmt, 2), 11);
-            strncpy(c.gender, (const char*)sqlite3_column_text(stmt, 3), 10);
-            strncpy(c.address, (const char*)sqlite3_column_text(stmt, 4), MAX_ADDRESS);
-            strncpy(c.father_name, (const char*)sqlite3_column_text(stmt, 5), MAX_NAME);
-            strncpy(c.mother_name, (const char*)sqlite3_column_text(stmt, 6), MAX_NAME);
-            strncpy(c.blood_group, (const char*)sqlite3_column_text(stmt, 7), 4);
-            c.is_active = sqlite3_column_int(stmt, 8);
-            c.created_at = (time_t)sqlite3_column_int64(stmt, 9);
-            c.last_modified = (time_t)sqlite3_column_int64(stmt, 10);
-            
-            display_citizen(&c);
-            printf("-----------------------------\n");
-            count++;
+            citizen_from_row(stmt, &c);
+            after = sqlite3_column_int64(stmt, 0);
+            int count = index_duplicates(&c, NULL);
+            ok = count >= 0;
+            flagged += ok ? count : 0;
+            rows++;
         }
-        
-        if(count == 0) {
-            printf("No citizens registered yet!\n");
+        stmt_release(STMT_CITIZEN_PAGE_NEXT);
+        if (!ok || sqlite3_exec(db, "COMMIT;", 0, 0, 0) != SQLITE_OK) {
+            fprintf(stderr, "Duplicate check: indexing citizens failed: %s\n", sqlite3_errmsg(db));
+            sqlite3_exec(db, "ROLLBACK;", 0, 0, 0);
+            ok = 0;
         }
-        sqlite3_finalize(stmt); 
-    } else {
-        printf("Failed to fetch citizens!\n");
+        indexed += rows;
+    } while (ok && rows == DEDUP_BATCH);
+    if (ok && indexed) {
+        fprintf(stderr, "Duplicate check: indexed %ld citizens, %ld possible duplicates flagged for review\n",
+                indexed, flagged);
     }
+    return ok && sqlite3_exec(db, "INSERT INTO settings VALUES ('duplicate_blocks', 1);", 0, 0, 0) == SQLITE_OK;
 }
-void admin_search_citizen() {
-    char nid[20];
-    printf("Enter NID to search: ");
-    scanf("%19s", nid);
-    clear_input_buffer();
-    
-    char *sql = "SELECT * FROM citizens WHERE nid = ?;";
-    sqlite3_stmt *stmt;
-    
-    if(sqlite3_prepare_v2(db, sql, -1, &stmt, 0) == SQLITE_OK) {
-        sqlite3_bind_text(stmt, 1, nid, -1, SQLITE_STATIC);
-        
-        if(sqlite3_step(stmt) == SQLITE_ROW) { 
-            Citizen c; 
-            strncpy(c.nid, (const char*)sqlite3_column_text(stmt, 0), 20); 
-            strncpy(c.name, (const char*)sqlite3_column_text(stmt, 1), MAX_NAME); 
-            strncpy(c.dob, (const char*)sqlite3_column_text(stmt, 2), 11); 
-            strncpy(c.gender, (const char*)sqlite3_column_text(stmt, 3), 10); 
-            strncpy(c.address, (const char*)sqlite3_column_text(stmt, 4), MAX_ADDRESS); 
-            strncpy(c.father_name, (const char*)sqlite3_column_text(stmt, 5), MAX_NAME); 
-            strncpy(c.mother_name, (const char*)sqlite3_column_text(stmt, 6), MAX_NAME); 
-            strncpy(c.blood_group, (const char*)sqlite3_column_text(stmt, 7), 4); 
-            c.is_active = sqlite3_column_int(stmt, 8); 
-            c.created_at = (time_t)sqlite3_column_int64(stmt, 9); 
-            c.last_modified = (time_t)sqlite3_column_int64(stmt, 10);  
-            display_citizen(&c); 
-            char *log_sql = "INSERT INTO audit_logs (nid, timestamp, activity_type) VALUES (?,?,?);"; 
-            sqlite3_stmt *log_stmt; 
-            if(sqlite3_prepare_v2(db, log_sql, -1, &log_stmt, 0) == SQLITE_OK) { 
-                sqlite3_bind_text(log_stmt, 1, nid, -1, SQLITE_STATIC); 
-                sqlite3_bind_int64(log_stmt, 2, (sqlite3_int64)time(NULL)); 
-                sqlite3_bind_text(log_stmt, 3, "SEARCHED", -1, SQLITE_STATIC); 
-                sqlite3_step(log_stmt); 
-                sqlite3_finalize(log_stmt); 
-            } 
-        } else { 
-            printf("Citizen with NID %s not found!\n", nid); 
-        } 
-        sqlite3_finalize(stmt); 
-    } else { 
-        printf("Search failed!\n"); 
-    } 
-} 
-void admin_update_citizen() {
-    char nid[20];
-    printf("Enter NID to update: ");
-    scanf("%19s", nid);
-    clear_input_buffer();
 
-    
-    char *fetch_sql = "SELECT * FROM citizens WHERE nid = ?;";
-    sqlite3_stmt *fetch_stmt;
-    Citizen existing;
-    int found = 0;
+// Citizens whose last write the main file and shard kept differently: the changes
+// main numbered after the shard's stamp, or the shard rows modified since main's
+long collect_torn_citizens(int shard, const sqlite3_int64 seq[2], sqlite3_int64 main_marked, sqlite3_int64 **keys) {
+    char sql[256];
+    if (seq[0] > seq[1]) {
+        snprintf(sql, sizeof(sql), "SELECT DISTINCT nid FROM main.citizen_changes WHERE seq > ?1 AND nid %% %d = %d;",
+                 db_shards, shard);
+    } else {
+        snprintf(sql, sizeof(sql), "SELECT nid FROM %s.citizens WHERE max(COALESCE(created_at, 0), "
+                                   "COALESCE(last_modified, 0), COALESCE(deleted_at, 0)) >= ?2;", shard_schemas[shard]);
+    }
+    sqlite3_stmt *stmt;
+    if (sqlite3_prepare_v2(db, sql, -1, &stmt, 0) != SQLITE_OK) {
+        return -1;
+    }
+    sqlite3_bind_int64(stmt, 1, seq[1]);
+    sqlite3_bind_int64(stmt, 2, main_marked);
+    long count = 0, cap = 0;
+    int rc;
+    while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+        if (count == cap) {
+            cap = cap ? cap * 2 : 64;
+            sqlite3_int64 *grown = realloc(*keys, cap * sizeof(**keys));
+            if (!grown) break;
+            *keys = grown;
+        }
+        (*keys)[count++] = sqlite3_column_int64(stmt, 0);
+    }
+    sqlite3_finalize(stmt);
+    return rc == SQLITE_DONE ? count : -1;
+}
 
-    if (sqlite3_prepare_v2(db, fetch_sql, -1, &fetch_stmt, 0) == SQLITE_OK) {
-        sqlite3_bind_text(fetch_stmt, 1, nid, -1, SQLITE_STATIC);
-        if (sqlite3_step(fetch_stmt) == SQLITE_ROW) {
-            
-            strncpy(existing.nid, (const char*)sqlite3_column_text(fetch_stmt, 0), 20);
-            strncpy(existing.name, (const char*)sqlite3_column_text(fetch_stmt, 1), MAX_NAME);
-            strncpy(existing.dob, (const char*)sqlite3_column_text(fetch_stmt, 2), 11);
-            strncpy(existing.gender, (const char*)sqlite3_column_text(fetch_stmt, 3), 10);
-            strncpy(existing.address, (const char*)sqlite3_column_text(fetch_stmt, 4), MAX_ADDRESS);
-            strncpy(existing.father_name, (const char*)sqlite3_column_text(fetch_stmt, 5), MAX_NAME);
-            strncpy(existing.mother_name, (const char*)sqlite3_column_text(fetch_stmt, 6), MAX_NAME);
-            strncpy(existing.blood_group, (const char*)sqlite3_column_text(fetch_stmt, 7), 4);
-            existing.is_active = sqlite3_column_int(fetch_stmt, 8);
-            existing.created_at = (time_t)sqlite3_column_int64(fetch_stmt, 9);
-            existing.last_modified = (time_t)sqlite3_column_int64(fetch_stmt, 10);
-            found = 1;
-        }
-        sqlite3_finalize(fetch_stmt);
-    }
-
-    if (!found) {
-        printf("Citizen with NID %s not found!\n", nid);
-        return;
+// A write to a sharded citizen commits the row in its shard, and its blocking keys,
+// review entries and change feed entry in the main file. SQLite commits each file
+// of a transaction on its own, so a crash between the two (or a power loss with
+// synchronous=NORMAL) can keep one half. The change triggers stamp both files with
+// the feed number of the shard's latest write; at startup, for a shard whose stamps
+// differ, each citizen the lost half touched is filed again under its blocking keys
+// as the row now stands, and fed as a new change so replicas fetch it again.
+int reconcile_shards() {
+    if (!db_shards) {
+        return 1;
     }
+    // Under the write lock no other commit is half done
+    int ok = sqlite3_exec(db, "BEGIN IMMEDIATE;", 0, 0, 0) == SQLITE_OK;
+    for (int i = 0; ok && i < db_shards; i++) {
+        char sql[512];
+        sqlite3_stmt *stmt;
+        snprintf(sql, sizeof(sql), "SELECT (SELECT seq FROM main.commit_marks WHERE shard = %d), "
+                                   "(SELECT marked_at FROM main.commit_marks WHERE shard = %d), "
+                                   "(SELECT seq FROM %s.commit_mark_%d);", i, i, shard_schemas[i], i);
+        sqlite3_int64 seq[2] = {0, 0}, main_marked = 0;
+        ok = sqlite3_prepare_v2(db, sql, -1, &stmt, 0) == SQLITE_OK;
+        if (ok && sqlite3_step(stmt) == SQLITE_ROW) {
+            seq[0] = sqlite3_column_int64(stmt, 0);
+            main_marked = sqlite3_column_int64(stmt, 1);
+            seq[1] = sqlite3_column_int64(stmt, 2);
+        }
+        sqlite3_finalize(stmt);
+        stmt = NULL;
+        if (!ok || seq[0] == seq[1]) continue;
 
-    // Copy existing data to retain NID and creation time
-    Citizen updated = existing;
-
-    printf("Enter new details for citizen with NID %s:\n", nid);
-    input_citizen(&updated, 0); 
-    // Prepare SQL statement
-    char *update_sql = "UPDATE citizens SET "
-                      "name = ?, dob = ?, gender = ?, address = ?, "
-                      "father_name = ?, mother_name = ?, blood_group = ?, "
-                      "is_active = ?, last_modified = ? "
-                      "WHERE nid = ?;";
-    sqlite3_stmt *update_stmt;
-
-    if (sqlite3_prepare_v2(db, update_sql, -1, &update_stmt, 0) == SQLITE_OK) {
-        sqlite3_bind_text(update_stmt, 1, updated.name, -1, SQLITE_STATIC);
-        sqlite3_bind_text(update_stmt, 2, updated.dob, -1, SQLITE_STATIC);
-        sqlite3_bind_text(update_stmt, 3, updated.gender, -1, SQLITE_STATIC);
-        sqlite3_bind_text(update_stmt, 4, updated.address, -1, SQLITE_STATIC);
-        sqlite3_bind_text(update_stmt, 5, updated.father_name, -1, SQLITE_STATIC);
-        sqlite3_bind_text(update_stmt, 6, updated.mother_name, -1, SQLITE_STATIC);
-        sqlite3_bind_text(update_stmt, 7, updated.blood_group, -1, SQLITE_STATIC);
-        sqlite3_bind_int(update_stmt, 8, updated.is_active);
-        sqlite3_bind_int64(update_stmt, 9, (sqlite3_int64)updated.last_modified);
-        sqlite3_bind_text(update_stmt, 10, nid, -1, SQLITE_STATIC); // Use original NID for WHERE
-
-        if (sqlite3_step(update_stmt) == SQLITE_DONE) {
-            printf("Citizen updated successfully!\n");
-            // Log activity...
-        } else {
-            printf("Failed to update citizen!\n");
+        const char *ahead = seq[0] > seq[1] ? "main file" : "shard file";
+        sqlite3_int64 *keys = NULL;
+        long count = collect_torn_citizens(i, seq, main_marked, &keys);
+        ok = count >= 0 && sqlite3_prepare_v2(db, "INSERT INTO citizen_changes (op, nid, changed_at) VALUES (?, ?, ?);",
+                                              -1, &stmt, 0) == SQLITE_OK;
+        char details[64];
+        snprintf(details, sizeof(details), "write committed only in the %s", ahead);
+        for (long k = 0; ok && k < count; k++) {
+            Citizen c;
+            char nid[20];
+            format_nid(keys[k], nid);
+            int live = find_citizen(nid, &c);
+            ok = drop_duplicate_blocks(keys[k], !live) && (!live || index_duplicates(&c, NULL) >= 0);
+            sqlite3_bind_int(stmt, 1, live ? 2 : 3);
+            sqlite3_bind_int64(stmt, 2, keys[k]);
+            sqlite3_bind_int64(stmt, 3, (sqlite3_int64)time(NULL));
+            ok = ok && sqlite3_step(stmt) == SQLITE_DONE;
+            sqlite3_reset(stmt);
+            if (ok) audit_log_details(nid, "RECONCILED", details);
+        }
+        sqlite3_finalize(stmt);
+        free(keys);
+        snprintf(sql, sizeof(sql), "INSERT OR REPLACE INTO main.commit_marks VALUES (%d, (SELECT COALESCE(max(seq), 0) "
+                                   "FROM main.citizen_changes), CAST(strftime('%%s', 'now') AS INTEGER)); "
+                                   "INSERT OR REPLACE INTO %s.commit_mark_%d SELECT 0, seq FROM main.commit_marks "
+                                   "WHERE shard = %d;", i, shard_schemas[i], i, i);
+        ok = ok && sqlite3_exec(db, sql, 0, 0, 0) == SQLITE_OK;
+        if (ok) {
+            fprintf(stderr, "Shards: the last write to %s committed only in the %s; re-filed %ld citizens\n",
+                    shard_schemas[i], ahead, count);
         }
-        sqlite3_finalize(update_stmt);
-    } else {
-        printf("Update failed!\n");
     }
+    if (!ok || sqlite3_exec(db, "COMMIT;", 0, 0, 0) != SQLITE_OK) {
+        fprintf(stderr, "Shards: reconciling the shard files failed: %s\n", sqlite3_errmsg(db));
+        sqlite3_exec(db, "ROLLBACK;", 0, 0, 0);
+        ok = 0;
+    }
+    return ok;
 }
-void admin_delete_citizen() {
-    char nid[20];
-    printf("Enter NID to delete: ");
-    scanf("%19s", nid);
-    clear_input_buffer();
-    
-    char *delete_sql = "DELETE FROM citizens WHERE nid = ?;";
-    sqlite3_stmt *delete_stmt;
-    
-    if(sqlite3_prepare_v2(db, delete_sql, -1, &delete_stmt, 0) == SQLITE_OK) {
-        sqlite3_bind_text(delete_stmt, 1, nid, -1, SQLITE_STATIC);
-        
-        if(sqlite3_step(delete_stmt) == SQLITE_DONE) {
-            printf("Citizen with NID %s deleted successfully!\n", nid);
-            
-            // Log deletion activity
-            char *log_sql = "INSERT INTO audit_logs (nid, timestamp, activity_type) VALUES (?,?,?);";
-            sqlite3_stmt *log_stmt;
-            if(sqlite3_prepare_v2(db, log_sql, -1, &log_stmt, 0) == SQLITE_OK) {
-                sqlite3_bind_text(log_stmt, 1, nid, -1, SQLITE_STATIC);
-                sqlite3_bind_int64(log_stmt, 2, (sqlite3_int64)time(NULL));
-                sqlite3_bind_text(log_stmt, 3, "DELETED", -1, SQLITE_STATIC);
-                sqlite3_step(log_stmt);
-                sqlite3_finalize(log_stmt);
-            }
+
+// Moves every citizen into count shard files, or back into the main file when count
+// is 0. The new files are filled first and the switch is one commit of the shard
+// count, so an interrupted run leaves the old layout in use; the old files are
+// deleted afterwards. Nothing else may have the database open meanwhile: the run
+// holds an exclusive lock on the main file and every shard throughout, and gives
+// up before changing anything if another connection has any of them open.
+int rebalance_shards(int count) {
+    if (count < 0 || count > DB_MAX_SHARDS) {
+        fprintf(stderr, "Shard count must be between 0 and %d\n", DB_MAX_SHARDS);
+        return 0;
+    }
+    if (count == db_shards) {
+        fprintf(stderr, "Citizens are already in %d shards\n", count);
+        return 1;
+    }
+    // This process's own login and audit connections would hold the files open too
+    auth_stop();
+    audit_stop();
+    if (sqlite3_exec(db, "PRAGMA locking_mode = EXCLUSIVE; BEGIN EXCLUSIVE; COMMIT;", 0, 0, 0) != SQLITE_OK) {
+        fprintf(stderr, "Rebalance: the database is in use elsewhere (%s); stop other users and retry\n",
+                sqlite3_errmsg(db));
+        sqlite3_exec(db, "ROLLBACK; PRAGMA locking_mode = NORMAL; BEGIN IMMEDIATE; COMMIT;", 0, 0, 0);
+        return 0;
+    }
+    long long started = now_ns();
+    long moved = 0;
+    char path[1024], sql[1200];
+    int ok = 1;
+    drop_change_triggers(db);      // moving a citizen does not change it
+    for (int i = 0; ok && i < count; i++) {
+        shard_path(i, count, path, sizeof(path));
+        remove_database_files(path);        // left by an interrupted run
+        sqlite3_snprintf(sizeof(sql), sql, "ATTACH %Q AS rebalance;", path);
+        if (!init_shard(path, 1) || sqlite3_exec(db, sql, 0, 0, 0) != SQLITE_OK) {
+            fprintf(stderr, "Rebalance: cannot create %s: %s\n", path, sqlite3_errmsg(db));
+            ok = 0;
+            break;
+        }
+        snprintf(sql, sizeof(sql), "INSERT INTO rebalance.citizens SELECT * FROM citizens WHERE nid %% %d = %d;", count, i);
+        ok = sqlite3_exec(db, "BEGIN IMMEDIATE;", 0, 0, 0) == SQLITE_OK &&
+             (!pii_encryption || drop_plaintext_indexes("rebalance")) &&
+             sqlite3_exec(db, sql, 0, 0, 0) == SQLITE_OK;
+        moved += ok ? sqlite3_changes(db) : 0;
+        if (!ok || sqlite3_exec(db, "COMMIT;", 0, 0, 0) != SQLITE_OK) {
+            fprintf(stderr, "Rebalance: filling %s failed: %s\n", path, sqlite3_errmsg(db));
+            sqlite3_exec(db, "ROLLBACK;", 0, 0, 0);
+            ok = 0;
+        }
+        sqlite3_exec(db, "DETACH rebalance;", 0, 0, 0);
+    }
+
+    // Rows moving back into (or out of) the main file go in the switch's transaction
+    if (ok) {
+        if (count) {
+            snprintf(sql, sizeof(sql), "INSERT OR REPLACE INTO settings VALUES ('citizen_shards', %d);", count);
         } else {
-            printf("Failed to delete citizen!\n");
+            snprintf(sql, sizeof(sql), "DELETE FROM settings WHERE key = 'citizen_shards';");
         }
-        sqlite3_finalize(delete_stmt);
-    } else {
-        printf("Delete failed!\n");
+        ok = sqlite3_exec(db, "BEGIN IMMEDIATE;", 0, 0, 0) == SQLITE_OK;
+        if (ok && !count) {
+            ok = sqlite3_exec(db, "INSERT INTO main.citizens SELECT * FROM citizens;", 0, 0, 0) == SQLITE_OK;
+            moved = sqlite3_changes(db);
+        }
+        ok = ok && (db_shards || sqlite3_exec(db, "DELETE FROM main.citizens;", 0, 0, 0) == SQLITE_OK) &&
+             sqlite3_exec(db, "DELETE FROM main.commit_marks;", 0, 0, 0) == SQLITE_OK &&    // stamps of the old files
+             sqlite3_exec(db, sql, 0, 0, 0) == SQLITE_OK;
+        if (!ok || sqlite3_exec(db, "COMMIT;", 0, 0, 0) != SQLITE_OK) {
+            fprintf(stderr, "Rebalance: switching to %d shards failed: %s\n", count, sqlite3_errmsg(db));
+            sqlite3_exec(db, "ROLLBACK;", 0, 0, 0);
+            ok = 0;
+        }
+    }
+    if (!ok) {
+        for (int i = 0; i < count; i++) {
+            shard_path(i, count, path, sizeof(path));
+            remove_database_files(path);
+        }
+        create_change_triggers(db);
+        sqlite3_exec(db, "PRAGMA locking_mode = NORMAL; BEGIN IMMEDIATE; COMMIT;", 0, 0, 0);
+        return 0;
     }
+
+    int old_count = db_shards;
+    finalize_statements();
+    detach_shards(db);
+    db_shards = count;
+    for (int i = 0; i < old_count; i++) {
+        shard_path(i, old_count, path, sizeof(path));
+        remove_database_files(path);
+    }
+    // The rows that left the main file would otherwise stay as free pages
+    if (!old_count && sqlite3_exec(db, "VACUUM main;", 0, 0, 0) != SQLITE_OK) {
+        fprintf(stderr, "Rebalance: VACUUM failed: %s\n", sqlite3_errmsg(db));
+    }
+    fprintf(stderr, "Rebalanced %ld citizens %s %d shards in %.2fs\n", moved,
+            count ? "into" : "out of", count ? count : old_count, (now_ns() - started) / 1e9);
+    ok = attach_shards(db) && create_change_triggers(db) && prepare_statements();
+    sqlite3_exec(db, "PRAGMA locking_mode = NORMAL; BEGIN IMMEDIATE; COMMIT;", 0, 0, 0);
+    return ok;
 }
 
-void admin_view_audit_logs() {
-    char *sql = "SELECT nid, timestamp, activity_type FROM audit_logs ORDER BY timestamp DESC;";
-    sqlite3_stmt *stmt;
-    
-    if(sqlite3_prepare_v2(db, sql, -1, &stmt, 0) == SQLITE_OK) {
-        printf("\nAudit Logs:\n");
-        printf("----------------------------------------\n");
-        while(sqlite3_step(stmt) == SQLITE_ROW) {
-            const char *nid = (const char*)sqlite3_column_text(stmt, 0);
-            time_t timestamp = (time_t)sqlite3_column_int64(stmt, 1);
-            const char *activity = (const char*)sqlite3_column_text(stmt, 2);
-            
-            printf("NID: %s\nActivity: %s\nTime: %s\n", 
-                   nid, activity, ctime(&timestamp));
-            printf("----------------------------------------\n");
-        }
-        sqlite3_finalize(stmt);
-    } else {
-        printf("Failed to fetch audit logs!\n");
+// Flushes pending audit events before the connections go away
+void close_db() {
+    auth_stop();
+    audit_stop();
+    close_connection();
+    close_nid_allocator();
+    cache_free();
+}
+
+// Non-interactive modes take the username from --user and the password from NID_PASSWORD
+int authenticate_cli(const char *username) {
+    const char *password = getenv("NID_PASSWORD");
+    if (!username || !password) {
+        fprintf(stderr, "Non-interactive mode requires --user and the NID_PASSWORD environment variable\n");
+        return 0;
     }
+    if (!authenticate_user(username, password)) {
+        fprintf(stderr, "Authentication failed!\n");
+        return 0;
+    }
+    return 1;
 }
 
-void admin_menu() {
-    int running = 1;
-    while(running) {
-        printf("\nADMIN PANEL\n");
-        printf("1. Register Citizen\n");
-        printf("2. View Citizens\n");
-        printf("3. Search Citizen\n");
-        printf("4. Update Citizen\n");
-        printf("5. Delete Citizen\n");
-        printf("6. View Audit Logs\n");
-        printf("7. Logout\n");
-        printf("Choice: ");
+void print_usage(const char *prog) {
+    fprintf(stderr,
+            "Usage: %s                                  interactive menu\n"
+            "       %s --import <file|-> --user <name> [--batch-size N]\n"
+            "                                             bulk import CSV/TSV rows:\n"
+            "                                             name,dob,gender,address,father_name,mother_name,blood_group\n"
+            "       %s --dump <file|-> --user <name>\n"
+            "                                             stream all citizens as tab-separated lines\n"
+            "       %s --export <dir> --user <name> [--format csv|ndjson|bin] [--shards N] [--compress]\n"
+            "                                             parallel export by NID range, with manifest.json\n"
+            "       %s --archive-audit <dir> --user <name> [--keep-months N]\n"
+            "                                             move audit months older than N (default 12) to gzip files\n"
+            "       %s --bench-login <count> --user <name>\n"
+            "                                             measure login throughput through the PBKDF2 pool\n"
+            "       %s --bench <rows> [--bench-ops N] [--bench-out file] [--bench-db path [--force]] [--seed N]\n"
+            "                                             time register/search/update/view/audit/delete on a\n"
+            "                                             scratch database of synthetic citizens (rows: 10K, 1M, 10M);\n"
+            "                                             --force replaces an existing scratch database\n"
+            "       %s --backup <dir> --user <name> [--backup-keep N] [--backup-pages N]\n"
+            "                                             online snapshot, verified, keeping the newest N (default 7)\n"
+            "       %s --statistics [rebuild] --user <name>\n"
+            "                                             citizen head counts by gender, blood group, birth decade\n"
+            "                                             and status; rebuild recounts them in parallel to check\n"
+            "       %s --batch <file|-> --user <name> [--batch-size N]\n"
+            "                                             run server requests, one tab-separated line each,\n"
+            "                                             committing up to N (default %d) consecutive writes\n"
+            "                                             together; one JSON reply line each on stdout\n"
+            "       %s --changes <seq|-> --user <name> [--consumer <name>] [--batch-size N]\n"
+            "                                             print the changes numbered after seq (-: after the\n"
+            "                                             consumer's acknowledgement), acknowledging each batch\n"
+            "                                             for the consumer; --forget-consumer <name> drops one\n"
+            "       %s --rebalance <N> --user <name>\n"
+            "                                             spread citizens over N shard files by NID (0: one file);\n"
+            "                                             run while nothing else uses the database\n"
+            "       %s --purge --user <name> [--retention-days N]\n"
+            "                                             remove citizens deleted more than N days ago (default %d)\n"
+            "                                             and return the freed space to the file system\n"
+            "       %s --server <socket> --user <name> [--workers N] [--backup <dir> --backup-every MINUTES]\n"
+            "                                             [--purge-every MINUTES] [--retention-days N]\n"
+            "                                             serve requests on a Unix domain socket, purging\n"
+            "                                             deleted citizens hourly by default (0: never)\n"
+            "       %s --client <socket> <COMMAND> [fields...]\n"
+            "                                             send one request to a running server\n"
+            "Any mode also takes --cache-mb N (default 64, 0 disables the citizen lookup cache).\n"
+            "Set NID_DATA_KEY (64 hex digits) to store names and addresses encrypted.\n",
+            prog, prog, prog, prog, prog, prog, prog, prog, prog, prog, BATCH_DEFAULT_GROUP, prog, prog, prog,
+            PURGE_RETENTION_DAYS, prog, prog);
+}
 
-        int choice;
-        scanf("%d", &choice);
-        clear_input_buffer();
+int main(int argc, char **argv) { 
+    const char *import_path = NULL, *cli_user = NULL, *server_path = NULL, *dump_path = NULL;
+    const char *archive_dir = NULL, *export_dir = NULL, *backup_dir = NULL;
+    ExportFormat export_format = EXPORT_CSV;
+    int export_compress = 0;
+    int keep_months = ARCHIVE_KEEP_MONTHS;
+    int bench_login_count = 0;
+    long bench_rows = 0;
+    int bench_ops = BENCH_DEFAULT_OPS;
+    const char *bench_out = NULL, *bench_db = "nid-bench.db";
+    int force = 0;
+    uint64_t seed = 1;
+    int cache_mb = CACHE_DEFAULT_MB;
+    int batch_size = 0;         // mode's default
+    int workers = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    int shards = workers;
+    int rebalance = -1;
+    int statistics = 0;         // 1: report, 2: recount and report
+    const char *changes_since = NULL, *consumer = NULL, *forget_consumer = NULL;
+    const char *batch_path = NULL;
+    int purge = 0;
+    if (argc >= 3 && strcmp(argv[1], "--client") == 0) {
+        return run_client(argv[2], argc - 3, argv + 3) ? 0 : 1;
+    }
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--import") == 0 && i + 1 < argc) {
+            import_path = argv[++i];
+        } else if (strcmp(argv[i], "--archive-audit") == 0 && i + 1 < argc) {
+            archive_dir = argv[++i];
+        } else if (strcmp(argv[i], "--keep-months") == 0 && i + 1 < argc) {
+            keep_months = atoi(argv[++i]);
+            if (keep_months < 0) keep_months = 0;
+        } else if (strcmp(argv[i], "--bench-login") == 0 && i + 1 < argc) {
+            bench_login_count = atoi(argv[++i]);
+            if (bench_login_count < 1) bench_login_count = 1;
+        } else if (strcmp(argv[i], "--bench") == 0 && i + 1 < argc) {
+            bench_rows = parse_scale(argv[++i]);
+            if (!bench_rows) {
+                print_usage(argv[0]);
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--bench-ops") == 0 && i + 1 < argc) {
+            bench_ops = atoi(argv[++i]);
+            if (bench_ops < 1) bench_ops = 1;
+        } else if (strcmp(argv[i], "--bench-out") == 0 && i + 1 < argc) {
+            bench_out = argv[++i];
+        } else if (strcmp(argv[i], "--bench-db") == 0 && i + 1 < argc) {
+            bench_db = argv[++i];
+        } else if (strcmp(argv[i], "--force") == 0) {
+            force = 1;
+        } else if (strcmp(argv[i], "--seed") == 0 && i + 1 < argc) {
+            seed = strtoull(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "--cache-mb") == 0 && i + 1 < argc) {
+            cache_mb = atoi(argv[++i]);
+            if (cache_mb < 0) cache_mb = 0;
+        } else if (strcmp(argv[i], "--dump") == 0 && i + 1 < argc) {
+            dump_path = argv[++i];
+        } else if (strcmp(argv[i], "--export") == 0 && i + 1 < argc) {
+            export_dir = argv[++i];
+        } else if (strcmp(argv[i], "--format") == 0 && i + 1 < argc) {
+            i++;
+            if (strcmp(argv[i], "csv") == 0) export_format = EXPORT_CSV;
+            else if (strcmp(argv[i], "ndjson") == 0) export_format = EXPORT_NDJSON;
+            else if (strcmp(argv[i], "bin") == 0) export_format = EXPORT_BINARY;
+            else {
+                print_usage(argv[0]);
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--shards") == 0 && i + 1 < argc) {
+            shards = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--compress") == 0) {
+            export_compress = 1;
+        } else if (strcmp(argv[i], "--backup") == 0 && i + 1 < argc) {
+            backup_dir = argv[++i];
+        } else if (strcmp(argv[i], "--backup-every") == 0 && i + 1 < argc) {
+            backup_schedule.interval_s = atoi(argv[++i]) * 60;
+        } else if (strcmp(argv[i], "--backup-keep") == 0 && i + 1 < argc) {
+            backup_schedule.keep = atoi(argv[++i]);
+            if (backup_schedule.keep < 1) backup_schedule.keep = 1;
+        } else if (strcmp(argv[i], "--backup-pages") == 0 && i + 1 < argc) {
+            backup_pages_per_step = atoi(argv[++i]);
+            if (backup_pages_per_step < 1) backup_pages_per_step = 1;
+        } else if (strcmp(argv[i], "--statistics") == 0) {
+            statistics = 1;
+            if (i + 1 < argc && strcmp(argv[i + 1], "rebuild") == 0) {
+                statistics = 2;
+                i++;
+            }
+        } else if (strcmp(argv[i], "--batch") == 0 && i + 1 < argc) {
+            batch_path = argv[++i];
+        } else if (strcmp(argv[i], "--changes") == 0 && i + 1 < argc) {
+            changes_since = argv[++i];
+        } else if (strcmp(argv[i], "--consumer") == 0 && i + 1 < argc) {
+            consumer = argv[++i];
+        } else if (strcmp(argv[i], "--forget-consumer") == 0 && i + 1 < argc) {
+            forget_consumer = argv[++i];
+        } else if (strcmp(argv[i], "--purge") == 0) {
+            purge = 1;
+        } else if (strcmp(argv[i], "--purge-every") == 0 && i + 1 < argc) {
+            purge_schedule.interval_s = atoi(argv[++i]) * 60;
+        } else if (strcmp(argv[i], "--retention-days") == 0 && i + 1 < argc) {
+            purge_schedule.retention_days = atoi(argv[++i]);
+            if (purge_schedule.retention_days < 0) purge_schedule.retention_days = 0;
+        } else if (strcmp(argv[i], "--rebalance") == 0 && i + 1 < argc) {
+            rebalance = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--server") == 0 && i + 1 < argc) {
+            server_path = argv[++i];
+        } else if (strcmp(argv[i], "--workers") == 0 && i + 1 < argc) {
+            workers = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--user") == 0 && i + 1 < argc) {
+            cli_user = argv[++i];
+        } else if (strcmp(argv[i], "--batch-size") == 0 && i + 1 < argc) {
+            batch_size = atoi(argv[++i]);
+            if (batch_size < 1) batch_size = 1;
+        } else {
+            print_usage(argv[0]);
+            return 1;
+        }
+    }
 
-        switch(choice) {
-            case 1: admin_register_citizen(); break;
-            case 2: admin_view_citizens(); break;
-            case 3: admin_search_citizen(); break;
-            case 4: admin_update_citizen(); break;
-            case 5: admin_delete_citizen(); break;
-            case 6: admin_view_audit_logs(); break;
-            case 7: running = 0; break;
-            default: printf("Invalid choice!\n");
+    if (bench_rows) {
+        // Always a fresh database, so runs are comparable
+        if (!check_bench_path(bench_db, force)) {
+            return 1;
         }
+        remove_database_files(bench_db);
+        DB_NAME = (char*)bench_db;
     }
-}
 
-// ================== MAIN PROGRAM ==================
-int main() { 
-    if(!init_db()) { 
+    cache_init(cache_mb);
+    if(!init_db() || !prepare_statements() || !init_nid_allocator()) { 
         fprintf(stderr, "Failed to initialize database!\n"); 
         return 1; 
     }  
+    if (!setup_field_encryption() || !build_duplicate_blocks() || !reconcile_shards()) {
+        close_db();
+        return 1;
+    }
     OpenSSL_add_all_algorithms();  
-    char *check_admin = "SELECT COUNT(*) FROM users WHERE username = 'pub22$';";
-    sqlite3_stmt *stmt; 
-    int admin_exists = 0; 
-    if(sqlite3_prepare_v2(db, check_admin, -1, &stmt, 0) == SQLITE_OK)  {
-        if(sqlite3_step(stmt) == SQLITE_ROW)  {
-            admin_exists = sqlite3_column_int(stmt, 0); 
-        } 
-        sqlite3_finalize(stmt); 
-    } 
-    if(!admin_exists) {
-        SystemUser  admin; 
-        strcpy(admin.username, "pub22$");
-        generate_salt(admin.salt);  
-        derive_key("Pubcse22$", admin.salt,admin.password_hash);
-        admin.role = ADMIN;
-        admin.failed_attempts = 0;
-        admin.last_login = 0;
-        char *insert_sql = "INSERT  INTO users VALUES (?,?,?,?,?,?);";
-        if(sqlite3_prepare_v2(db, insert_sql, -1, &stmt, 0) ==  SQLITE_OK) {
-            sqlite3_bind_text(stmt, 1, admin.username, -1, SQLITE_STATIC);
-            sqlite3_bind_blob(stmt, 2, admin.password_hash, SHA256_DIGEST_LENGTH, SQLITE_STATIC);
-            sqlite3_bind_blob(stmt, 3, admin.salt, SALT_LEN, SQLITE_STATIC);
-            sqlite3_bind_int(stmt, 4, admin.role);
-            sqlite3_bind_int(stmt, 5, admin.failed_attempts);
-            sqlite3_bind_int64(stmt, 6, admin.last_login);
-            sqlite3_step(stmt);
-            sqlite3_finalize(stmt);
-            printf("Admin user created with password 'adminpass'\n");
+    if (!bench_rows) ensure_admin_user();  // the scratch database needs no login
+    audit_start();
+    if (workers < 1) workers = 1;
+    if (!auth_start((int)sysconf(_SC_NPROCESSORS_ONLN))) {
+        fprintf(stderr, "Login pool unavailable, checking passwords inline\n");
+    }
+
+    if (server_path) {
+        backup_schedule.dir = backup_dir;
+        int ok = authenticate_cli(cli_user) && run_server(server_path, workers);
+        close_db();
+        EVP_cleanup();
+        return ok ? 0 : 1;
+    }
+
+    if (bench_rows) {
+        FILE *out = bench_out ? fopen(bench_out, "w") : stdout;
+        int ok = 0;
+        if (!out) {
+            perror(bench_out);
+        } else {
+            ok = run_benchmark(bench_rows, bench_ops, seed, out);
+            if (out != stdout) fclose(out);
+        }
+        close_db();
+        EVP_cleanup();
+        remove_database_files(DB_NAME);
+        return ok ? 0 : 1;
+    }
+
+    if (bench_login_count) {
+        int ok = authenticate_cli(cli_user) && bench_logins(cli_user, getenv("NID_PASSWORD"), bench_login_count);
+        close_db();
+        EVP_cleanup();
+        return ok ? 0 : 1;
+    }
+
+    if (backup_dir) {
+        // WAL lets officers keep writing while the snapshot is copied
+        int ok = authenticate_cli(cli_user) && exec_sql("PRAGMA journal_mode=WAL;") &&
+                 backup_database(backup_dir, backup_schedule.keep);
+        close_db();
+        EVP_cleanup();
+        return ok ? 0 : 1;
+    }
+
+    if (statistics) {
+        StatsFilter all = {-1, -1, -1, -1};
+        Buffer report = {0};
+        int ok = authenticate_cli(cli_user) && (statistics == 1 || rebuild_statistics(workers)) &&
+                 citizen_statistics(&all, &report);
+        if (ok && report.len) printf("%s\n", report.data + 1);
+        buf_free(&report);
+        close_db();
+        EVP_cleanup();
+        return ok ? 0 : 1;
+    }
+
+    if (batch_path) {
+        int ok = 0;
+        if (authenticate_cli(cli_user)) {
+            FILE *in = strcmp(batch_path, "-") == 0 ? stdin : fopen(batch_path, "r");
+            if (!in) {
+                perror(batch_path);
+            } else {
+                ok = run_batch(in, STDOUT_FILENO, batch_size ? batch_size : BATCH_DEFAULT_GROUP);
+                if (in != stdin) fclose(in);
+            }
+        }
+        close_db();
+        EVP_cleanup();
+        return ok ? 0 : 1;
+    }
+
+    if (changes_since || forget_consumer) {
+        int ok = authenticate_cli(cli_user);
+        if (ok && forget_consumer) {
+            ok = ack_changes(forget_consumer, -1) >= 0;
+            if (!ok) fprintf(stderr, "Changes: cannot drop consumer: %s\n", sqlite3_errmsg(db));
+        }
+        if (ok && changes_since) {
+            sqlite3_int64 since = strcmp(changes_since, "-") == 0 ? -1 : strtoll(changes_since, NULL, 10);
+            ok = stream_changes(since, consumer, batch_size, STDOUT_FILENO);
+        }
+        close_db();
+        EVP_cleanup();
+        return ok ? 0 : 1;
+    }
+
+    if (purge) {
+        int ok = authenticate_cli(cli_user) && purge_tombstones(purge_schedule.retention_days, 1);
+        close_db();
+        EVP_cleanup();
+        return ok ? 0 : 1;
+    }
+
+    if (rebalance >= 0) {
+        int ok = authenticate_cli(cli_user) && rebalance_shards(rebalance);
+        close_db();
+        EVP_cleanup();
+        return ok ? 0 : 1;
+    }
+
+    if (archive_dir) {
+        int ok = authenticate_cli(cli_user) && archive_audit_logs(archive_dir, keep_months);
+        close_db();
+        EVP_cleanup();
+        return ok ? 0 : 1;
+    }
+
+    if (dump_path) {
+        int ok = 0;
+        if (authenticate_cli(cli_user)) {
+            int fd = strcmp(dump_path, "-") == 0 ? STDOUT_FILENO : open(dump_path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+            if (fd < 0) {
+                perror(dump_path);
+            } else {
+                ok = dump_citizens(fd);
+                if (fd != STDOUT_FILENO) close(fd);
+            }
+        }
+        close_db();
+        EVP_cleanup();
+        return ok ? 0 : 1;
+    }
+
+    if (export_dir) {
+        int ok = authenticate_cli(cli_user) && export_citizens(export_dir, export_format, shards, export_compress);
+        close_db();
+        EVP_cleanup();
+        return ok ? 0 : 1;
+    }
+
+    if (import_path) {
+        int ok = 0;
+        if (authenticate_cli(cli_user)) {
+            FILE *in = strcmp(import_path, "-") == 0 ? stdin : fopen(import_path, "r");
+            if (!in) {
+                perror(import_path);
+            } else {
+                ok = import_citizens(in, batch_size ? batch_size : IMPORT_BATCH_SIZE);
+                if (in != stdin) fclose(in);
+            }
         }
+        close_db();
+        EVP_cleanup();
+        return ok ? 0 : 1;
     }
+
     int running = 1;
     while(running) {
         printf("\nNATIONAL ID MANAGEMENT SYSTEM\n");
@@ -571,9 +7758,19 @@ int main() {
             printf("Password: ");
             fgets(password, sizeof(password), stdin);
             password[strcspn(password, "\n")] = '\0';
-            if(authenticate_user(username, password)) {
+            AuthJob job = {0};
+            job.username = username;
+            job.password = password;
+            int result = auth_submit(&job);
+            if(result == AUTH_OK) {
                 printf("Login successful!\n");
+                if (job.last_login) printf("Last login: %s", ctime(&job.last_login));
+                if (job.failed_attempts) printf("%d failed attempt(s) since then.\n", job.failed_attempts);
+                issue_session(username, cli_session);
                 admin_menu();
+                memset(cli_session, 0, sizeof(cli_session));
+            } else if(result == AUTH_BUSY) {
+                printf("Login service busy, try again.\n");
             } else {
                 printf("Authentication failed!\n"); }
         } else if(choice == 2) {
@@ -581,7 +7778,7 @@ int main() {
         } else {
             printf("Invalid choice!\n");} 
     } 
-    sqlite3_close(db);
+    close_db();
     EVP_cleanup();
     return 0;
 } 